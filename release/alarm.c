@@ -2,123 +2,690 @@
 #include <stdio.h>
 
 #include "alarm.h"
+#include "minithread.h"
+#include "synch.h"
 
-queue_t alarm_queue = NULL; // Queue containing alarms (soonest deadline at head of queue)
+/*
+ * Alarms are kept on a hierarchical timing wheel. Time is counted in ticks of
+ * ALARM_WHEEL_RESOLUTION, and level l has ALARM_WHEEL_SLOTS slots that each span
+ * ALARM_WHEEL_SLOTS^l ticks. A pending alarm sits on the lowest level whose turn
+ * covers its tick; whenever a level wraps around, the next slot of the level above
+ * is cascaded down. Registering, unregistering and expiring an alarm are therefore
+ * O(1), and a bitmap of occupied slots per level lets idle stretches be skipped.
+ *
+ * The wheel is turned up to the tick now falls in, so alarms go off at their exact
+ * deadlines rather than at tick boundaries: those of the current tick that are not
+ * yet due wait on alarm_near, which is checked against the time on every firing.
+ *
+ * To bound the time spent with interrupts disabled, the clock handler executes only
+ * a few handlers per interrupt, and none of deferred alarms: those are queued on
+ * alarm_deferred for the softirq thread, which executes them with interrupts enabled.
+ *
+ * An alarm with slack goes off at the latest time in its window [nominal, nominal + slack]
+ * that is a multiple of the largest power of two no greater than the slack. Alarms whose
+ * windows overlap thus tend to share a deadline, and go off with a single clock interrupt.
+ * Others whose nominal deadline has passed by then go off with them too if they wait on
+ * alarm_near; those still on the wheel keep their own deadline.
+ */
+
+#define ALARM_WHEEL_MASK (ALARM_WHEEL_SLOTS - 1)
+#define ALARM_WHEEL_SPAN (1ULL << (ALARM_WHEEL_BITS * ALARM_WHEEL_LEVELS)) // Ticks covered by the whole wheel
+
+/* Values of level for an alarm not on the wheel */
+#define ALARM_EXPIRED -1 // Due, and waiting on alarm_expired to be executed
+#define ALARM_PARKED -2 // Allocated, but not scheduled
+#define ALARM_NEAR -3 // Due within the tick the wheel has reached, and waiting on alarm_near
+#define ALARM_QUEUED -4 // Due, and waiting on alarm_deferred to be executed by the softirq thread
+
+static list_t alarm_wheel[ALARM_WHEEL_LEVELS][ALARM_WHEEL_SLOTS]; // Pending alarms
+static unsigned long long alarm_occupied[ALARM_WHEEL_LEVELS]; // Bit s set if slot s of a level is nonempty
+static unsigned long long alarm_wheel_tick = 0; // Every alarm due at or before this tick is off the wheel
+static int alarm_pending = 0; // Alarms on the wheel
+static list_t alarm_near = {NULL, NULL, 0}; // Alarms off the wheel but not yet due
+static list_t alarm_expired = {NULL, NULL, 0}; // Alarms due but not yet executed
+static list_t alarm_deferred = {NULL, NULL, 0}; // Deferred alarms due but not yet executed
+
+static unsigned long long alarm_next = 0; // What alarm_next_deadline returns, while alarm_next_valid
+static int alarm_next_valid = 0; // Cleared whenever alarm_next may no longer be the soonest
+
+static alarm_t alarm_running = NULL; // Periodic alarm whose handler the clock handler is executing
+static alarm_t alarm_softirq_running = NULL; // Periodic alarm whose handler the softirq thread is executing
+static semaphore_t alarm_softirq_wakeup = NULL; // Signalled whenever alarm_deferred becomes nonempty
+
+static alarm_t alarm_slabs[ALARM_MAX_SLABS]; // Every alarm ever allocated, ALARM_SLAB_SIZE at a time
+static int alarm_slab_count = 0;
+static list_t alarm_free = {NULL, NULL, 0}; // Alarms not in use
+
+static tas_lock_t alarm_lock = 0;  // Guards the wheel and alarms across virtual processors
 
 /* CLOCK VARIABLES */
 long clk_period = 100 * MILLISECOND; // Clock interrupt period
 long clk_count = 0;                 // Running count of clock interrupts
 
+/* The first processor's clock fires alarms */
+#define ALARM_CPU 0
 
-/* see alarm.h */
-alarm_id register_alarm(int delay, alarm_handler_t alarm, void *arg) {
-	elem_q* iter;
-	elem_q* elem;
+
+/*
+ * Put alarm in the wheel slot for its tick. Call with alarm_lock held.
+ */
+static void alarm_wheel_insert(alarm_t alarm) {
+    unsigned long long tick = alarm->tick;
+    int level = 0;
+
+    // Alarms beyond the wheel's reach wait in the top level, and are cascaded until in range
+    if (tick - alarm_wheel_tick >= ALARM_WHEEL_SPAN) {
+        tick = alarm_wheel_tick + ALARM_WHEEL_SPAN - 1;
+    }
+    while ((tick - alarm_wheel_tick) >> (ALARM_WHEEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+
+    alarm->level = level;
+    alarm->slot = (int) ((tick >> (ALARM_WHEEL_BITS * level)) & ALARM_WHEEL_MASK);
+    list_append(&alarm_wheel[level][alarm->slot], &alarm->node);
+    alarm_occupied[level] |= 1ULL << alarm->slot;
+    alarm_pending++;
+}
+
+/*
+ * Take alarm out of its wheel slot. Call with alarm_lock held.
+ */
+static void alarm_wheel_remove(alarm_t alarm) {
+    list_t* slot = &alarm_wheel[alarm->level][alarm->slot];
+
+    list_remove(slot, &alarm->node);
+    if (list_length(slot) == 0) {
+        alarm_occupied[alarm->level] &= ~(1ULL << alarm->slot);
+    }
+    alarm_pending--;
+}
+
+/*
+ * Move an alarm off the wheel to the expired list if it is due at now, or else to alarm_near.
+ * Call with alarm_lock held.
+ */
+static void alarm_expire(alarm_t alarm, unsigned long long now) {
+    if (alarm->nominal <= now) {
+        alarm->level = ALARM_EXPIRED;
+        list_append(&alarm_expired, &alarm->node);
+    } else {
+        alarm->level = ALARM_NEAR;
+        list_append(&alarm_near, &alarm->node);
+    }
+}
+
+/*
+ * Empty a wheel slot, re-inserting its alarms relative to the current tick (cascading)
+ * or, on level 0, expiring them at now. Call with alarm_lock held.
+ */
+static void alarm_wheel_drain(int level, int slot, unsigned long long now) {
+    alarm_t alarm;
+
+    while ((alarm = (alarm_t) list_dequeue(&alarm_wheel[level][slot])) != NULL) {
+        alarm_pending--;
+        if (level == 0) {
+            alarm_expire(alarm, now);
+        } else {
+            alarm_wheel_insert(alarm);
+        }
+    }
+    alarm_occupied[level] &= ~(1ULL << slot);
+}
+
+/*
+ * Turn the wheel to tick target, expiring alarms along the way at now. Call with alarm_lock held.
+ */
+static void alarm_wheel_advance(unsigned long long target, unsigned long long now) {
+    int level;
+
+    while (alarm_wheel_tick < target) {
+        if (alarm_pending == 0) { // Nothing to do until an alarm is registered
+            alarm_wheel_tick = target;
+            break;
+        }
+
+        // With level 0 empty, nothing happens before it wraps around and the levels above cascade
+        if (alarm_occupied[0] == 0 && ((alarm_wheel_tick + 1) & ALARM_WHEEL_MASK) != 0) {
+            alarm_wheel_tick |= ALARM_WHEEL_MASK;
+            if (alarm_wheel_tick > target) {
+                alarm_wheel_tick = target;
+            }
+            continue;
+        }
+
+        alarm_wheel_tick++;
+        for (level = 1; level < ALARM_WHEEL_LEVELS &&
+                ((alarm_wheel_tick >> (ALARM_WHEEL_BITS * (level - 1))) & ALARM_WHEEL_MASK) == 0; level++) {
+            alarm_wheel_drain(level, (int) ((alarm_wheel_tick >> (ALARM_WHEEL_BITS * level)) & ALARM_WHEEL_MASK), now);
+        }
+        alarm_wheel_drain(0, (int) (alarm_wheel_tick & ALARM_WHEEL_MASK), now);
+    }
+}
+
+/*
+ * Return alarm to the free list, invalidating its id. Call with alarm_lock held.
+ */
+static void alarm_release(alarm_t alarm) {
+    alarm->generation++;
+    alarm->level = ALARM_PARKED;
+    alarm->func = NULL;
+    alarm->arg = NULL;
+    list_append(&alarm_free, &alarm->node);
+}
+
+/*
+ * Allocate another slab of alarms onto the free list. Return 0, or -1 on failure.
+ */
+static int alarm_slab_grow() {
+    alarm_t slab;
+    interrupt_level_t old_level;
+    int i;
+
+    slab = (alarm_t) malloc(ALARM_SLAB_SIZE * sizeof(struct alarm));
+    if (slab == NULL) { // malloc() failed
+        fprintf(stderr, "ERROR: register_alarm() failed to malloc new alarm slab\n");
+        return -1;
+    }
+
+    old_level = set_interrupt_level(DISABLED);
+    atomic_spin_lock(&alarm_lock);
+    if (alarm_slab_count == ALARM_MAX_SLABS) {
+        atomic_clear(&alarm_lock);
+        set_interrupt_level(old_level);
+        fprintf(stderr, "ERROR: register_alarm() ran out of alarms\n");
+        free(slab);
+        return -1;
+    }
+    for (i = 0; i < ALARM_SLAB_SIZE; i++) {
+        slab[i].index = alarm_slab_count * ALARM_SLAB_SIZE + i;
+        slab[i].generation = 0;
+        slab[i].level = ALARM_PARKED;
+        slab[i].period = 0;
+        slab[i].slack = 0;
+        slab[i].deferred = 0;
+        slab[i].func = NULL;
+        slab[i].arg = NULL;
+        list_node_init(&slab[i].node, &slab[i]);
+        list_append(&alarm_free, &slab[i].node);
+    }
+    alarm_slabs[alarm_slab_count++] = slab;
+    atomic_clear(&alarm_lock);
+    set_interrupt_level(old_level);
+
+    return 0;
+}
+
+/*
+ * Return the live alarm named by id, or NULL if it has since been freed. Call with alarm_lock held.
+ */
+static alarm_t alarm_lookup(alarm_id id) {
+    unsigned long handle = (unsigned long) id;
+    unsigned long index = (handle & 0xffffffffUL) - 1;
+    alarm_t alarm;
+
+    if (index >= (unsigned long) (alarm_slab_count * ALARM_SLAB_SIZE)) {
+        return NULL;
+    }
+    alarm = &alarm_slabs[index / ALARM_SLAB_SIZE][index % ALARM_SLAB_SIZE];
+
+    return alarm->generation == (unsigned int) (handle >> 32) ? alarm : NULL;
+}
+
+
+/*
+ * Return the time at which the clock must call alarm_fire for a scheduled alarm: its
+ * deadline, or, if it waits on a higher level of the wheel, the moment its slot can be
+ * cascaded. Call with alarm_lock held.
+ */
+static unsigned long long alarm_due(alarm_t alarm) {
+    unsigned long long base;
+    int shift;
+
+    if (alarm->level == ALARM_EXPIRED) { // Due already, even if going off early within its slack
+        return alarm->nominal;
+    } else if (alarm->level <= 0) {
+        return alarm->deadline;
+    }
+
+    // The wheel turns to the slot's first tick as soon as the time is past the tick before
+    shift = ALARM_WHEEL_BITS * alarm->level;
+    base = alarm_wheel_tick >> shift;
+    return (((base + 1 + ((alarm->slot - (base + 1)) & ALARM_WHEEL_MASK)) << shift) - 1) * ALARM_WHEEL_RESOLUTION + 1;
+}
+
+/*
+ * Return the time within slack [ns] after nominal at which an alarm goes off: the latest
+ * that is a multiple of the largest power of two no greater than slack.
+ */
+static unsigned long long alarm_coalesce(unsigned long long nominal, unsigned long long slack) {
+    unsigned long long granularity;
+
+    if (slack == 0) {
+        return nominal;
+    }
+    granularity = 1ULL << (63 - __builtin_clzll(slack));
+
+    return (nominal + slack) & ~(granularity - 1);
+}
+
+/*
+ * Schedule alarm to go off at nominal (or up to its slack later), or as soon as possible if
+ * that has passed by now. Call with alarm_lock held.
+ */
+static void alarm_schedule(alarm_t alarm, unsigned long long nominal, unsigned long long now) {
+    unsigned long long now_tick = now / ALARM_WHEEL_RESOLUTION;
+
+    // An idle wheel has not been kept turning; bring it up to date before measuring from it
+    if (alarm_pending == 0 && alarm_wheel_tick < now_tick) {
+        alarm_wheel_tick = now_tick;
+    }
+
+    alarm->nominal = nominal;
+    alarm->deadline = alarm_coalesce(nominal, ((unsigned long long) alarm->slack) * MILLISECOND);
+    alarm->tick = (alarm->deadline + ALARM_WHEEL_RESOLUTION - 1) / ALARM_WHEEL_RESOLUTION;
+    if (alarm->tick <= alarm_wheel_tick) { // The wheel has already been turned past it
+        alarm->level = ALARM_NEAR;
+        list_append(&alarm_near, &alarm->node);
+    } else {
+        alarm_wheel_insert(alarm);
+    }
+
+    if (alarm_next_valid && (alarm_next == 0 || alarm_due(alarm) < alarm_next)) {
+        alarm_next = alarm_due(alarm);
+    }
+}
+
+/*
+ * Take alarm off the wheel, alarm_near or the expired list, if it is on one. Call with alarm_lock held.
+ */
+static void alarm_unschedule(alarm_t alarm) {
+    // If it was the soonest, the next soonest has to be looked for
+    if (alarm_next_valid && alarm->level != ALARM_PARKED && alarm->level != ALARM_QUEUED &&
+            alarm_due(alarm) <= alarm_next) {
+        alarm_next_valid = 0;
+    }
+
+    if (alarm->level >= 0) {
+        alarm_wheel_remove(alarm);
+    } else if (alarm->level == ALARM_NEAR) {
+        list_remove(&alarm_near, &alarm->node);
+    } else if (alarm->level == ALARM_EXPIRED) {
+        list_remove(&alarm_expired, &alarm->node);
+    } else if (alarm->level == ALARM_QUEUED) {
+        list_remove(&alarm_deferred, &alarm->node);
+    }
+    alarm->level = ALARM_PARKED;
+}
+
+/*
+ * Allocate and schedule an alarm, returning its id or NULL on failure.
+ */
+static alarm_id alarm_create(int delay, int period, int slack, int deferred, alarm_handler_t func, void* arg) {
 	alarm_t new_alarm;
-	int not_added = 1;
+	unsigned long long deadline, now;
+	interrupt_level_t old_level;
 
     // Disable interrupts while trying to register an alarm
-    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    old_level = set_interrupt_level(DISABLED);
+    atomic_spin_lock(&alarm_lock);
 
-	/* Initialize new alarm */
-    new_alarm = (alarm_t) malloc(sizeof(struct alarm));
-    if (new_alarm == NULL) { // malloc() failed
-        fprintf(stderr, "ERROR: register_alarm() failed to malloc new alarm_t\n");
-        return NULL;
+    // Take a free alarm, allocating more (without the lock) if there are none
+    while ((new_alarm = (alarm_t) list_dequeue(&alarm_free)) == NULL) {
+        atomic_clear(&alarm_lock);
+        set_interrupt_level(old_level);
+        if (alarm_slab_grow() < 0) {
+            return NULL;
+        }
+        old_level = set_interrupt_level(DISABLED);
+        atomic_spin_lock(&alarm_lock);
     }
-    new_alarm->deadline = ((unsigned long long) clk_count) * clk_period + ((unsigned long long) delay) * MILLISECOND;
-    new_alarm->func = alarm;
+
+    new_alarm->func = func;
     new_alarm->arg = arg;
-    new_alarm->executed = 0;
+    new_alarm->period = period;
+    new_alarm->slack = slack;
+    new_alarm->deferred = deferred;
+    now = minithread_clock_now();
+    alarm_schedule(new_alarm, now + ((unsigned long long) delay) * MILLISECOND, now);
+    deadline = new_alarm->deadline;
+    atomic_clear(&alarm_lock);
+
+    // A one-shot clock must be brought forward if it is set for later than this alarm
+    minithread_clock_arm(ALARM_CPU, deadline);
+
+    // Re-enable interrupts
+    set_interrupt_level(old_level);
+
+    return (alarm_id) ((((unsigned long) new_alarm->generation) << 32) | (new_alarm->index + 1));
+}
+
 
-    /* Initialize new queue element */
-    elem = (elem_q*) malloc(sizeof(elem_q));
-    if (elem == NULL) { // malloc() failed
-        fprintf(stderr, "ERROR: register_alarm() failed to malloc new elem_q\n");
+/* see alarm.h */
+alarm_id register_alarm(int delay, alarm_handler_t alarm, void *arg) {
+    return alarm_create(delay, 0, 0, 0, alarm, arg);
+}
+
+/* see alarm.h */
+alarm_id register_alarm_slack(int delay, int slack, alarm_handler_t alarm, void *arg) {
+    if (slack < 0) {
+        fprintf(stderr, "ERROR: register_alarm_slack() received negative slack\n");
         return NULL;
     }
-    elem->data = new_alarm;
 
-    /* Add new alarm's wrapper element to alarm queue */
-    if (alarm_queue == NULL) { // Ensure alarm_queue has been initialized
-        alarm_queue = queue_new();
+    return alarm_create(delay, 0, slack, 0, alarm, arg);
+}
+
+/* see alarm.h */
+alarm_id register_deferred_alarm(int delay, alarm_handler_t alarm, void *arg) {
+    return alarm_create(delay, 0, 0, 1, alarm, arg);
+}
+
+/* see alarm.h */
+alarm_id register_periodic_alarm(int period, alarm_handler_t alarm, void *arg) {
+    if (period <= 0) {
+        fprintf(stderr, "ERROR: register_periodic_alarm() received non-positive period\n");
+        return NULL;
     }
-    if (queue_length(alarm_queue) == 0) { // Nothing in alarm_queue; simply add new alarm
-    	queue_append(alarm_queue, new_alarm);
-    } else {
-    	iter = alarm_queue->head;
-
-    	while (iter->next != alarm_queue->head && not_added) {
-    		if (((alarm_t) (iter->data))->deadline > new_alarm->deadline) { // Found the position to place new alarm in alarm_queue
-    			elem->next = iter;
-    			elem->prev = iter->prev;
-    			iter->prev->next = elem;
-    			iter->prev = elem;
-    			if (iter == alarm_queue->head)
-    				alarm_queue->head = elem;
-    			not_added = 0;
-    		}
-    		iter = iter->next;
-    	}
-
-    	// New alarm has latest deadline; insert at end of queue (iter now points to alarm_queue->TAIL       NOT  head)
-    	if (not_added) {
-            queue_append(alarm_queue, new_alarm);
-            // elem->data = NULL;
-            // free(elem);
-
-
-            /* Below is probably wrong */
-            // elem->next = iter->next;        //Head of queue
-            // elem->prev = iter;
-            // elem->prev->next = elem;
-            // elem->next->prev = elem; 
-            // //iter->next = elem;
-            // //iter->next = elem;
-            // //iter->prev = (iter->prev == iter) ? elem : iter->prev;
-            // alarm_queue->tail = elem;
-
-            /*Below is wrong...*/
-    		// elem->next = iter;
-    		// elem->prev = iter->prev;
-    		// iter->prev->next = elem;
-    		// iter->prev = elem;
-   			// alarm_queue->tail = elem;
-    		not_added = 0;
-    	}
+
+    return alarm_create(period, period, 0, 0, alarm, arg);
+}
+
+/* see alarm.h */
+int rearm_alarm(alarm_id id, int delay) {
+    alarm_t alarm;
+    unsigned long long deadline = 0, now;
+
+    // Disable interrupts while trying to rearm an alarm
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+    atomic_spin_lock(&alarm_lock);
+    alarm = alarm_lookup(id);
+    if (alarm == NULL) { // Executed (if one-shot) or unregistered
+        atomic_clear(&alarm_lock);
+        set_interrupt_level(old_level);
+        return -1;
+    }
+    alarm_unschedule(alarm);
+    if (delay >= 0) {
+        now = minithread_clock_now();
+        alarm_schedule(alarm, now + ((unsigned long long) delay) * MILLISECOND, now);
+        deadline = alarm->deadline;
     }
+    atomic_clear(&alarm_lock);
+
+    // A one-shot clock must be brought forward if it is set for later than this alarm
+    minithread_clock_arm(ALARM_CPU, deadline);
+
     // Re-enable interrupts
     set_interrupt_level(old_level);
 
-    // printf("Alarm queue length: %i\n", queue_length(alarm_queue));
-    return (alarm_id) new_alarm;
+    return 0;
 }
 
 /* see alarm.h */
-int deregister_alarm(alarm_id alarm) {
-    // void* temp;
+int set_alarm_slack(alarm_id id, int slack) {
+    alarm_t alarm;
+    unsigned long long deadline = 0;
+    interrupt_level_t old_level;
 
-	int executed = ((alarm_t) alarm)->executed;
+    if (slack < 0) {
+        fprintf(stderr, "ERROR: set_alarm_slack() received negative slack\n");
+        return -1;
+    }
 
-    // Disable interrupts while trying to register an alarm
-    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+    // Disable interrupts while trying to change an alarm
+    old_level = set_interrupt_level(DISABLED);
 
-    if (queue_delete(alarm_queue, (alarm_t) alarm) < 0) {
-        fprintf(stderr, "ERROR: deregister_alarm() failed to delete alarm\n");
+    atomic_spin_lock(&alarm_lock);
+    alarm = alarm_lookup(id);
+    if (alarm == NULL) { // Executed (if one-shot) or unregistered
+        atomic_clear(&alarm_lock);
+        set_interrupt_level(old_level);
+        return -1;
+    }
+    alarm->slack = slack;
+    if (alarm->level >= 0 || alarm->level == ALARM_NEAR) { // Pending: move it to its new deadline
+        alarm_unschedule(alarm);
+        alarm_schedule(alarm, alarm->nominal, minithread_clock_now());
+        deadline = alarm->deadline;
     }
+    atomic_clear(&alarm_lock);
 
-    // if (queue_dequeue(alarm_queue, &temp) < 0) {
-    //     fprintf(stderr, "ERROR: deregister_alarm() failed to DEQUEUE alarm\n");
-    // }
+    // Less slack may bring the alarm forward
+    minithread_clock_arm(ALARM_CPU, deadline);
+
+    // Re-enable interrupts
+    set_interrupt_level(old_level);
+
+    return 0;
+}
+
+/* see alarm.h */
+int deregister_alarm(alarm_id id) {
+	alarm_t alarm;
+	int executed = 1;
+
+    // Disable interrupts while trying to deregister an alarm
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+    // Decide under the lock, so that an alarm not yet executed here is never executed
+    atomic_spin_lock(&alarm_lock);
+    alarm = alarm_lookup(id);
+    if (alarm != NULL) { // Not yet executed, or periodic
+        executed = (alarm == alarm_running || alarm == alarm_softirq_running);
+        if (alarm == alarm_running) { // Once freed, the alarm may be reused before its handler returns
+            alarm_running = NULL;
+        }
+        if (alarm == alarm_softirq_running) {
+            alarm_softirq_running = NULL;
+        }
+        alarm_unschedule(alarm);
+        alarm_release(alarm);
+    }
+    atomic_clear(&alarm_lock);
 
-    // printf("Alarm queue length: %i\n", queue_length(alarm_queue));
-    
     // Re-enable interrupts
     set_interrupt_level(old_level);
-    
+
     return executed;
 }
 
+/* see alarm.h */
+void backoff_init(backoff_t* backoff, int initial, int max) {
+    backoff->initial = initial;
+    backoff->max = max < initial ? initial : max;
+    backoff_reset(backoff);
+}
+
+/* see alarm.h */
+int backoff_next(backoff_t* backoff) {
+    int delay = backoff->delay;
+
+    backoff->delay = delay > backoff->max / 2 ? backoff->max : 2 * delay;
+    backoff->attempts++;
+
+    return delay;
+}
+
+/* see alarm.h */
+void backoff_reset(backoff_t* backoff) {
+    backoff->delay = backoff->initial;
+    backoff->attempts = 0;
+}
+
+/*
+ * Return the earliest deadline of the alarms on list, or 0 if it is empty. Call with alarm_lock held.
+ */
+static unsigned long long alarm_list_earliest(list_t* list) {
+    list_node* iter;
+    unsigned long long deadline = 0;
+
+    for (iter = list->head; iter != NULL; iter = iter->next) {
+        if (deadline == 0 || ((alarm_t) iter->data)->deadline < deadline) {
+            deadline = ((alarm_t) iter->data)->deadline;
+        }
+    }
+
+    return deadline;
+}
+
+/* see alarm.h */
+unsigned long long alarm_next_deadline() {
+    unsigned long long deadline, candidate, base, occupied;
+    int level, shift, skip;
+
+    atomic_spin_lock(&alarm_lock);
+    if (alarm_next_valid) { // Nothing has been fired or taken off since it was last looked for
+        deadline = alarm_next;
+        atomic_clear(&alarm_lock);
+        return deadline;
+    }
+
+    if (list_length(&alarm_expired) > 0) { // Already due, even if going off early within its slack
+        deadline = ((alarm_t) alarm_expired.head->data)->nominal;
+    } else {
+        deadline = alarm_list_earliest(&alarm_near);
+    }
+
+    // On each level, the first occupied slot after the current one is the next to expire or cascade
+    for (level = 0; level < ALARM_WHEEL_LEVELS; level++) {
+        if (alarm_occupied[level] == 0) {
+            continue;
+        }
+        shift = ALARM_WHEEL_BITS * level;
+        base = alarm_wheel_tick >> shift;
+        skip = (int) ((base + 1) & ALARM_WHEEL_MASK);
+        occupied = skip == 0 ? alarm_occupied[level] :
+            (alarm_occupied[level] >> skip) | (alarm_occupied[level] << (ALARM_WHEEL_SLOTS - skip));
+        if (level == 0) { // Its alarms' own deadlines
+            candidate = alarm_list_earliest(&alarm_wheel[0][(skip + __builtin_ctzll(occupied)) & ALARM_WHEEL_MASK]);
+        } else { // The wheel turns to the slot's first tick as soon as the time is past the tick before
+            candidate = (((base + 1 + __builtin_ctzll(occupied)) << shift) - 1) * ALARM_WHEEL_RESOLUTION + 1;
+        }
+        if (deadline == 0 || candidate < deadline) {
+            deadline = candidate;
+        }
+    }
+    alarm_next = deadline;
+    alarm_next_valid = 1;
+    atomic_clear(&alarm_lock);
+
+    return deadline;
+}
+
+/*
+ * Execute an expired alarm, first rescheduling it if periodic, in the clock handler or,
+ * if deferred, in the softirq thread with interrupts enabled. Call with interrupts disabled
+ * and alarm_lock held, which is dropped while the handler runs since handlers may
+ * (de)register alarms.
+ */
+static void alarm_execute(alarm_t alarm, int deferred, unsigned long long now) {
+    alarm_t* running = deferred ? &alarm_softirq_running : &alarm_running;
+    alarm_handler_t func = alarm->func;
+    void* arg = alarm->arg;
+    unsigned long long next = 0;
+
+    if (alarm->period > 0) { // Due again a period on, or a period from now if it fell behind
+        next = alarm->nominal + ((unsigned long long) alarm->period) * MILLISECOND;
+        alarm->level = ALARM_PARKED;
+        alarm_schedule(alarm, next > now ? next : now + ((unsigned long long) alarm->period) * MILLISECOND, now);
+        next = alarm->deadline;
+        *running = alarm;
+    } else {
+        alarm_release(alarm); // Executed: deregister_alarm now returns 1
+    }
+    atomic_clear(&alarm_lock);
+
+    if (deferred) {
+        // Only the clock handler reprograms the clock after executing alarms
+        minithread_clock_arm(ALARM_CPU, next);
+        set_interrupt_level(ENABLED);
+        func(arg);
+        set_interrupt_level(DISABLED);
+    } else {
+        func(arg);
+    }
+
+    atomic_spin_lock(&alarm_lock);
+    *running = NULL;
+}
+
+/* see alarm.h */
+void alarm_fire(unsigned long long now) {
+    alarm_t alarm;
+    list_node* iter;
+    int executed = 0, wakeup = 0;
+
+    atomic_spin_lock(&alarm_lock);
+    alarm_next_valid = 0; // The wheel is turned, and alarms expire
+
+    // Alarms of the tick the wheel reached last time that have since come due
+    for (iter = alarm_near.head; iter != NULL; ) {
+        alarm = (alarm_t) iter->data;
+        iter = iter->next;
+        if (alarm->nominal <= now) {
+            list_remove(&alarm_near, &alarm->node);
+            alarm_expire(alarm, now);
+        }
+    }
+    alarm_wheel_advance((now + ALARM_WHEEL_RESOLUTION - 1) / ALARM_WHEEL_RESOLUTION, now);
+
+    // Hand deferred alarms to the softirq thread, and execute the rest up to the budget
+    while (executed < ALARM_FIRE_BUDGET && (alarm = (alarm_t) list_dequeue(&alarm_expired)) != NULL) {
+        if (alarm->deferred) {
+            wakeup |= (list_length(&alarm_deferred) == 0);
+            alarm->level = ALARM_QUEUED;
+            list_append(&alarm_deferred, &alarm->node);
+        } else {
+            alarm_execute(alarm, 0, now);
+            executed++;
+        }
+    }
+    atomic_clear(&alarm_lock);
+
+    if (wakeup) {
+        semaphore_V(alarm_softirq_wakeup);
+    }
+}
+
+/*
+ * Body of the softirq thread: whenever woken, execute deferred alarms until none are left.
+ */
+static int alarm_softirq(arg_t arg) {
+    alarm_t alarm;
+    interrupt_level_t old_level;
+
+    for (;;) {
+        semaphore_P(alarm_softirq_wakeup);
+
+        old_level = set_interrupt_level(DISABLED);
+        atomic_spin_lock(&alarm_lock);
+        while ((alarm = (alarm_t) list_dequeue(&alarm_deferred)) != NULL) {
+            alarm_execute(alarm, 1, minithread_clock_now());
+        }
+        atomic_clear(&alarm_lock);
+        set_interrupt_level(old_level);
+    }
+
+    return 0;
+}
+
+/* see alarm.h */
+void alarm_initialize() {
+    minithread_attr_t attr;
+
+    alarm_softirq_wakeup = semaphore_create_named("softirq");
+    semaphore_initialize(alarm_softirq_wakeup, 0);
+
+    minithread_attr_init(&attr);
+    attr.level = 0;
+    attr.name = "softirq";
+    if (minithread_fork_attr(alarm_softirq, NULL, &attr) == NULL) {
+        fprintf(stderr, "ERROR: alarm_initialize() failed to fork softirq thread\n");
+    }
+}
+
 /*
 ** vim: ts=4 sw=4 et cindent
-*/
\ No newline at end of file
+*/
@@ -9,37 +9,132 @@
 
 #include "queue.h"
 #include "interrupts.h"
+#include "machineprimitives.h"
 
 /* An alarm_handler_t is a function that will run within the interrupt handler.
  * It must not block, and it must not perform I/O or any other long-running
- * computations.
+ * computations.  The handler of a deferred alarm is instead run by the softirq
+ * thread, with interrupts enabled, so it may take longer and may wait for
+ * locks, but must not wait for anything else: deferred alarms behind it are
+ * held up meanwhile.
  */
 typedef void (*alarm_handler_t)(void*);
 typedef void *alarm_id;
 
+/* ALARM WHEEL PARAMETERS */
+#define ALARM_WHEEL_RESOLUTION MILLISECOND	// Width of a level-0 wheel slot [ns]
+#define ALARM_WHEEL_BITS 6					// Each level of the wheel has 1 << ALARM_WHEEL_BITS slots...
+#define ALARM_WHEEL_SLOTS (1 << ALARM_WHEEL_BITS)
+#define ALARM_WHEEL_LEVELS 4				// ...and each slot spans a whole turn of the level below
+#define ALARM_SLAB_SIZE 64					// Alarms are allocated this many at a time...
+#define ALARM_MAX_SLABS 1024				// ...and never more than this many times
+#define ALARM_FIRE_BUDGET 8					// Most handlers executed per clock interrupt
+
 typedef struct alarm *alarm_t;
 struct alarm {
-	unsigned long long int deadline; // Absolute deadline in ms
-	int executed;
-	void* func;
+	unsigned long long int nominal; // Absolute deadline [ns] on minithread_clock_now() asked for
+	unsigned long long int deadline; // When the alarm goes off [ns]: nominal, or up to slack later to coalesce with others
+	unsigned long long int tick; // Wheel tick the alarm goes off at: its deadline rounded up to a slot boundary
+	unsigned int generation; // Bumped whenever the alarm is freed, so that stale alarm_ids are recognised
+	int index; // Position in the slab table; together with generation, makes up the alarm_id
+	int level; // Wheel level and slot holding the alarm while it is pending; negative otherwise
+	int slot;
+	int period; // Interval [ms] between executions of a periodic alarm; 0 for a one-shot alarm
+	int slack; // How late [ms] the alarm may go off, so that it can share an expiry with others
+	int deferred; // 1 if executed by the softirq thread, 0 if by the clock handler
+	alarm_handler_t func;
 	void* arg;
+	list_node node; // Links the alarm into its wheel slot, the expired or deferred list, or the free list
+};
+
+/*
+ * Exponential backoff: each delay is twice the one before, up to a cap.
+ */
+typedef struct backoff backoff_t;
+struct backoff {
+	int initial; // First delay [ms]
+	int max; // Largest delay [ms]
+	int delay; // Next delay [ms]
+	int attempts; // Delays handed out since the last reset
 };
 
 /* CLOCK VARIABLES */
 extern long clk_period;    		// Clock interrupt period
 extern long clk_count;			// Running count of clock interrupts
 
-extern queue_t alarm_queue;	// Queue containing alarms (soonest deadline at head of queue)
-
 
 /* register an alarm to go off in "delay" milliseconds.  Returns a handle to
  * the alarm.
  */
 extern alarm_id register_alarm(int delay, alarm_handler_t func, void *arg);
 
+/* register an alarm to go off between "delay" and "delay" + "slack"
+ * milliseconds from now.  Alarms whose windows overlap are likely to go off
+ * together, with a single clock interrupt.  Returns a handle to the alarm.
+ */
+extern alarm_id register_alarm_slack(int delay, int slack, alarm_handler_t func, void *arg);
+
+/* register an alarm to go off in "delay" milliseconds, whose handler is run
+ * by the softirq thread with interrupts enabled rather than by the clock
+ * handler.  Returns a handle to the alarm.
+ */
+extern alarm_id register_deferred_alarm(int delay, alarm_handler_t func, void *arg);
+
+/* register an alarm to go off every "period" milliseconds, the first time
+ * "period" milliseconds from now, until it is unregistered.  Returns a handle
+ * to the alarm, which stays valid across executions.
+ */
+extern alarm_id register_periodic_alarm(int period, alarm_handler_t func, void *arg);
+
+/* make an alarm go off "delay" milliseconds from now instead of when it was
+ * due (a periodic alarm then carries on every period from there), or, if delay
+ * is negative, park it until it is next rearmed.  May be called from the
+ * alarm's own handler.  Returns 0, or -1 if the alarm has been freed: a one-shot
+ * alarm is freed once executed, so it must then be registered anew.
+ */
+extern int rearm_alarm(alarm_id id, int delay);
+
+/* let an alarm go off up to "slack" milliseconds late, from now on and every
+ * time it is rearmed or (if periodic) rescheduled.  Returns 0, or -1 if the
+ * alarm has been freed.
+ */
+extern int set_alarm_slack(alarm_id id, int slack);
+
 /* unregister an alarm.  Returns 0 if the alarm had not been executed, 1
- * otherwise.
+ * otherwise; for a periodic alarm, 1 means its handler is executing right now
+ * on another processor, or, if deferred, in the softirq thread.  An alarm is
+ * freed once it has been unregistered (or, if one-shot, executed), after which
+ * its id is stale but harmless to pass here (returning 1) or to rearm_alarm.
  */
 extern int deregister_alarm(alarm_id id);
 
+/* start a backoff at initial milliseconds, doubling up to max. */
+extern void backoff_init(backoff_t* backoff, int initial, int max);
+
+/* return the next delay of a backoff, and double the one after it. */
+extern int backoff_next(backoff_t* backoff);
+
+/* start a backoff over from its initial delay. */
+extern void backoff_reset(backoff_t* backoff);
+
+/* return the time at which the clock must next call alarm_fire, or 0 if no
+ * alarm is pending.  This is never later than the soonest deadline, but may be
+ * earlier.  The answer is kept until an alarm fires or is unregistered, so
+ * calling this again in between is O(1).  Call with interrupts disabled.
+ */
+extern unsigned long long alarm_next_deadline();
+
+/* execute alarms whose deadline is no later than now, one at a time, and hand
+ * deferred ones to the softirq thread.  At most ALARM_FIRE_BUDGET handlers are
+ * executed per call; any alarms left over keep alarm_next_deadline in the past,
+ * so that the clock goes off again straight away.  Called by the clock handler,
+ * with interrupts disabled.
+ */
+extern void alarm_fire(unsigned long long now);
+
+/* start the softirq thread, a level 0 minithread that executes deferred
+ * alarms.  Called once, by minithread_system_initialize.
+ */
+extern void alarm_initialize();
+
 #endif
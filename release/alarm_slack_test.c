@@ -0,0 +1,184 @@
+/* alarm_slack_test.c
+
+   Test alarms with timer slack: every alarm goes off within its window and
+   never early, alarms with overlapping windows go off together, and the
+   slack given by set_alarm_slack is kept across rearms and periodic
+   reschedules.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "minithread.h"
+#include "synch.h"
+#include "alarm.h"
+
+
+#define ALARMS 500
+#define SPACING 5    // Distinct delays are this many ms apart...
+#define DELAYS 40    // ...and there are this many of them
+#define SLACK 25
+#define BATCH_GAP (2 * MILLISECOND)  // Alarms going off closer together than this went off together
+#define PERIODS 10
+#define LATENESS (20 * MILLISECOND)  // How far past its window an alarm may go off on a busy host
+
+typedef struct window window_t;
+struct window {
+  unsigned long long lo;  // Earliest time the alarm may go off [ns]
+  unsigned long long hi;  // Latest time, before LATENESS [ns]
+  unsigned long long fired;  // When the alarm went off [ns]
+};
+
+semaphore_t done;
+window_t windows[ALARMS];
+int early = 0;
+int late = 0;
+
+unsigned long long fired[PERIODS];
+int periods = 0;
+
+
+/* Check that an alarm goes off within its window. */
+void check(void* arg) {
+  window_t* w = (window_t*) arg;
+  unsigned long long now = minithread_clock_now();
+
+  w->fired = now;
+  if (now < w->lo) {
+    early++;
+  } else if (now > w->hi + LATENESS) {
+    late++;
+  }
+  semaphore_V(done);
+}
+
+/* Record each execution of a periodic alarm, until PERIODS of them. */
+void tick(void* arg) {
+  if (periods < PERIODS) {
+    fired[periods++] = minithread_clock_now();
+    if (periods == PERIODS) {
+      semaphore_V(done);
+    }
+  }
+}
+
+/* Order windows by when their alarms went off. */
+int by_firing(const void* a, const void* b) {
+  unsigned long long x = ((const window_t*) a)->fired, y = ((const window_t*) b)->fired;
+
+  return (x > y) - (x < y);
+}
+
+/* Register ALARMS alarms with slack, wait for all of them, and return the number of batches they went off in. */
+int run_batch(int slack) {
+  unsigned long long now;
+  int i, delay, batches = 1;
+
+  for (i = 0; i < ALARMS; i++) {
+    delay = 20 + SPACING * ((i * 37) % DELAYS);  // 37 is coprime to DELAYS, so the delays are interleaved
+    now = minithread_clock_now();
+    windows[i].lo = now + delay * MILLISECOND;
+    windows[i].hi = minithread_clock_now() + (delay + slack) * MILLISECOND;
+    register_alarm_slack(delay, slack, check, &windows[i]);
+  }
+  for (i = 0; i < ALARMS; i++) {
+    semaphore_P(done);
+  }
+
+  // Counted from the handlers' own times, since ALARM_FIRE_BUDGET spreads a batch over several clock interrupts
+  qsort(windows, ALARMS, sizeof(window_t), by_firing);
+  for (i = 1; i < ALARMS; i++) {
+    if (windows[i].fired - windows[i - 1].fired > BATCH_GAP) {
+      batches++;
+    }
+  }
+  return batches;
+}
+
+/* Alarms whose windows overlap go off together: no more batches than there are slack-sized stretches of delays. */
+int coalesce_test() {
+  int exact, slacked;
+
+  early = late = 0;
+  exact = run_batch(0);
+  slacked = run_batch(SLACK);
+  printf("batches: exact %d, with %dms slack %d\n", exact, SLACK, slacked);
+
+  // Slack rounds deadlines down to a multiple of a power of two greater than half of it
+  if (slacked > SPACING * DELAYS / (SLACK / 2) + 2) return 0;
+  if (register_alarm_slack(10, -1, check, &windows[0]) != NULL) return 0;
+  return early == 0 && late == 0;
+}
+
+/* Slack set on a pending alarm applies to it and to its rearms, and is lost with the alarm. */
+int set_slack_test() {
+  unsigned long long now;
+  alarm_id id;
+
+  early = late = 0;
+  id = register_alarm(1000, check, &windows[0]);
+  if (set_alarm_slack(id, 40) != 0) return 0;
+  if (set_alarm_slack(id, -1) != -1) return 0;
+
+  // Rearmed sooner, the alarm keeps its 40ms of slack
+  now = minithread_clock_now();
+  windows[0].lo = now + 60 * MILLISECOND;
+  if (rearm_alarm(id, 60) != 0) return 0;
+  windows[0].hi = minithread_clock_now() + 100 * MILLISECOND;
+  semaphore_P(done);
+
+  // Executed, the one-shot alarm is freed
+  if (set_alarm_slack(id, 10) != -1) return 0;
+  return early == 0 && late == 0;
+}
+
+/* A periodic alarm with slack goes off within its slack of every period, without drifting. */
+int periodic_slack_test() {
+  unsigned long long before, after;
+  alarm_id id;
+  int i;
+
+  before = minithread_clock_now();
+  id = register_periodic_alarm(20, tick, NULL);
+  if (set_alarm_slack(id, 8) != 0) return 0;
+  after = minithread_clock_now();
+  semaphore_P(done);
+  deregister_alarm(id);
+
+  for (i = 0; i < PERIODS; i++) {
+    if (fired[i] < before + (i + 1) * 20 * MILLISECOND) return 0;
+    if (fired[i] > after + (i + 1) * 20 * MILLISECOND + 8 * MILLISECOND + LATENESS) return 0;
+  }
+  return 1;
+}
+
+
+int run_tests(int* arg) {
+  if (coalesce_test()) {
+    printf("Coalesce success!!!\n");
+  } else {
+    printf("Coalesce failure...\n");
+  }
+
+  if (set_slack_test()) {
+    printf("Set slack success!!!\n");
+  } else {
+    printf("Set slack failure...\n");
+  }
+
+  if (periodic_slack_test()) {
+    printf("Periodic slack success!!!\n");
+  } else {
+    printf("Periodic slack failure...\n");
+  }
+
+  exit(0);
+  return 0;
+}
+
+int main(void) {
+  done = semaphore_create();
+  semaphore_initialize(done, 0);
+  minithread_system_initialize(run_tests, NULL);
+  return 0;
+}
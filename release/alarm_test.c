@@ -1,29 +1,204 @@
-/* alarm_test.c
-
-   Test an alarm
-*/
-
-#include <stdio.h>
-#include <stdlib.h>
-
-#include "minithread.h"
-#include "alarm.h"
-
-
-void functor() {
-	printf("functor() running\n");
-	return;
-}
-
-int thread(int* arg) {
-	register_alarm(6400, (alarm_handler_t) functor, NULL);
-	printf("Hello, world!\n");
-	// while (1);
-	// minithread_sleep_with_timeout(5000);
-	return 0;
-}
-
-int main(void) {
-	minithread_system_initialize(thread, NULL);
-	return 0;
-}
+/* alarm_test.c
+
+   Test the alarm wheel: alarms go off in deadline order and never early,
+   including either side of the delays where they move up a level of the
+   wheel and are cascaded down again; an alarm unregistered while pending
+   never goes off; and the id of a freed alarm stays stale once its slot is
+   reused by another alarm.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "minithread.h"
+#include "synch.h"
+#include "alarm.h"
+
+
+#define ORDERED 64
+#define BOUNDARIES 8
+#define LATENESS (20 * MILLISECOND)  // How far past its deadline an alarm may go off on a busy host
+
+typedef struct expected expected_t;
+struct expected {
+  int delay;                  // [ms]
+  unsigned long long due;     // Deadline [ns]
+  unsigned long long fired;   // When the alarm went off [ns]; 0 if it has not
+};
+
+semaphore_t done;
+int fired_order[ORDERED];
+int fired_count = 0;
+expected_t boundaries[BOUNDARIES];
+int never_fired = 1;
+int live_fired = 0;
+
+// Either side of a whole turn of level 0 of the wheel (64ms) and of level 1 (4096ms); the 1ms
+// alarm is within a single slot and at the mercy of host scheduling, so only held to never
+// going off early and going off first
+int boundary_delays[BOUNDARIES] = { 4097, 63, 4095, 65, 64, 4096, 62, 1 };
+
+
+/* Record the order in which alarms go off. */
+void record_order(void* arg) {
+  fired_order[fired_count++] = (int) (long) arg;
+  semaphore_V(done);
+}
+
+/* Record when an alarm went off. */
+void record_time(void* arg) {
+  ((expected_t*) arg)->fired = minithread_clock_now();
+  semaphore_V(done);
+}
+
+/* Handler of an alarm that must never go off. */
+void must_not_fire(void* arg) {
+  never_fired = 0;
+}
+
+/* Wake the main thread. */
+void wake(void* arg) {
+  semaphore_V(done);
+}
+
+/* Handler of the alarm reusing a freed alarm's slot. */
+void live(void* arg) {
+  live_fired++;
+  semaphore_V(done);
+}
+
+/* Alarms registered in scrambled order go off in order of their deadlines. */
+int order_test() {
+  int i, delay;
+
+  for (i = 0; i < ORDERED; i++) {
+    delay = (i * 37) % ORDERED;  // 37 is coprime to ORDERED, so every delay comes up once
+    register_alarm(10 + delay * 3, record_order, (void*) (long) delay);
+  }
+  for (i = 0; i < ORDERED; i++) {
+    semaphore_P(done);
+  }
+
+  for (i = 0; i < ORDERED; i++) {
+    if (fired_order[i] != i) return 0;
+  }
+  return 1;
+}
+
+/* Alarms either side of the level boundaries of the wheel go off on time, and in order. */
+int boundary_test() {
+  int i, j;
+
+  for (i = 0; i < BOUNDARIES; i++) {
+    boundaries[i].delay = boundary_delays[i];
+    boundaries[i].due = minithread_clock_now() + ((unsigned long long) boundary_delays[i]) * MILLISECOND;
+    boundaries[i].fired = 0;
+    register_alarm(boundary_delays[i], record_time, &boundaries[i]);
+  }
+  for (i = 0; i < BOUNDARIES; i++) {
+    semaphore_P(done);
+  }
+
+  for (i = 0; i < BOUNDARIES; i++) {
+    if (boundaries[i].fired < boundaries[i].due
+        || (boundaries[i].delay > 1 && boundaries[i].fired > boundaries[i].due + LATENESS)) {
+      printf("alarm due in %dms went off %lldms off\n", boundaries[i].delay,
+        ((long long) boundaries[i].fired - (long long) boundaries[i].due) / MILLISECOND);
+      return 0;
+    }
+    for (j = 0; j < BOUNDARIES; j++) {
+      if (boundaries[j].delay > boundaries[i].delay && boundaries[j].fired < boundaries[i].fired) return 0;
+    }
+  }
+  return 1;
+}
+
+/* An alarm unregistered before it goes off never does, wherever it waits on the wheel. */
+int deregister_test() {
+  alarm_id soon, later, periodic, fired;
+
+  soon = register_alarm(30, must_not_fire, NULL);
+  later = register_alarm(5000, must_not_fire, NULL);
+  periodic = register_periodic_alarm(20, must_not_fire, NULL);
+  fired = register_alarm(10, wake, NULL);
+
+  if (deregister_alarm(soon) != 0) return 0;
+  if (deregister_alarm(later) != 0) return 0;
+  if (deregister_alarm(periodic) != 0) return 0;
+  if (deregister_alarm(soon) != 1) return 0;  // Already freed
+
+  semaphore_P(done);
+  if (deregister_alarm(fired) != 1) return 0;  // Already executed
+  minithread_sleep_with_timeout(60);
+  return never_fired;
+}
+
+/* The id of a freed alarm names nothing, even once its slot holds another alarm. */
+int stale_id_test() {
+  alarm_id old, recycled = NULL, other;
+  int i;
+
+  old = register_alarm(1000, must_not_fire, NULL);
+  deregister_alarm(old);
+
+  // Freed alarms are reused in turn; the low half of an id names the slot
+  for (i = 0; i < 100000 && recycled == NULL; i++) {
+    other = register_alarm(50, live, NULL);
+    if (((unsigned long) other & 0xffffffffUL) == ((unsigned long) old & 0xffffffffUL)) {
+      recycled = other;
+    } else {
+      deregister_alarm(other);
+    }
+  }
+  if (recycled == NULL || recycled == old) return 0;
+
+  // Nothing done with the old id touches the new alarm
+  if (rearm_alarm(old, 10000) != -1) return 0;
+  if (set_alarm_slack(old, 10000) != -1) return 0;
+  if (deregister_alarm(old) != 1) return 0;
+  semaphore_P(done);
+  if (live_fired != 1) return 0;
+
+  // Once executed, the new alarm's id is stale in turn
+  if (rearm_alarm(recycled, 10) != -1) return 0;
+  if (deregister_alarm(recycled) != 1) return 0;
+  minithread_sleep_with_timeout(30);
+  return live_fired == 1 && never_fired;
+}
+
+
+int run_tests(int* arg) {
+  if (order_test()) {
+    printf("Order success!!!\n");
+  } else {
+    printf("Order failure...\n");
+  }
+
+  if (boundary_test()) {
+    printf("Boundary success!!!\n");
+  } else {
+    printf("Boundary failure...\n");
+  }
+
+  if (deregister_test()) {
+    printf("Deregister success!!!\n");
+  } else {
+    printf("Deregister failure...\n");
+  }
+
+  if (stale_id_test()) {
+    printf("Stale id success!!!\n");
+  } else {
+    printf("Stale id failure...\n");
+  }
+
+  exit(0);
+  return 0;
+}
+
+int main(void) {
+  done = semaphore_create();
+  semaphore_initialize(done, 0);
+  minithread_system_initialize(run_tests, NULL);
+  return 0;
+}
@@ -48,9 +48,7 @@ int producer(int* arg) {
   int count = 1;
   int n, i;
 
-  minithread_fork(consumer, arg);
-
-  minithread_yield();
+  minithread_yield_to(minithread_fork(consumer, arg));
 
   while (count <= *arg) {
     n = genintrand(BUFFER_SIZE);
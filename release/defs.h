@@ -15,6 +15,15 @@
 #define INTERRUPT_DEFER 0
 #define INTERRUPT_DROP 1
 
+/* if set to 1, each stack has an inaccessible guard page below it to catch overflows */
+#define STACK_GUARD_PAGE 1
+
+/* if set to 1, the clock is a one-shot timer set for the next alarm or end of quanta, rather than ticking every clk_period */
+#define CLOCK_TICKLESS 1
+
+/* if set to 1, semaphores record contention statistics for synch_profile_dump */
+#define SYNCH_PROFILE 0
+
 /* for now kernel printfs are just regular printfs */
 #define kprintf printf
 
@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "future.h"
+#include "interrupts.h"
+#include "alarm.h"
+#include "minithread.h"
+
+/*
+ *      Futures. A waiting thread links a future_link into the waiters of each
+ *      future it waits for; all of its links point at one future_waiter on its
+ *      stack, which records whether it has been woken, and by what.
+ */
+
+#define FUTURE_WAITING 0
+#define FUTURE_COMPLETED 1 // Woken by a completion
+#define FUTURE_EXPIRED 2   // Woken, or too late to wake, by the timeout alarm
+
+typedef struct future_waiter future_waiter;
+struct future_waiter {
+	minithread_t thread;
+	volatile int woken; // FUTURE_WAITING until the first of a completion or the timeout wakes the thread
+};
+
+struct future_link {
+	future_waiter* waiter;
+	struct future_link* next;
+};
+
+
+/*
+ * minithread_future_t future_create()
+ *      Allocate a new, incomplete future.
+ */
+minithread_future_t future_create() {
+	minithread_future_t future = (minithread_future_t) malloc(sizeof(struct future));
+	if (future == NULL) { // malloc() failed
+		fprintf(stderr, "ERROR: future_create() failed to malloc new minithread_future_t\n");
+		return NULL;
+	}
+
+	future->lock = 0;
+	future->done = 0;
+	future->value = 0;
+	future->waiters = NULL;
+
+	return future;
+}
+
+/*
+ * future_destroy(minithread_future_t future)
+ *      Deallocate a future.
+ */
+void future_destroy(minithread_future_t future) {
+	if (future == NULL) {
+		fprintf(stderr, "ERROR: future_destroy() received NULL argument future\n");
+		return;
+	}
+	if (future->waiters != NULL) {
+		fprintf(stderr, "ERROR: future_destroy() received a future that threads are waiting for\n");
+		return;
+	}
+
+	free(future);
+}
+
+/*
+ * future_complete(minithread_future_t future, int value)
+ *      Complete the future, waking its waiters.
+ */
+void future_complete(minithread_future_t future, int value) {
+	struct future_link* link;
+	minithread_t tcb;
+	interrupt_level_t old_ilevel;
+
+	if (future == NULL) {
+		fprintf(stderr, "ERROR: future_complete() received NULL argument future\n");
+		return;
+	}
+
+	old_ilevel = set_interrupt_level(DISABLED); // Disable interrupts
+
+	atomic_spin_lock(&future->lock); // Acquire lock; other processors may be using future
+	if (future->done) {
+		atomic_clear(&future->lock);
+		set_interrupt_level(old_ilevel);
+		fprintf(stderr, "ERROR: future_complete() received a future that was already completed\n");
+		return;
+	}
+
+	future->value = value;
+	future->done = 1;
+
+	// A waiter stays linked until it takes this lock, so its links are valid here
+	for (link = future->waiters; link != NULL; link = link->next) {
+		tcb = link->waiter->thread;
+		if (compare_and_swap((int*) &(link->waiter->woken), FUTURE_WAITING, FUTURE_COMPLETED) == FUTURE_WAITING) {
+			minithread_start(tcb);
+		}
+	}
+	atomic_clear(&future->lock); // Release lock
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+	if (old_ilevel == ENABLED) {
+		minithread_resched(); // A woken thread may outrank the caller
+	}
+}
+
+/*
+ * Alarm handler for a timed wait: wake the waiter unless a completion got there first.
+ * Either way mark it FUTURE_EXPIRED, so the waiter knows this handler is done with it.
+ */
+static void future_expire(void* arg) {
+	future_waiter* waiter = (future_waiter*) arg;
+	minithread_t tcb = waiter->thread;
+
+	if (swap((int*) &(waiter->woken), FUTURE_EXPIRED) == FUTURE_WAITING) {
+		minithread_start(tcb);
+	}
+}
+
+/*
+ * Wait until one of the n futures is complete or, unless delay is negative, delay
+ * milliseconds have passed. Return the index of the first complete future, or n if none
+ * completed in time.
+ */
+static int future_wait_many(minithread_future_t* futures, int n, int delay) {
+	future_waiter waiter;
+	struct future_link one_link;
+	struct future_link* links;
+	struct future_link** iter;
+	alarm_id alarm = NULL;
+	int i, linked;
+	interrupt_level_t old_ilevel;
+
+	links = (n == 1) ? &one_link : (struct future_link*) malloc(n * sizeof(struct future_link));
+	if (links == NULL) {
+		fprintf(stderr, "ERROR: future_wait_many() failed to malloc future links\n");
+		return n;
+	}
+
+	waiter.thread = minithread_self();
+	waiter.woken = FUTURE_WAITING;
+
+	old_ilevel = set_interrupt_level(DISABLED); // Disable interrupts
+
+	// Wait on each future in turn, unless one is already complete
+	for (linked = 0; linked < n; linked++) {
+		atomic_spin_lock(&futures[linked]->lock);
+		if (futures[linked]->done) {
+			atomic_clear(&futures[linked]->lock);
+			break;
+		}
+		links[linked].waiter = &waiter;
+		links[linked].next = futures[linked]->waiters;
+		futures[linked]->waiters = &links[linked];
+		atomic_clear(&futures[linked]->lock);
+	}
+
+	if (linked == n) {
+		if (delay >= 0) {
+			alarm = register_alarm(delay, future_expire, &waiter);
+		}
+		// A completion on another processor may requeue us before we have switched out; the
+		// scheduler does not resume us elsewhere until our context is saved
+		minithread_stop();
+		set_interrupt_level(DISABLED);
+
+		// An alarm that already went off may still be touching waiter on another processor
+		if (alarm != NULL && deregister_alarm(alarm) == 1) {
+			while (waiter.woken != FUTURE_EXPIRED)
+				;
+		}
+	}
+
+	// Unlink from every future, so that no completion touches waiter once we return
+	for (i = 0; i < linked; i++) {
+		atomic_spin_lock(&futures[i]->lock);
+		for (iter = &(futures[i]->waiters); *iter != &links[i]; iter = &((*iter)->next))
+			;
+		*iter = links[i].next;
+		atomic_clear(&futures[i]->lock);
+	}
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+
+	if (links != &one_link) {
+		free(links);
+	}
+
+	for (i = 0; i < n && !futures[i]->done; i++)
+		;
+	return i;
+}
+
+/*
+ * int future_poll(minithread_future_t future, int* value)
+ *      Return 1 and the result if the future is complete, or 0.
+ */
+int future_poll(minithread_future_t future, int* value) {
+	if (future == NULL) {
+		fprintf(stderr, "ERROR: future_poll() received NULL argument future\n");
+		return 0;
+	}
+
+	if (!future->done) {
+		return 0;
+	}
+	if (value != NULL) {
+		*value = future->value;
+	}
+	return 1;
+}
+
+/*
+ * int future_wait(minithread_future_t future, int* value)
+ *      Wait for the future to complete.
+ */
+int future_wait(minithread_future_t future, int* value) {
+	if (future == NULL) {
+		fprintf(stderr, "ERROR: future_wait() received NULL argument future\n");
+		return -1;
+	}
+
+	if (future_wait_many(&future, 1, -1) != 0) {
+		return -1;
+	}
+	if (value != NULL) {
+		*value = future->value;
+	}
+	return 0;
+}
+
+/*
+ * int future_wait_timeout(minithread_future_t future, int delay, int* value)
+ *      Wait at most delay milliseconds for the future to complete.
+ */
+int future_wait_timeout(minithread_future_t future, int delay, int* value) {
+	if (future == NULL) {
+		fprintf(stderr, "ERROR: future_wait_timeout() received NULL argument future\n");
+		return -1;
+	}
+	if (delay < 0) {
+		fprintf(stderr, "ERROR: future_wait_timeout() received negative delay\n");
+		return -1;
+	}
+
+	if (future_wait_many(&future, 1, delay) != 0) {
+		return 0; // Timed out
+	}
+	if (value != NULL) {
+		*value = future->value;
+	}
+	return 1;
+}
+
+/*
+ * int future_wait_all(minithread_future_t* futures, int n)
+ *      Wait for all n futures to complete.
+ */
+int future_wait_all(minithread_future_t* futures, int n) {
+	int i;
+
+	if (futures == NULL || n < 0) {
+		fprintf(stderr, "ERROR: future_wait_all() received invalid arguments\n");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (future_wait(futures[i], NULL) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * int future_wait_any(minithread_future_t* futures, int n)
+ *      Wait for one of the n futures to complete.
+ */
+int future_wait_any(minithread_future_t* futures, int n) {
+	int i;
+
+	if (futures == NULL || n <= 0) {
+		fprintf(stderr, "ERROR: future_wait_any() received invalid arguments\n");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (futures[i] == NULL) {
+			fprintf(stderr, "ERROR: future_wait_any() received NULL future\n");
+			return -1;
+		}
+	}
+
+	i = future_wait_many(futures, n, -1);
+	return (i < n) ? i : -1;
+}
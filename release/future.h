@@ -0,0 +1,83 @@
+/*
+ * Definitions for futures.
+ *
+ *  A future stands for the result of an operation that completes later, e.g. a
+ *  disk request or a reliable send. It is completed once, typically by an
+ *  interrupt handler, and any number of threads may wait for it. A thread can
+ *  wait for several futures at once, so it can keep many operations in flight
+ *  without a thread (and stack) per operation.
+ */
+#ifndef __FUTURE_H__
+#define __FUTURE_H__
+
+#include "machineprimitives.h"
+#include "defs.h"
+
+struct future_link;
+
+typedef struct future *minithread_future_t;
+struct future {
+	tas_lock_t lock;
+	int done;						//Set once the future is completed
+	int value;						//Result of the operation, valid once done
+	struct future_link* waiters;	//Threads waiting for the future
+};
+
+/* FUTURE METHODS */
+
+/*
+ * minithread_future_t future_create()
+ *  Allocate a new, incomplete future.
+ */
+extern minithread_future_t future_create();
+
+/*
+ * future_destroy(minithread_future_t future)
+ *  Deallocate a future. No thread may be waiting for it, and it may not be
+ *  completed afterwards.
+ */
+extern void future_destroy(minithread_future_t future);
+
+/*
+ * future_complete(minithread_future_t future, int value)
+ *  Complete the future with the result value, waking every thread waiting for
+ *  it. Does not block, so it may be called from interrupt handlers. Completing
+ *  a future twice is an error.
+ */
+extern void future_complete(minithread_future_t future, int value);
+
+/*
+ * int future_poll(minithread_future_t future, int* value)
+ *  Return 1 and store the result in *value (unless value is NULL) if the future
+ *  is complete, or 0 if it is not.
+ */
+extern int future_poll(minithread_future_t future, int* value);
+
+/*
+ * int future_wait(minithread_future_t future, int* value)
+ *  Wait for the future to complete and store its result in *value (unless
+ *  value is NULL). Returns 0 on success, -1 on error.
+ */
+extern int future_wait(minithread_future_t future, int* value);
+
+/*
+ * int future_wait_timeout(minithread_future_t future, int delay, int* value)
+ *  Like future_wait, but give up after delay milliseconds. Returns 1 if the
+ *  future completed, 0 if the wait timed out, -1 on error.
+ */
+extern int future_wait_timeout(minithread_future_t future, int delay, int* value);
+
+/*
+ * int future_wait_all(minithread_future_t* futures, int n)
+ *  Wait for all n futures to complete. Returns 0 on success, -1 on error.
+ */
+extern int future_wait_all(minithread_future_t* futures, int n);
+
+/*
+ * int future_wait_any(minithread_future_t* futures, int n)
+ *  Wait for at least one of the n futures to complete. Returns the index of a
+ *  completed future (the lowest, if several are), or -1 on error.
+ */
+extern int future_wait_any(minithread_future_t* futures, int n);
+
+#endif /*__FUTURE_H__*/
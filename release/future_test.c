@@ -0,0 +1,172 @@
+/* future_test.c
+
+   Test futures: waiting for a future completed by another thread or by an
+   alarm handler, waiting for one completed before anyone waits, giving up on
+   one that is never completed, and waiting for several at once.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "minithread.h"
+#include "synch.h"
+#include "alarm.h"
+#include "future.h"
+
+
+#define WAITERS 10
+#define MANY 8
+
+minithread_future_t shared;
+minithread_future_t many[MANY];
+semaphore_t woken;
+int woken_right = 0;
+
+
+/* Alarm handler completing one of many with 100 plus its index. */
+void complete_later(void* arg) {
+  minithread_future_t* future = (minithread_future_t*) arg;
+
+  future_complete(*future, 100 + (int) (future - many));
+}
+
+/* Alarm handler completing a future with 7. */
+void complete_seven(void* arg) {
+  future_complete((minithread_future_t) arg, 7);
+}
+
+int waiter(int* arg) {
+  int value = 0;
+
+  if (future_wait(shared, &value) == 0 && value == 42) {
+    __sync_fetch_and_add(&woken_right, 1);
+  }
+  semaphore_V(woken);
+  return 0;
+}
+
+int completer(int* arg) {
+  minithread_sleep_with_timeout(30);
+  future_complete(shared, 42);
+  return 0;
+}
+
+/* A future completed before anyone waits for it is seen at once by every kind of wait. */
+int completed_first_test() {
+  minithread_future_t future = future_create();
+  int value = 0;
+
+  if (future_poll(future, &value) != 0) return 0;
+  future_complete(future, 5);
+
+  if (future_poll(future, &value) != 1 || value != 5) return 0;
+  value = 0;
+  if (future_wait(future, &value) != 0 || value != 5) return 0;
+  value = 0;
+  if (future_wait_timeout(future, 10, &value) != 1 || value != 5) return 0;
+  if (future_wait_all(&future, 1) != 0) return 0;
+  if (future_wait_any(&future, 1) != 0) return 0;
+
+  future_destroy(future);
+  return 1;
+}
+
+/* Every thread waiting for a future wakes with its value, whether a thread or an alarm completes it. */
+int wait_test() {
+  minithread_future_t future;
+  int i, value = 0;
+
+  shared = future_create();
+  for (i = 0; i < WAITERS; i++) {
+    minithread_fork(waiter, NULL);
+  }
+  minithread_fork(completer, NULL);
+  for (i = 0; i < WAITERS; i++) {
+    semaphore_P(woken);
+  }
+  future_destroy(shared);
+  if (woken_right != WAITERS) return 0;
+
+  future = future_create();
+  register_alarm(20, complete_seven, future);
+  if (future_wait(future, &value) != 0 || value != 7) return 0;
+  future_destroy(future);
+
+  return 1;
+}
+
+/* A wait for a future nobody completes gives up after its delay. */
+int timeout_test() {
+  minithread_future_t future = future_create();
+  unsigned long long start = minithread_clock_now();
+  int value = 0;
+
+  if (future_wait_timeout(future, 50, &value) != 0) return 0;
+  if (minithread_clock_now() - start < 50 * MILLISECOND) return 0;
+  if (future_poll(future, &value) != 0) return 0;
+
+  future_destroy(future);
+  return 1;
+}
+
+/* Waiting for several futures: any returns the first completed, all returns once every one is. */
+int wait_many_test() {
+  int i, value;
+
+  // All but the first are completed by alarms, in reverse order 10ms apart; the first by hand, before it is waited for
+  for (i = 0; i < MANY; i++) {
+    many[i] = future_create();
+  }
+  for (i = 1; i < MANY; i++) {
+    register_alarm((MANY - i) * 10, complete_later, &many[i]);
+  }
+  if (future_wait_any(many + 1, MANY - 1) != MANY - 2) return 0;
+
+  future_complete(many[0], 100);
+  if (future_wait_any(many, MANY) != 0) return 0;
+
+  if (future_wait_all(many, MANY) != 0) return 0;
+  for (i = 0; i < MANY; i++) {
+    if (future_poll(many[i], &value) != 1 || value != 100 + i) return 0;
+    future_destroy(many[i]);
+  }
+
+  return 1;
+}
+
+
+int run_tests(int* arg) {
+  if (completed_first_test()) {
+    printf("Completed first success!!!\n");
+  } else {
+    printf("Completed first failure...\n");
+  }
+
+  if (wait_test()) {
+    printf("Wait success!!!\n");
+  } else {
+    printf("Wait failure...\n");
+  }
+
+  if (timeout_test()) {
+    printf("Timeout success!!!\n");
+  } else {
+    printf("Timeout failure...\n");
+  }
+
+  if (wait_many_test()) {
+    printf("Wait many success!!!\n");
+  } else {
+    printf("Wait many failure...\n");
+  }
+
+  exit(0);
+  return 0;
+}
+
+int main(void) {
+  woken = semaphore_create();
+  semaphore_initialize(woken, 0);
+  minithread_system_initialize(run_tests, NULL);
+  return 0;
+}
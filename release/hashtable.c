@@ -27,12 +27,14 @@ cache_elem_t cache_table_insert(cache_table_t table, network_address_t dest, cha
     }
 
     network_address_copy(dest, entry->dest);
-    entry->mutex = semaphore_create();
+    entry->mutex = semaphore_create_named("route entry mutex");
     semaphore_initialize(entry->mutex, 1);
-    entry->timeout = semaphore_create();
+    entry->timeout = semaphore_create_named("route discovery");
     semaphore_initialize(entry->timeout, 0);
     entry->expire = NULL;
-    entry->reply = NULL;
+    entry->awaiting_reply = 0;
+    entry->reply_timed_out = 0;
+    entry->discovery_alarm = NULL; // Registered by the first discovery
 
     index = hash_address(entry->dest) % table->size;
 
@@ -15,8 +15,10 @@ struct cache_elem {
 	int path_len;
 	semaphore_t mutex; // Mutex on cache element
 	semaphore_t timeout; // 12 sec discovery timeout alert
-	alarm_t expire; // 3 sec expire alarm
-	alarm_t reply; // 12 sec discovery timeout alarm
+	alarm_id expire; // 3 sec expire alarm
+	int awaiting_reply; // Set while a discovery waits for a reply; cleared by whichever of the network handler and the timeout wins
+	int reply_timed_out; // Set by the discovery timer when it wins awaiting_reply
+	alarm_id discovery_alarm; // Periodic discovery timer, reused across discoveries; parked between them
 };
 
 struct cache_table {
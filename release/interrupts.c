@@ -8,23 +8,28 @@
 #include <pthread.h>
 #include <ucontext.h>
 #include <semaphore.h>
+#include <sched.h>
+#include <sys/syscall.h>
 #include "defs.h"
 #include "interrupts.h"
 #include "interrupts_private.h"
 #include "minithread.h"
 #include "assert.h"
 #include "machineprimitives.h"
+#include "ring.h"
 
 #define MAXEVENTS 64
 #define DISK_INTERRUPT_TYPE 4
 #define READ_INTERRUPT_TYPE 3
 #define NETWORK_INTERRUPT_TYPE 2
 #define CLOCK_INTERRUPT_TYPE 1
+#define INTERRUPT_TYPES 5
+#define INTERRUPT_RING_CAPACITY 256
+#define INTERRUPT_DRAIN_BUDGET 32   /* most events handled per signal */
 #define MAXBUF 1000
 #define ENABLED 1
 #define DISABLED 0
 
-interrupt_level_t interrupt_level;
 long ticks;
 extern int start();
 extern int end();
@@ -32,9 +37,10 @@ extern int end();
 /*
  * Virtual processor interrupt level (spl).
  * Are interrupts enabled? A new interrupt will only be taken when interrupts
- * are enabled.
+ * are enabled. Each virtual processor runs on its own host thread, so the
+ * level is thread-local.
  */
-interrupt_level_t interrupt_level;
+__thread interrupt_level_t interrupt_level;
 
 typedef struct interrupt_t interrupt_t;
 struct interrupt_t {
@@ -44,6 +50,24 @@ struct interrupt_t {
 
 static pthread_mutex_t signal_mutex;
 
+/*
+ * Events of one type sent by the pollers but not yet handled. A poller puts
+ * its event on the ring and signals only if no signal for the type is on its
+ * way already; the handler invoked by the signal then handles every event on
+ * the ring, so that one signal round trip serves a whole burst of events.
+ */
+typedef struct interrupt_queue interrupt_queue_t;
+struct interrupt_queue {
+  int type;
+  ring_t pending;           /* events not yet handled */
+  volatile int signalled;   /* 1 from sending a signal until its handler starts */
+  volatile int resignal;    /* 1 if a drain left events for interrupt_resignal to signal */
+  interrupt_t interrupt;    /* what the signal runs: interrupt_drain on this queue */
+};
+
+static interrupt_queue_t interrupt_queues[INTERRUPT_TYPES];
+static sem_t resignal_sema;
+
 #define R8 0
 #define R9 1
 #define R10 2
@@ -65,6 +89,19 @@ static pthread_mutex_t signal_mutex;
        } while (0)
 
 
+/*
+ * Clock of each virtual processor. clock_armed[cpu] is when a one-shot clock
+ * is next due to interrupt (0 if not armed), so that arming it for a later
+ * time can skip the system call; arms from different processors are
+ * serialized by clock_lock[cpu]. The signal handler itself only clears or
+ * pushes back clock_armed, without the lock.
+ */
+static timer_t clock_timer[MAX_CLOCKS];
+static volatile unsigned long long clock_armed[MAX_CLOCKS];
+static tas_lock_t clock_lock[MAX_CLOCKS];
+static int clock_oneshot = 0;
+static __thread int clock_cpu;
+
 interrupt_handler_t mini_clock_handler;
 interrupt_handler_t mini_network_handler;
 interrupt_handler_t mini_read_handler;
@@ -79,9 +116,199 @@ sem_t interrupt_received_sema;
  * interrupt level
  */
 interrupt_level_t set_interrupt_level(interrupt_level_t newlevel) {
-    return swap(&interrupt_level, newlevel);
+    /*
+     * A single instruction, so a minithread cannot be preempted and moved to
+     * another processor between finding this processor's level and swapping it.
+     */
+    __asm__ volatile ("xchgl %0, %%fs:interrupt_level@tpoff"
+                      : "+r" (newlevel) : : "memory");
+    return newlevel;
+}
+
+/*
+ * Give the calling host thread its own signal stack and a clock that
+ * interrupts only that thread every [period] nanoseconds, or when armed
+ * if [period] is 0.
+ */
+static void clock_start(int cpu, int period) {
+    struct sigevent sev;
+    struct itimerspec its;
+    stack_t ss;
+
+    ss.ss_sp = malloc(SIGSTKSZ);
+    if (ss.ss_sp == NULL) {
+        perror("malloc.");
+        abort();
+    }
+    ss.ss_size = SIGSTKSZ;
+    ss.ss_flags = 0;
+    if (sigaltstack(&ss, NULL) == -1) {
+        perror("signal stack");
+        abort();
+    }
+
+    /* Create the timer */
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SIGRTMAX-1;
+    sev.sigev_value.sival_ptr = &clock_timer[cpu];
+    sev._sigev_un._tid = syscall(SYS_gettid);
+    /* Wall-clock time, so the clock keeps ticking while the idle thread is parked */
+    if (timer_create(CLOCK_MONOTONIC, &sev, &clock_timer[cpu]) == -1)
+        errExit("timer_create");
+    clock_cpu = cpu;
+
+    if (period == 0) {
+        clock_oneshot = 1;
+        return;
+    }
+
+    /* Start the timer */
+    its.it_value.tv_sec = (period) / 1000000000;
+    its.it_value.tv_nsec = (period) % 1000000000;
+    its.it_interval.tv_sec = its.it_value.tv_sec;
+    its.it_interval.tv_nsec = its.it_value.tv_nsec;
+
+    if (timer_settime(clock_timer[cpu], 0, &its, NULL) == -1)
+        errExit("timer_settime");
+}
+
+/*
+ * Set the one-shot clock of [cpu] to go off at [deadline].
+ */
+static void clock_set(int cpu, unsigned long long deadline) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = deadline / SECOND;
+    its.it_value.tv_nsec = deadline % SECOND;
+    clock_armed[cpu] = deadline;
+    timer_settime(clock_timer[cpu], TIMER_ABSTIME, &its, NULL);
+}
+
+void minithread_clock_arm(int cpu, unsigned long long deadline) {
+    unsigned long long armed, soonest;
+
+    if (!clock_oneshot || deadline == 0)
+        return;
+
+    soonest = minithread_clock_now() + CLOCK_MIN_DELAY;
+    if (deadline < soonest)
+        deadline = soonest;
+
+    atomic_spin_lock(&clock_lock[cpu]);
+    armed = clock_armed[cpu];
+    if (armed == 0 || deadline < armed)
+        clock_set(cpu, deadline);
+    atomic_clear(&clock_lock[cpu]);
+}
+
+unsigned long long minithread_clock_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * (unsigned long long) SECOND + now.tv_nsec;
+}
+
+
+static void interrupt_signal(interrupt_queue_t* queue);
+
+/*
+ * Handler run by a signal for a type of event: handle the events on the
+ * ring, in the order they were sent, one at a time and with interrupts
+ * disabled like a handler run by a signal of its own. If a handler switches
+ * to another minithread, the events behind it are handled when this one is
+ * switched back to, or by the signal for the next event sent, if sooner.
+ *
+ * At most INTERRUPT_DRAIN_BUDGET events are handled per signal, so that a
+ * full ring does not keep interrupts disabled for long; the rest are left to
+ * another signal, which interrupt_resignal sends, since a handler cannot
+ * wait for a signal to be taken.
+ */
+static void interrupt_drain(interrupt_queue_t* queue) {
+    interrupt_handler_t handler;
+    void* arg;
+    int handled;
+
+    if (queue->type == NETWORK_INTERRUPT_TYPE)
+        handler = mini_network_handler;
+    else if (queue->type == READ_INTERRUPT_TYPE)
+        handler = mini_read_handler;
+    else
+        handler = mini_disk_handler;
+
+    /* Events sent from here on get a signal of their own. */
+    queue->signalled = 0;
+
+    /*
+     * A handler may enable interrupts; disable them before taking the next
+     * event, or a signal taken in between could handle later events first.
+     */
+    for (handled = 0; handled < INTERRUPT_DRAIN_BUDGET; handled++) {
+        set_interrupt_level(DISABLED);
+        if ((arg = ring_get(queue->pending)) == NULL)
+            return;
+        handler(arg);
+    }
+
+    if (ring_length(queue->pending) > 0 &&
+            compare_and_swap((int*) &queue->signalled, 0, 1) == 0) {
+        queue->resignal = 1;
+        sem_post(&resignal_sema);
+    }
 }
 
+/*
+ * Host thread that sends the signal for events left on a ring by
+ * interrupt_drain.
+ */
+static void* interrupt_resignal(void* arg) {
+    int i;
+
+    for (;;) {
+        while (sem_wait(&resignal_sema) == -1)
+            ;
+        for (i = 0; i < INTERRUPT_TYPES; i++) {
+            if (interrupt_queues[i].resignal) {
+                interrupt_queues[i].resignal = 0;
+                interrupt_signal(&interrupt_queues[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Create the pending event ring of each type sent by the pollers, and the
+ * thread that signals for events left over by a drain.
+ */
+static void interrupt_queues_init() {
+    int types[] = {NETWORK_INTERRUPT_TYPE, READ_INTERRUPT_TYPE, DISK_INTERRUPT_TYPE};
+    interrupt_queue_t* queue;
+    pthread_t resignal_thread;
+    sigset_t set;
+    sigset_t old_set;
+    int i;
+
+    for (i = 0; i < (int) (sizeof(types) / sizeof(types[0])); i++) {
+        queue = &interrupt_queues[types[i]];
+        queue->type = types[i];
+        queue->pending = ring_new(INTERRUPT_RING_CAPACITY, RING_REJECT);
+        AbortOnCondition(queue->pending == NULL, "ring_new");
+        queue->signalled = 0;
+        queue->resignal = 0;
+        queue->interrupt.handler = (interrupt_handler_t) interrupt_drain;
+        queue->interrupt.arg = queue;
+    }
+
+    /* Like the pollers, the thread never takes an interrupt itself. */
+    sem_init(&resignal_sema, 0, 0);
+    sigfillset(&set);
+    sigprocmask(SIG_BLOCK, &set, &old_set);
+    AbortOnCondition(pthread_create(&resignal_thread, NULL, interrupt_resignal, NULL) != 0,
+        "pthread");
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+}
 
 /*
  * Register the minithread clock handler by making
@@ -96,26 +323,11 @@ interrupt_level_t set_interrupt_level(interrupt_level_t newlevel) {
  * chances of an overrun.
  */
 void minithread_clock_init(int period, interrupt_handler_t clock_handler) {
-    timer_t timerid;
-    struct sigevent sev;
-    struct itimerspec its;
     struct sigaction sa;
-    stack_t ss;
     mini_clock_handler = clock_handler;
 
     sem_init(&interrupt_received_sema,0,0);
-
-    ss.ss_sp = malloc(SIGSTKSZ);
-    if (ss.ss_sp == NULL) {
-        perror("malloc.");
-        abort();
-    }
-    ss.ss_size = SIGSTKSZ;
-    ss.ss_flags = 0;
-    if (sigaltstack(&ss, NULL) == -1) {
-        perror("signal stack");
-        abort();
-    }
+    interrupt_queues_init();
 
     if (DEBUG)
         printf("SIGRTMAX = %d\n",SIGRTMAX);
@@ -130,21 +342,11 @@ void minithread_clock_init(int period, interrupt_handler_t clock_handler) {
     if (sigaction(SIGRTMAX-1, &sa, NULL) == -1)
         errExit("sigaction");
 
-    /* Create the timer */
-    sev.sigev_notify = SIGEV_SIGNAL;
-    sev.sigev_signo = SIGRTMAX-1;
-    sev.sigev_value.sival_ptr = &timerid;
-    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timerid) == -1)
-        errExit("timer_create");
-
-    /* Start the timer */
-    its.it_value.tv_sec = (period) / 1000000000;
-    its.it_value.tv_nsec = (period) % 1000000000;
-    its.it_interval.tv_sec = its.it_value.tv_sec;
-    its.it_interval.tv_nsec = its.it_value.tv_nsec;
+    clock_start(0, period);
+}
 
-    if (timer_settime(timerid, 0, &its, NULL) == -1)
-        errExit("timer_settime");
+void minithread_clock_init_cpu(int cpu, int period) {
+    clock_start(cpu, period);
 }
 
 
@@ -154,6 +356,25 @@ void minithread_clock_init(int period, interrupt_handler_t clock_handler) {
  */
 void handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext) {
     uint64_t eip = ucontext->uc_mcontext.gregs[RIP];
+
+    /*
+     * A clock signal sent with pthread_kill is a wakeup kick for a parked
+     * idle processor, not a tick: ending its sigsuspend is all it is for.
+     */
+    if (sig==SIGRTMAX-1 && si->si_code==SI_TKILL)
+        return;
+
+    /*
+     * A one-shot clock is spent once it fires. If this interrupt cannot be
+     * taken now, try again shortly rather than lose it.
+     */
+    if (sig==SIGRTMAX-1 && clock_oneshot) {
+        if (interrupt_level==ENABLED && eip > (uint64_t)start && eip < (uint64_t)end)
+            clock_armed[clock_cpu] = 0;
+        else
+            clock_set(clock_cpu, minithread_clock_now() + CLOCK_RETRY);
+    }
+
     /*
      * This allows us to check the interrupt level
      * and effectively block other signals.
@@ -178,8 +399,18 @@ void handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext) {
 #define ROUND(X,Y)   (((unsigned long)X) & ~(Y-1)) /* Y must be a power of 2 */
         newsp = (unsigned long *) ROUND(newsp, 16);
         if (ucontext->uc_mcontext.fpregs!=0){
-            newsp -= sizeof(struct _fpstate)/sizeof(long);
-            memcpy(newsp,ucontext->uc_mcontext.fpregs,sizeof(struct _fpstate));
+            /*
+             * sigreturn reads the whole xsave area that follows the legacy
+             * fxsave state, so copy all of it and keep it 64-byte aligned.
+             * Otherwise the kernel reads past the copy, which faults when the
+             * interrupted stack ends at a guard page.
+             */
+            struct _fpx_sw_bytes *sw_bytes = (struct _fpx_sw_bytes *) &ucontext->uc_mcontext.fpregs->__glibc_reserved1[12];
+            unsigned long fpsize = sizeof(struct _fpstate);
+            if (sw_bytes->magic1 == FP_XSTATE_MAGIC1)
+                fpsize = sw_bytes->extended_size;
+            newsp = (unsigned long *) ROUND((char *) newsp - fpsize, 64);
+            memcpy(newsp,ucontext->uc_mcontext.fpregs,fpsize);
             ucontext->uc_mcontext.fpregs = (void *)newsp;
         }
 
@@ -221,24 +452,17 @@ void handle_interrupt(int sig, siginfo_t *si, ucontext_t *ucontext) {
     }
 }
 
-void send_interrupt(int interrupt_type, interrupt_handler_t handler, void* arg) {
-    interrupt_t interrupt;
+/*
+ * Deliver a signal that runs the handler of queue's events, resending it
+ * until a processor takes it.
+ */
+static void interrupt_signal(interrupt_queue_t* queue) {
     pthread_mutex_lock(&signal_mutex);
     for (;;) {
         signal_handled = 0;
 
-        interrupt.arg = arg;
-        if(interrupt_type==NETWORK_INTERRUPT_TYPE)
-            interrupt.handler = mini_network_handler;
-        else if(interrupt_type==READ_INTERRUPT_TYPE)
-            interrupt.handler = mini_read_handler;
-        else if(interrupt_type==DISK_INTERRUPT_TYPE)
-            interrupt.handler = mini_disk_handler;
-        else
-            abort();
-
         /* Repeat if signal is not delivered. */
-        while(sigqueue(getpid(),SIGRTMAX-2, (union sigval)(void*)&interrupt)==-1);
+        while(sigqueue(getpid(),SIGRTMAX-2, (union sigval)(void*)&queue->interrupt)==-1);
 
         /* semaphore_P to wait for main thread signal */
         sem_wait(&interrupt_received_sema);
@@ -252,3 +476,22 @@ void send_interrupt(int interrupt_type, interrupt_handler_t handler, void* arg)
     }
     pthread_mutex_unlock(&signal_mutex);
 }
+
+void send_interrupt(int interrupt_type, interrupt_handler_t handler, void* arg) {
+    interrupt_queue_t* queue;
+
+    if (interrupt_type < 0 || interrupt_type >= INTERRUPT_TYPES ||
+            interrupt_queues[interrupt_type].pending == NULL)
+        abort();
+    queue = &interrupt_queues[interrupt_type];
+
+    /* A full ring drains once the signal for its events is taken. */
+    while (ring_put(queue->pending, arg, NULL) == -1) {
+        if (compare_and_swap((int*) &queue->signalled, 0, 1) == 0)
+            interrupt_signal(queue);
+        sched_yield();
+    }
+
+    if (compare_and_swap((int*) &queue->signalled, 0, 1) == 0)
+        interrupt_signal(queue);
+}
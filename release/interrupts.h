@@ -48,8 +48,8 @@
  * disabled.
  *
  * the exception to this is when you're disabling interrupts before a call
- * to minithread_switch: the minithread switch code resets the interrupt
- * level to ENABLED itself.
+ * to minithread_switch: the scheduler resets the interrupt level to ENABLED
+ * itself once the switch has completed.
  *
  * Interrupts that occur while interrupts are disabled are dropped, so you
  * should minimize the amount of time interrupts are disabled in order to
@@ -57,7 +57,7 @@
  */
 
 typedef int interrupt_level_t;
-extern interrupt_level_t interrupt_level;
+extern __thread interrupt_level_t interrupt_level;     /* one per virtual processor */
 
 #define DISABLED 0
 #define ENABLED 1
@@ -80,5 +80,38 @@ extern interrupt_level_t set_interrupt_level(interrupt_level_t newlevel);
 typedef void(*interrupt_handler_t)(void*);
 extern void minithread_clock_init(int period, interrupt_handler_t h);
 
+/*
+ * minithread_clock_init_cpu(cpu,period)
+ *     starts a clock for additional virtual processor [cpu] (the first
+ *     processor, which calls minithread_clock_init, is 0). Must be called on
+ *     that processor's host thread, after minithread_clock_init. The handler
+ *     installed by minithread_clock_init then also runs on this processor
+ *     every [period] nanoseconds.
+ */
+#define MAX_CLOCKS 32
+extern void minithread_clock_init_cpu(int cpu, int period);
+
+/*
+ * A [period] of 0 makes the clocks one-shot: a processor's clock is silent
+ * until minithread_clock_arm(cpu,deadline) sets it to interrupt processor
+ * [cpu] once the time is [deadline] nanoseconds on minithread_clock_now(),
+ * which may be called from any processor. Arming only ever moves a pending
+ * interrupt earlier; an interrupt that comes early is the handler's to
+ * ignore, and one that has to be dropped is retried every CLOCK_RETRY
+ * nanoseconds until it is taken. A deadline less than CLOCK_MIN_DELAY away
+ * is pushed back to it, since the caller has interrupts disabled and an
+ * interrupt raised at once would have to be dropped.
+ */
+#define CLOCK_RETRY (1*MILLISECOND)
+#define CLOCK_MIN_DELAY (50*MICROSECOND)
+extern void minithread_clock_arm(int cpu, unsigned long long deadline);
+
+/*
+ * minithread_clock_now()
+ *     returns the current time, in nanoseconds, on the monotonic clock that
+ *     drives the clock interrupts.
+ */
+extern unsigned long long minithread_clock_now();
+
 #endif /* __INTERRUPTS_H__ */
 
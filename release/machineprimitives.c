@@ -12,6 +12,7 @@
 #include "minithread.h"
 #include "machineprimitives.h"
 #include <sys/mman.h>
+#include <unistd.h>
 
 /*
  * Used to initialize a thread's stack for the first context switch
@@ -48,11 +49,182 @@ struct initial_stack_state {
 #define STACKSIZE               (256 * 1024)
 #define STACKALIGN              0xf
 
+/*
+ * The lowest word of a stack is never written by a thread that stays within
+ * its stack. It is 0 on a stack with a guard page below it (so that page is
+ * not committed until the thread gets that deep) and STACK_CANARY on a stack
+ * without one; any other value means the stack overflowed.
+ */
+#define STACK_CANARY            0x57ac4ca7a57ac4caUL
+
+/*
+ * Stack cache. Size class i holds stacks of STACK_CLASS_MIN << i bytes; freed
+ * stacks are threaded onto their class's free list through their highest word,
+ * which the thread has touched already. Stacks larger than the biggest class
+ * bypass the cache.
+ */
+#define STACK_CLASS_MIN         (16 * 1024)
+#define STACK_CLASSES           8
+#define STACK_CACHE_LIMIT       64      /* max free stacks kept per class */
+
+typedef struct stack_class stack_class;
+struct stack_class {
+  void *free_list;
+  int count;
+};
+
+static stack_class stack_cache[STACK_CLASSES];
+static tas_lock_t stack_cache_lock = 0;    /* shared by all virtual processors */
+static unsigned long stack_cache_hits = 0;
+static unsigned long stack_cache_misses = 0;
+
+#define STACK_LINK(base, size)  (*((void **) ((char *) (base) + (size) - sizeof(void *))))
+
+/*
+ * Each guard page splits off a kernel mapping. Guards are handed out only
+ * while guarded stacks use under a quarter of vm.max_map_count, leaving the
+ * rest of the process room for its own mappings; later stacks rely on their
+ * canary alone, and their mappings merge.
+ */
+static int stack_guards_left = -1;
+
+/*
+ * Return the size class for a stack of size bytes, or -1 if it is too big to cache.
+ */
+static int stack_class_of(int size) {
+    int class = 0;
+
+    while (class < STACK_CLASSES && (STACK_CLASS_MIN << class) < size)
+      class++;
+
+    return (class < STACK_CLASSES) ? class : -1;
+}
+
+/*
+ * Claim a guard page from the budget; return 1 on success, 0 if none are left.
+ */
+static int stack_guard_take() {
+    interrupt_level_t old_level;
+    FILE *f;
+    int max_map_count = 65530, taken = 0;
+
+    if (!STACK_GUARD_PAGE)
+      return 0;
+
+    if (stack_guards_left < 0) {
+      f = fopen("/proc/sys/vm/max_map_count", "r");
+      if (f != NULL) {
+        if (fscanf(f, "%d", &max_map_count) != 1)
+          max_map_count = 65530;
+        fclose(f);
+      }
+      stack_guards_left = max_map_count / 8;    /* two mappings per guarded stack */
+    }
+
+    old_level = set_interrupt_level(DISABLED);
+    atomic_spin_lock(&stack_cache_lock);
+    if (stack_guards_left > 0) {
+      stack_guards_left--;
+      taken = 1;
+    }
+    atomic_clear(&stack_cache_lock);
+    set_interrupt_level(old_level);
+
+    return taken;
+}
+
+/*
+ * Return a guard page to the budget.
+ */
+static void stack_guard_give() {
+    interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+    atomic_spin_lock(&stack_cache_lock);
+    stack_guards_left++;
+    atomic_clear(&stack_cache_lock);
+    set_interrupt_level(old_level);
+}
+
+/*
+ * Get fresh memory for a stack of size bytes from the system. The region is
+ * only reserved: pages are committed as the thread first touches them, so a
+ * thread costs the stack depth it actually uses rather than size.
+ */
+static void *stack_memory_new(int size) {
+    long page = sysconf(_SC_PAGESIZE);
+    int guarded = stack_guard_take();
+    char *region;
+
+    region = mmap(NULL, size + (guarded ? page : 0), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+      if (guarded)
+        stack_guard_give();
+      return NULL;
+    }
+
+    if (guarded) {
+      /* Overflowing the stack faults on the guard page instead of corrupting the heap */
+      if (mprotect(region, page, PROT_NONE) == 0)
+        return region + page;
+
+      /* Out of mappings after all; trim the would-be guard off and use a canary */
+      munmap(region, page);
+      stack_guard_give();
+      region += page;
+    }
+
+    *((unsigned long *) region) = STACK_CANARY;
+    return region;
+}
+
+/*
+ * Return the memory of a stack of size bytes to the system.
+ */
+static void stack_memory_free(void *stackbase, int size) {
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (*((unsigned long *) stackbase) == STACK_CANARY) {
+      munmap(stackbase, size);
+    } else {
+      munmap((char *) stackbase - page, size + page);
+      stack_guard_give();
+    }
+}
+
 /*
  * Allocate a new stack.
  */
 void minithread_allocate_stack(stack_pointer_t *stackbase, stack_pointer_t *stacktop) {
-    *stackbase = (stack_pointer_t) malloc(STACKSIZE);
+    minithread_allocate_stack_size(stackbase, stacktop, STACKSIZE);
+}
+
+/*
+ * Allocate a new stack of at least size bytes, reusing a cached one if possible.
+ */
+void minithread_allocate_stack_size(stack_pointer_t *stackbase, stack_pointer_t *stacktop, int size) {
+    interrupt_level_t old_level;
+    int class = stack_class_of(size);
+
+    *stackbase = NULL;
+    if (class >= 0)
+      size = STACK_CLASS_MIN << class;
+
+    old_level = set_interrupt_level(DISABLED);
+    atomic_spin_lock(&stack_cache_lock);
+    if (class >= 0 && stack_cache[class].free_list != NULL) {
+      *stackbase = (stack_pointer_t) stack_cache[class].free_list;
+      stack_cache[class].free_list = STACK_LINK(*stackbase, size);
+      stack_cache[class].count--;
+      stack_cache_hits++;
+    } else {
+      stack_cache_misses++;
+    }
+    atomic_clear(&stack_cache_lock);
+    set_interrupt_level(old_level);
+
+    if (*stackbase == NULL)
+      *stackbase = (stack_pointer_t) stack_memory_new(size);
     if (!*stackbase) {
     	return;
     }
@@ -60,7 +232,7 @@ void minithread_allocate_stack(stack_pointer_t *stackbase, stack_pointer_t *stac
     if (STACK_GROWS_DOWN)
       /* Stacks grow down, but malloc grows up. Compensate and word align
          (turn off low 2 bits by anding with ~3). */
-      *stacktop = (stack_pointer_t) ((long)((char*)*stackbase + STACKSIZE - 1) & ~STACKALIGN);
+      *stacktop = (stack_pointer_t) ((long)((char*)*stackbase + size - 1) & ~STACKALIGN);
     else {
       /* Word align (turn off low 2 bits by anding with ~3) */
       *stacktop = (stack_pointer_t)(((long)*stackbase + 3)&~STACKALIGN);
@@ -73,7 +245,65 @@ void minithread_allocate_stack(stack_pointer_t *stackbase, stack_pointer_t *stac
  * The stack cannot be used after this call.
  */
 void minithread_free_stack(stack_pointer_t stackbase) {
-    free(stackbase);
+    minithread_free_stack_size(stackbase, STACKSIZE);
+}
+
+/*
+ * Free a stack of the given size, keeping it cached for reuse if its class has room.
+ */
+void minithread_free_stack_size(stack_pointer_t stackbase, int size) {
+    interrupt_level_t old_level;
+    int class = stack_class_of(size);
+
+    if (stackbase == NULL)
+      return;
+
+    if (class >= 0) {
+      old_level = set_interrupt_level(DISABLED);
+      atomic_spin_lock(&stack_cache_lock);
+      if (stack_cache[class].count < STACK_CACHE_LIMIT) {
+        STACK_LINK(stackbase, STACK_CLASS_MIN << class) = stack_cache[class].free_list;
+        stack_cache[class].free_list = stackbase;
+        stack_cache[class].count++;
+        stackbase = NULL;
+      }
+      atomic_clear(&stack_cache_lock);
+      set_interrupt_level(old_level);
+      size = STACK_CLASS_MIN << class;
+    }
+
+    if (stackbase != NULL)
+      stack_memory_free(stackbase, size);
+}
+
+/*
+ * Check the canary at the bottom of a stack.
+ */
+int minithread_stack_check(stack_pointer_t stackbase) {
+    unsigned long bottom;
+
+    if (stackbase == NULL)
+      return 0;
+
+    bottom = *((unsigned long *) stackbase);
+    return (bottom == 0 || bottom == STACK_CANARY) ? 0 : -1;
+}
+
+/*
+ * Is addr inside the guard page below the stack at stackbase?
+ */
+int minithread_stack_guard_hit(stack_pointer_t stackbase, void *addr) {
+    char *base = (char *) stackbase;
+
+    return stackbase != NULL && (char *) addr >= base - sysconf(_SC_PAGESIZE) && (char *) addr < base;
+}
+
+/*
+ * Report stack cache hit and miss counts.
+ */
+void minithread_stack_cache_stats(unsigned long *hits, unsigned long *misses) {
+    *hits = stack_cache_hits;
+    *misses = stack_cache_misses;
 }
 
 /*
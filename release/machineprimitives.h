@@ -46,6 +46,50 @@ extern void minithread_allocate_stack(stack_pointer_t *stackbase,
  */
 extern void minithread_free_stack(stack_pointer_t stackbase);
 
+/*
+ * minithread_allocate_stack_size(stackbase, stacktop, size)
+ * minithread_free_stack_size(stackbase, size)
+ *
+ * As above, for a stack of at least size bytes. Freed stacks are kept on a
+ * free list per size class and handed back out by later allocations of the
+ * same class, so threads that come and go do not hit the allocator. A stack
+ * must be freed with the same size it was allocated with.
+ */
+extern void minithread_allocate_stack_size(stack_pointer_t *stackbase,
+                                           stack_pointer_t *stacktop,
+                                           int size);
+
+extern void minithread_free_stack_size(stack_pointer_t stackbase, int size);
+
+/*
+ * minithread_stack_check(stack_pointer_t stackbase)
+ *
+ * Stacks are reserved address space that is committed only as it is used, so
+ * a thread's memory footprint is the depth it actually reaches. When
+ * STACK_GUARD_PAGE is set, stacks get an inaccessible guard page below them
+ * for as long as the kernel's mapping limit allows; the rest carry a canary
+ * in their lowest word. Return 0 if the stack at stackbase is intact, or -1
+ * if the thread running on it has overflowed.
+ */
+extern int minithread_stack_check(stack_pointer_t stackbase);
+
+/*
+ * minithread_stack_guard_hit(stack_pointer_t stackbase, void *addr)
+ *
+ * Return 1 if addr lies in the guard page of the stack at stackbase (i.e. a
+ * fault at addr is a stack overflow), or 0 otherwise.
+ */
+extern int minithread_stack_guard_hit(stack_pointer_t stackbase, void *addr);
+
+/*
+ * minithread_stack_cache_stats(hits, misses)
+ *
+ * Report how many stack allocations were served from the cache (hits) and
+ * how many had to allocate fresh memory (misses).
+ */
+extern void minithread_stack_cache_stats(unsigned long *hits,
+                                         unsigned long *misses);
+
 /*
  *  Initialize the stackframe pointed to by *stacktop so that
  *  the thread running off of *stacktop will invoke:
@@ -101,6 +145,18 @@ extern int atomic_test_and_set(tas_lock_t *l);
  */
 extern void atomic_clear(tas_lock_t *l);
 
+/*
+ *  Spin until the lock at l is acquired. Virtual processors are host threads,
+ *  so call with interrupts disabled and hold the lock only briefly.
+ */
+extern void atomic_spin_lock(tas_lock_t *l);
+
+/*
+ *  Tell the processor that the caller is busy-waiting, so that it can save
+ *  power and let a sibling hyperthread run.
+ */
+extern void cpu_relax();
+
 /*
  * Atomically set the value pointed to be x to be newval, and return
  * the old value of x.
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>     // included for currentTimeMillis
+#include <sched.h>
 #include <sys/timeb.h>
 
 #include "defs.h"
@@ -51,6 +52,33 @@ void atomic_clear(tas_lock_t *l) {
 	*l = 0;	
 }
 
+/*
+ * atomic_spin_lock
+ *
+ * test-and-test-and-set; after SPIN_LIMIT failed tries the host CPU is
+ * given up, since the holder's host thread may have been descheduled
+ */
+#define SPIN_LIMIT 100
+
+void atomic_spin_lock(tas_lock_t *l) {
+	int spins = 0;
+
+	while (atomic_test_and_set(l) == 1) {
+		while (*(volatile tas_lock_t *) l) {
+			if (++spins == SPIN_LIMIT) {
+				sched_yield();
+				spins = 0;
+			} else {
+				cpu_relax();
+			}
+		}
+	}
+}
+
+void cpu_relax() {
+	__asm__ volatile ("pause" : : : "memory");
+}
+
 
 /*
  * minithread_root
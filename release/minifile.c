@@ -7,9 +7,8 @@
 #include <string.h>
 
 
-semaphore_t metadata_mutex; // Mutex for metadata accesses spanning multiple inodes (creating, deleting files & directories that require directory inodes to change)
 file_description_t* file_description_table;
-semaphore_t fdt_mutex; // Mutex for file_description_table - DO NOT USE TO PROTECT P() AND V() ON file_description mutex's
+rwlock_t fdt_lock; // Lock for file_description_table - DO NOT USE TO PROTECT LOCKING AND UNLOCKING file_description locks
 mmbm_t requests; // Map for current requests
 semaphore_t mmbm_sema; // Sema for getting entry in mmbm_t
 semaphore_t mmbm_mutex; // Mutex for mmbm_t
@@ -72,13 +71,13 @@ minifile_t minifile_open(char *filename, char *mode) {
 	}
 
 	// Update (or create) file description table entry
-	semaphore_P(fdt_mutex);
+	rwlock_write_lock(fdt_lock);
 	if (file_description_table[block_num] == NULL) {
 		create file description table element;
 		add element to table;
 	}
 	file_description_table[block_num]->open_handles++;
-	semaphore_V(fdt_mutex);
+	rwlock_write_unlock(fdt_lock);
 
 	// Create minifile
 	if ((file = malloc(sizeof(struct minifile))) == NULL) {
@@ -111,9 +110,9 @@ minifile_t minifile_open(char *filename, char *mode) {
 
 
 
-	// semaphore_P(file_description_table[block_num]->mutex);
+	// rwlock_read_lock(file_description_table[block_num]->lock);
 	// read file into read buffer of minifile
-	// semaphore_V(file_description_table[block_num]->mutex)
+	// rwlock_read_unlock(file_description_table[block_num]->lock)
 
 	return file;
 }
@@ -193,12 +192,12 @@ int minifile_mkdir(char *dirname) {
 	}
 
 	// Lock superblock fdt entry
-	semaphore_P(file_description_table[0]->mutex);
+	rwlock_write_lock(file_description_table[0]->lock);
 	
 	// Read superblock inode
 	if ((error = minifile_read_block(&disk, 0, superblock_buffer)) < 0) {
 		fprintf(stderr, "ERROR: minifile_mkdir() failed to read block %i\n", error);
-		semaphore_V(file_description_table[0]->mutex);
+		rwlock_write_unlock(file_description_table[0]->lock);
 		return -1;
 	}
 
@@ -206,7 +205,7 @@ int minifile_mkdir(char *dirname) {
 	superblk = (superblock_t) superblock_buffer;
 	if ((free_inodes = unpack_unsigned_int(superblk->data.free_inodes)) < 1) {
 		fprintf(stderr, "ERROR: minifile_mkdir() encountered no more inodes\n");
-		semaphore_V(file_description_table[0]->mutex);
+		rwlock_write_unlock(file_description_table[0]->lock);
 		return -1;
 	} else {
 		pack_unsigned_int(superblk->data.free_inodes, free_inodes - 1);
@@ -215,13 +214,13 @@ int minifile_mkdir(char *dirname) {
 	dir_inode = unpack_unsigned_int(superblk->data.first_free_inode); // inode to store new directory
 	if ((error = minifile_read_block(&disk, dir_inode, target_buffer)) < 0) {
 		fprintf(stderr, "ERROR: minifile_mkdir() failed to read block %i\n", error);
-		semaphore_V(file_description_table[0]->mutex);
+		rwlock_write_unlock(file_description_table[0]->lock);
 		return -1;
 	}
 	ddb_num = unpack_unsigned_int(superblk->data.first_free_data_block); // inode to store new directory
 	if ((error = minifile_read_block(&disk, ddb_num, ddb_buffer)) < 0) {
 		fprintf(stderr, "ERROR: minifile_mkdir() failed to read block %i\n", error);
-		semaphore_V(file_description_table[0]->mutex);
+		rwlock_write_unlock(file_description_table[0]->lock);
 		return -1;
 	}
 	dir = (inode_t) target_buffer;
@@ -246,10 +245,10 @@ int minifile_mkdir(char *dirname) {
 	}
 
 	// Unlock superblock fdt entry
-	semaphore_V(file_description_table[0]->mutex);
+	rwlock_write_unlock(file_description_table[0]->lock);
 
 	// Lock fdt entry from other threads accessing this file while we read
-	semaphore_P(file_description_table[wd]->mutex);
+	rwlock_write_lock(file_description_table[wd]->lock);
 	
 	// Read working directory inode
 	if ((error = minifile_read_block(&disk, wd, wd_buffer)) < 0) {
@@ -262,7 +261,7 @@ int minifile_mkdir(char *dirname) {
 	// Ensure current working directory is, in fact, a directory
 	if (ind->data.inode_type == FIL) {
 		fprintf(stderr, "ERROR: minifile_mkdir() called and current working directory is a non-directory!\n");
-		semaphore_V(file_description_table[wd]->mutex);
+		rwlock_write_unlock(file_description_table[wd]->lock);
 		// TODO: Flag to reverse superblock changes
 		return -1;
 	} else if (ind->data.inode_type != DIR) {
@@ -279,7 +278,7 @@ int minifile_mkdir(char *dirname) {
 
 
 	// Unlock fdt entry
-	semaphore_V(file_description_table[wd]->mutex);
+	rwlock_write_unlock(file_description_table[wd]->lock);
 
 	// Update directory inode
 	dir->data.inode_type = DIR;
@@ -372,7 +371,7 @@ int minifile_rmdir(char *dirname) {
 	// Ensure directory is, in fact, a directory
 	if (dir->data.inode_type == FIL) {
 		fprintf(stderr, "ERROR: minifile_rmdir() called and directory points to a non-directory!\n");
-		// semaphore_V(file_description_table[wd]->mutex);
+		// rwlock_write_unlock(file_description_table[wd]->lock);
 		// TODO: Flag to reverse superblock changes
 		return -1;
 	} else if (dir->data.inode_type != DIR) {
@@ -409,7 +408,7 @@ int minifile_stat(char *path) {
 	}
 
 	// Lock fdt entry from other threads accessing this file while we read
-	semaphore_P(file_description_table[block_num]->mutex);
+	rwlock_read_lock(file_description_table[block_num]->lock);
 	
 	if ((error = minifile_read_block(&disk, block_num, block_buffer)) < 0) {
 		fprintf(stderr, "ERROR: minifile_stat() failed to read block %i\n", error);
@@ -417,7 +416,7 @@ int minifile_stat(char *path) {
 	}
 
 	// Unlock fdt entry
-	semaphore_V(file_description_table[block_num]->mutex);
+	rwlock_read_unlock(file_description_table[block_num]->lock);
 
 	ind = (inode_t) block_buffer;
 
@@ -444,7 +443,7 @@ int minifile_cd(char *path) {
 	}
 
 	// Lock fdt entry from other threads accessing this file while we read
-	semaphore_P(file_description_table[block_num]->mutex);
+	rwlock_read_lock(file_description_table[block_num]->lock);
 	
 	if ((error = minifile_read_block(&disk, block_num, block_buffer)) < 0) {
 		fprintf(stderr, "ERROR: minifile_cd() failed to read block %i\n", error);
@@ -452,7 +451,7 @@ int minifile_cd(char *path) {
 	}
 
 	// Unlock fdt entry
-	semaphore_V(file_description_table[block_num]->mutex);
+	rwlock_read_unlock(file_description_table[block_num]->lock);
 
 	ind = (inode_t) block_buffer;
 
@@ -498,7 +497,6 @@ char** minifile_ls(char *path) {
 	// Ensure directory is, in fact, a directory
 	if (dir->data.inode_type == FIL) {
 		fprintf(stderr, "ERROR: minifile_ls() called and path points to a non-directory!\n");
-		semaphore_V(file_description_table[wd]->mutex);
 		// TODO: Flag to reverse superblock changes
 		return -1;
 	} else if (dir->data.inode_type != DIR) {
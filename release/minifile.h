@@ -20,7 +20,6 @@ typedef struct mutex_mem_buffer_map* mmbm_t;
 
 typedef enum {R, RP, W, WP, A, AP} file_mode_t;
 
-extern semaphore_t metadata_mutex; // Mutex for metadata accesses spanning multiple inodes
 extern file_description_t* file_description_table;
 extern mmbm_t requests; // Map for current requests
 extern semaphore_t mmbm_sema; // Sema for getting entry in mmbm_t
@@ -47,7 +46,7 @@ struct minifile {
 struct file_description {
 	int inode_num; // Redundant (given from current index within file_description_table)
 	int open_handles; // Number of open handles to this inode
-	semaphore_t mutex; // Used only for reading & writing this file's inode or its data blocks
+	rwlock_t lock; // Used only for reading & writing this file's inode or its data blocks; readers share it
 };
 
 struct mutex_mem_buffer_map {
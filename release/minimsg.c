@@ -17,29 +17,20 @@ semaphore_t msgmutex = NULL; // Mutual exclusion semaphore
 
 /* performs any required initialization of the minimsg layer. */
 void minimsg_initialize() {
-	int i;
-
-	msgmutex = semaphore_create();
+	msgmutex = semaphore_create_named("msgmutex");
     semaphore_initialize(msgmutex, 1);
 
-    bound_ports_free = semaphore_create();
+    bound_ports_free = semaphore_create_named("bound_ports_free");
     semaphore_initialize(bound_ports_free, BOUND_MAX_PORT_NUM - BOUND_MIN_PORT_NUM + 1);
 
-    // Initialize ports array
-	ports = (miniport_t*) malloc((BOUND_MAX_PORT_NUM + 1) * sizeof(miniport_t));
+    // Initialize ports array; unbound ports (and their rings) are created on first use, and
+    // datagrams for ports nobody has created are dropped by the network handler
+	ports = (miniport_t*) calloc(BOUND_MAX_PORT_NUM + 1, sizeof(miniport_t));
 
 	if (ports == NULL) { // Fail if malloc() fails
       fprintf(stderr, "ERROR: minimsg_initialize() failed to malloc miniport_t array\n");
       return;
     }
-
-    // Initialize each unbound port's data elements
-    for (i = UNBOUND_MIN_PORT_NUM; i <= UNBOUND_MAX_PORT_NUM; i++) {
-    	miniport_create_unbound(i);
-    	ports[i]->u.unbound.incoming_data = queue_new();
-    	ports[i]->u.unbound.datagrams_ready = semaphore_create();
-    	semaphore_initialize(ports[i]->u.unbound.datagrams_ready, 0);
-    }
 }
 
 
@@ -73,8 +64,14 @@ miniport_t miniport_create_unbound(int port_number) {
 
 		unbound_port->port_type = UNBOUND;
 		unbound_port->port_num = port_number;
-		unbound_port->u.unbound.incoming_data = queue_new();
-		unbound_port->u.unbound.datagrams_ready = semaphore_create();
+		unbound_port->u.unbound.incoming_data = ring_new(MINIPORT_RING_CAPACITY, RING_DROP_OLDEST); // Favour fresh datagrams
+		if (unbound_port->u.unbound.incoming_data == NULL) {
+			fprintf(stderr, "ERROR: miniport_create_unbound() failed to create incoming ring\n");
+			free(unbound_port);
+			semaphore_V(msgmutex);
+			return NULL;
+		}
+		unbound_port->u.unbound.datagrams_ready = semaphore_create_named("port datagrams_ready");
 		semaphore_initialize(unbound_port->u.unbound.datagrams_ready, 0); // Counting semaphore
 
 		ports[port_number] = unbound_port;
@@ -268,7 +265,7 @@ int minimsg_receive(miniport_t local_unbound_port, miniport_t* new_local_bound_p
 	// semaphore_P(msgmutex);
 
 	// Obtain received message from miniport queue and extract header data
-	if (queue_dequeue(local_unbound_port->u.unbound.incoming_data, (void**) &packet) < 0) {
+	if ((packet = ring_get(local_unbound_port->u.unbound.incoming_data)) == NULL) {
 		fprintf(stderr, "ERROR: minimsg_receive() failed to dequeue message from miniport queue\n");
 		semaphore_V(msgmutex);
 		return -1;
@@ -306,4 +303,51 @@ int minimsg_receive(miniport_t local_unbound_port, miniport_t* new_local_bound_p
  	// semaphore_V(msgmutex);
 
     return sizeof(msg);
-}
\ No newline at end of file
+}
+
+/*
+ * Incoming ring of an unbound miniport, copied for miniport_stats_dump.
+ */
+typedef struct miniport_snapshot miniport_snapshot;
+struct miniport_snapshot {
+	int port_num;
+	int length;
+	ring_stats_t stats;
+};
+
+/* Prints the incoming ring counters of every unbound miniport to stdout. */
+void miniport_stats_dump() {
+	miniport_snapshot* snapshot;
+	int port, i, n = 0;
+
+	semaphore_P(msgmutex);
+	for (port = UNBOUND_MIN_PORT_NUM; port <= UNBOUND_MAX_PORT_NUM; port++) {
+		if (ports[port] != NULL) {
+			n++;
+		}
+	}
+	snapshot = (miniport_snapshot*) malloc((n > 0 ? n : 1) * sizeof(miniport_snapshot));
+	if (snapshot == NULL) { // malloc() failed
+		semaphore_V(msgmutex);
+		fprintf(stderr, "ERROR: miniport_stats_dump() failed to malloc snapshot\n");
+		return;
+	}
+	// Copy the counters under msgmutex, so that ports are not destroyed meanwhile
+	for (port = UNBOUND_MIN_PORT_NUM, i = 0; port <= UNBOUND_MAX_PORT_NUM; port++) {
+		if (ports[port] != NULL) {
+			snapshot[i].port_num = port;
+			snapshot[i].length = ring_length(ports[port]->u.unbound.incoming_data);
+			ring_stats(ports[port]->u.unbound.incoming_data, &snapshot[i].stats);
+			i++;
+		}
+	}
+	semaphore_V(msgmutex);
+
+	printf("%6s %6s %8s %8s %8s %8s %6s\n", "port", "queued", "puts", "gets", "rejected", "evicted", "high");
+	for (i = 0; i < n; i++) {
+		printf("%6i %6i %8i %8i %8i %8i %6i\n", snapshot[i].port_num, snapshot[i].length, snapshot[i].stats.puts,
+			snapshot[i].stats.gets, snapshot[i].stats.rejected, snapshot[i].stats.evicted, snapshot[i].stats.high_water);
+	}
+
+	free(snapshot);
+}
@@ -13,6 +13,7 @@
 
 #include "synch.h"
 #include "queue.h"
+#include "ring.h"
 #include <stdio.h>
 
 #include "miniroute.h"
@@ -28,13 +29,16 @@
 #define BOUND_MIN_PORT_NUM 32768
 #define BOUND_MAX_PORT_NUM 65536
 
+// Datagrams an unbound port buffers before dropping the oldest
+#define MINIPORT_RING_CAPACITY 16
+
 
 struct miniport { 
  	char port_type; 
  	int port_num;
 	union { 
  		struct { 
- 			queue_t incoming_data; 
+ 			ring_t incoming_data; 
  			semaphore_t datagrams_ready;
  		} unbound; 
  	
@@ -105,4 +109,10 @@ extern int minimsg_send(miniport_t local_unbound_port, miniport_t local_bound_po
  */
 extern int minimsg_receive(miniport_t local_unbound_port, miniport_t* new_local_bound_port, minimsg_t msg, int *len);
 
+/* Prints, for every unbound miniport, the counters of its incoming ring: datagrams queued now,
+ * put, taken, refused and evicted so far, and the most ever queued at once. Datagrams evicted
+ * to make room for fresh ones were lost to a receiver that did not keep up.
+ */
+extern void miniport_stats_dump();
+
 #endif /*__MINIMSG_H__*/
\ No newline at end of file
@@ -3,15 +3,14 @@
 
 // Miniroute data structures
 cache_table_t cache;
-semaphore_t cache_mutex = NULL;
+rwlock_t cache_lock = NULL; // Lookups share it; only inserting into the cache takes it for writing
 unsigned int id = 0; // id for Route Discovery and Route Reply packets // How many to allow? Unsigned?
 
 
 /* Performs any initialization of the miniroute layer, if required. */
 void miniroute_initialize() {
-	// Initialize mutex for cache accesses
-	cache_mutex = semaphore_create();
-    semaphore_initialize(cache_mutex, 1);
+	// Initialize lock for cache accesses
+	cache_lock = rwlock_create();
 
     // Init Cache
     cache = cache_table_new();
@@ -39,9 +38,9 @@ int miniroute_send_pkt(network_address_t dest_address, int hdr_len, char* hdr, i
 		return -1;
 	}
 
-	semaphore_P(cache_mutex);
+	rwlock_read_lock(cache_lock);
 	dest_elem = cache_table_get(cache, dest_address);
-	semaphore_V(cache_mutex);
+	rwlock_read_unlock(cache_lock);
 
 	if (dest_elem == NULL) { // Need to Discover path
 		fprintf(stderr, "Discovering path...\n");
@@ -51,9 +50,9 @@ int miniroute_send_pkt(network_address_t dest_address, int hdr_len, char* hdr, i
 			return -1;
 		}
 
-		semaphore_P(cache_mutex);
+		rwlock_read_lock(cache_lock);
 		dest_elem = cache_table_get(cache, dest_address);
-		semaphore_V(cache_mutex);
+		rwlock_read_unlock(cache_lock);
 	} else if (dest_elem->path[0][0] == 0) {
 		fprintf(stderr, "ERROR: miniroute_send_pkt() found non-null cache entry with null path\n");
 		return -1;
@@ -119,39 +118,16 @@ unsigned short hash_address(network_address_t address) {
 
 /* ROUTE DISCOVERY METHODS */
 
-/* 
- * Allows the thread to be woken if either a packet arrives or the timeout finishes.
- * Requires functions that access socket queues ....
- *
- * Precondition: sema is initialized as a counting semaphore (0)
- * 
- * Returns 0 if discovery packet was received, 1 if woke up without discovery, -1 on error
+/*
+ * Alarm handler for a cache entry's discovery timer: wakes the discovering thread to rebroadcast,
+ * unless the network handler cleared awaiting_reply first.
  */
-int wait_for_discovery_or_timeout(semaphore_t sema, alarm_t* alarm, int timeout) {
-	if (sema == NULL) {
-		fprintf(stderr, "ERROR: wait_for_discovery_or_timeout() passed uninitialized semaphore\n");
-		return -1;
-	}
-
-	*alarm = (alarm_t) register_alarm(timeout, (alarm_handler_t) semaphore_V, (void*) sema);
-	
-	semaphore_P(sema);
+static void discovery_timeout(void* arg) {
+	cache_elem_t entry = (cache_elem_t) arg;
 
-	if (*alarm == NULL) {
-		return 0;
-	} else {
-		if ((*alarm)->executed) {
-			if (deregister_alarm(*alarm)) {
-				*alarm = NULL;
-				return 1;
-			} else {
-				fprintf(stderr, "ERROR: wait_for_discovery_or_timeout() woke up with conflicting executed statuses\n");
-				return -1;
-			}
-		} else {
-			fprintf(stderr, "ERROR: wait_for_discovery_or_timeout() woke up with not executed non-null alarm\n");
-			return -1;
-		}
+	if (swap(&(entry->awaiting_reply), 0)) {
+		entry->reply_timed_out = 1;
+		semaphore_V(entry->timeout);
 	}
 }
 
@@ -164,7 +140,6 @@ int miniroute_discover_path(network_address_t dest_address) {
 	int send_attempts, timeout, received_next_packet;
 	network_address_t myaddr;
 	cache_elem_t dest_elem = NULL;
-	int status = 0;
 	routing_header_t routing_hdr;
 
 	send_attempts = 0;
@@ -172,19 +147,25 @@ int miniroute_discover_path(network_address_t dest_address) {
 	received_next_packet = 0;
 	network_get_my_address(myaddr);
 	
-	semaphore_P(cache_mutex);
 	// Quick lookup in cache
+	rwlock_read_lock(cache_lock);
 	dest_elem = cache_table_get(cache, dest_address);
+	rwlock_read_unlock(cache_lock);
 	if (dest_elem == NULL){
-		//create element
-		dest_elem = cache_table_insert(cache, dest_address, NULL);	//don't specify path here, leave NULL
-		if (dest_elem == NULL) {
-			fprintf(stderr, "ERROR: miniroute_discover_path() failed to insert new cache element\n");
-			semaphore_V(cache_mutex);
-			return -1;
+		rwlock_write_lock(cache_lock);
+		// Another thread may have inserted it since we looked
+		dest_elem = cache_table_get(cache, dest_address);
+		if (dest_elem == NULL){
+			//create element
+			dest_elem = cache_table_insert(cache, dest_address, NULL);	//don't specify path here, leave NULL
+			if (dest_elem == NULL) {
+				fprintf(stderr, "ERROR: miniroute_discover_path() failed to insert new cache element\n");
+				rwlock_write_unlock(cache_lock);
+				return -1;
+			}
 		}
+		rwlock_write_unlock(cache_lock);
 	}
-	semaphore_V(cache_mutex);
 
 	semaphore_P(dest_elem->mutex);
 
@@ -204,25 +185,39 @@ int miniroute_discover_path(network_address_t dest_address) {
 		pack_unsigned_int(routing_hdr->path_len, 1);
 		pack_address(&routing_hdr->path[0][0], myaddr);
 
+		dest_elem->reply_timed_out = 0;
 		while (send_attempts < MAX_DISC_ATTEMPTS && !received_next_packet) {
 			fprintf(stderr, "DEBUG: Send attempt: %i\n", send_attempts);
+			dest_elem->awaiting_reply = 1; // Before sending, so that the quickest reply still wakes us
 			if (network_bcast_pkt(sizeof(struct routing_header), (char*) routing_hdr, 0, NULL) < 0) {
 				fprintf(stderr, "ERROR: miniroute_discover_path() failed to successfully execute network_bcast_pkt()\n");
+				dest_elem->awaiting_reply = 0;
+				rearm_alarm(dest_elem->discovery_alarm, -1);
 				semaphore_V(dest_elem->mutex);
 				return -1; // Failure
 			}
 
-			// Block here until timeout expires (and alarm is thus deregistered) or packet is received, deregistering the pending alarm		
-			status = wait_for_discovery_or_timeout(dest_elem->timeout, &(dest_elem->reply), timeout);
+			// Start the timer on the first attempt; it goes off again every timeout for the later ones
+			if (send_attempts == 0 && rearm_alarm(dest_elem->discovery_alarm, timeout) < 0) {
+				dest_elem->discovery_alarm = register_periodic_alarm(timeout, discovery_timeout, dest_elem);
+				if (dest_elem->discovery_alarm == NULL) {
+					fprintf(stderr, "ERROR: miniroute_discover_path() failed to register discovery alarm\n");
+					dest_elem->awaiting_reply = 0;
+					semaphore_V(dest_elem->mutex);
+					return -1;
+				}
+			}
 
-			if (status == -1) { // Error
-				return -1;
-			} else if (status == 1) { // Timed out
+			// Block here until the timer goes off or the reply is received
+			semaphore_P(dest_elem->timeout);
+			if (swap(&(dest_elem->reply_timed_out), 0)) { // Timed out
 				send_attempts++;
-			} else if (status == 0) { // Received reply packet
+			} else { // Received reply packet
 				received_next_packet = 1;
 			}
 		}
+
+		rearm_alarm(dest_elem->discovery_alarm, -1); // Park the timer until the next discovery
 	} else {
 		received_next_packet = 1; // path already defined
 	}
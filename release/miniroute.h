@@ -15,13 +15,14 @@ enum routing_packet_type {
 
 #define MAX_DISC_ATTEMPTS 3
 #define DISCOVERY_TIMEOUT 12000 // Initial timeout time in [ms]
+#define ROUTE_EXPIRE_SLACK 250 // How late [ms] a route cache entry may expire, so that the expiries of many entries coalesce
 
 #define MAX_DISC_ID 100000 // CHECK
 
 
 // Miniroute Data structures (extern)
 extern cache_table_t cache;
-extern semaphore_t cache_mutex;
+extern rwlock_t cache_lock;
 extern unsigned int id;
 
 
@@ -2,6 +2,7 @@
  *	Implementation of minisockets.
  */
 #include "minisocket.h"
+#include "minithread.h"
 
 minisocket_t* sockets = NULL; // Array of minisockets with each element representing a port
 semaphore_t skt_mutex = NULL; // Mutual exclusion semaphore for manipulating socket data structures
@@ -11,11 +12,11 @@ int used_client_ports = 0; // Number of client ports in use
 
 /* Initializes the minisocket layer. */
 void minisocket_initialize() {
-	skt_mutex = semaphore_create();
+	skt_mutex = semaphore_create_named("skt_mutex");
     semaphore_initialize(skt_mutex, 1);
 
-    // Initialize ports array
-    sockets = (minisocket_t*) malloc((NUM_SERVER_PORTS + NUM_CLIENT_PORTS) * sizeof(minisocket_t));
+    // Initialize ports array; a NULL entry is a free port
+    sockets = (minisocket_t*) calloc(NUM_SERVER_PORTS + NUM_CLIENT_PORTS, sizeof(minisocket_t));
 
 	if (sockets == NULL) { // Fail if malloc() fails
       fprintf(stderr, "ERROR: minisocket_initialize() failed to malloc minisocket_t array\n");
@@ -79,20 +80,21 @@ minisocket_t minisocket_server_create(int port, minisocket_error *error) {
 	// Set fields in minisocket
 	socket->active = 0;
 	socket->local_port = port;
-	socket->datagrams_ready = semaphore_create();
+	socket->datagrams_ready = semaphore_create_named("socket datagrams_ready");
 	semaphore_initialize(socket->datagrams_ready, 0);
-	socket->sending = semaphore_create();
-	semaphore_initialize(socket->sending, 1);
-	socket->receiving = semaphore_create();
+	socket->sending = mutex_create();
+	socket->receiving = semaphore_create_named("socket receiving");
 	semaphore_initialize(socket->receiving, 1);
-	socket->timeout = semaphore_create();
+	socket->timeout = semaphore_create_named("socket timeout");
 	semaphore_initialize(socket->timeout, 0);
-	socket->wait_syn = semaphore_create();
+	socket->wait_syn = semaphore_create_named("socket wait_syn");
 	semaphore_initialize(socket->wait_syn, 0);
-	socket->incoming_data = queue_new();
+	socket->incoming_data = ring_new(MINISOCKET_RING_CAPACITY, RING_REJECT); // Full ring pushes back on the sender
 	socket->seqnum = 0;
 	socket->acknum = 0;
-	socket->alarm = NULL;
+	socket->awaiting_ack = 0;
+	socket->ack_timed_out = 0;
+	socket->retransmit_alarm = NULL; // Registered by the first retransmit_packet
 
 	sockets[port] = socket; // Add socket to socket ports array
 	used_server_ports++; // Increment server-ports-in-use counter
@@ -121,7 +123,6 @@ minisocket_t minisocket_server_create(int port, minisocket_error *error) {
 	// semaphore_V(skt_mutex);
 
 	if (received_ACK == 1) {
-		socket->alarm = NULL;		//No active retransmission alarm
 		*error = SOCKET_NOERROR;
 		return socket;
 	} else {
@@ -211,20 +212,21 @@ minisocket_t minisocket_client_create(network_address_t addr, int port, minisock
 	socket->local_port = local_port;
 	socket->remote_port = port;
 	network_address_copy(addr, socket->dest_address);
-	socket->datagrams_ready = semaphore_create();
+	socket->datagrams_ready = semaphore_create_named("socket datagrams_ready");
 	semaphore_initialize(socket->datagrams_ready, 0);
-	socket->sending = semaphore_create();
-	semaphore_initialize(socket->sending, 1);
-	socket->receiving = semaphore_create();
+	socket->sending = mutex_create();
+	socket->receiving = semaphore_create_named("socket receiving");
 	semaphore_initialize(socket->receiving, 1);
-	socket->timeout = semaphore_create();
+	socket->timeout = semaphore_create_named("socket timeout");
 	semaphore_initialize(socket->timeout, 0);
-	socket->wait_syn = semaphore_create();
+	socket->wait_syn = semaphore_create_named("socket wait_syn");
 	semaphore_initialize(socket->wait_syn, 0);
-	socket->incoming_data = queue_new();
+	socket->incoming_data = ring_new(MINISOCKET_RING_CAPACITY, RING_REJECT); // Full ring pushes back on the sender
 	socket->seqnum = 0;
 	socket->acknum = 0;
-	socket->alarm = NULL;
+	socket->awaiting_ack = 0;
+	socket->ack_timed_out = 0;
+	socket->retransmit_alarm = NULL; // Registered by the first retransmit_packet
 
 	sockets[local_port] = socket; // Add socket to socket ports array
 	used_client_ports++; // Increment client-ports-in-use counter
@@ -316,7 +318,7 @@ int minisocket_send(minisocket_t socket, minimsg_t msg, int len, minisocket_erro
 	}
 
 	// Exclude other threads from sending from the same socket while I'm sending
-	semaphore_P(socket->sending);
+	mutex_lock(socket->sending);
 
 	bytes_sent = 0;
 	// Fragment long messages into smaller packets
@@ -330,21 +332,91 @@ int minisocket_send(minisocket_t socket, minimsg_t msg, int len, minisocket_erro
 		if (result == 1) { // ACK received (packet send successfully)
 			bytes_sent += send_len;
 		} else if (result == 0) { // All timeout attempts failed - close connection
-			semaphore_V(socket->sending);
+			mutex_unlock(socket->sending);
 			minisocket_close(socket);
 			return -1;
 		} else { // Generic failure
-			semaphore_V(socket->sending);
+			mutex_unlock(socket->sending);
 			return -1;
 		}
 	}
 
-	semaphore_V(socket->sending);
+	mutex_unlock(socket->sending);
 
 	return 0;
 }
 
 
+/* A send made by minisocket_send_async */
+typedef struct minisocket_async_send* minisocket_async_send_t;
+struct minisocket_async_send {
+	minisocket_t socket;
+	minimsg_t msg;
+	int len;
+	minisocket_error* error;
+	minithread_future_t future; // Completed with minisocket_send's return value
+};
+
+/* Retransmission blocks, so an asynchronous send runs on a small stack of its own */
+#define ASYNC_SEND_STACK_SIZE (32 * 1024)
+
+/* Body of the thread carrying out an asynchronous send. */
+static int minisocket_send_async_run(int* arg) {
+	minisocket_async_send_t send = (minisocket_async_send_t) arg;
+	int result;
+
+	result = minisocket_send(send->socket, send->msg, send->len, send->error);
+	future_complete(send->future, result);
+	free(send);
+
+	return 0;
+}
+
+/*
+ * Start sending a message and return a future for the result, or NULL with the errorcode
+ * stored in the "error" variable.
+ */
+minithread_future_t minisocket_send_async(minisocket_t socket, minimsg_t msg, int len, minisocket_error *error) {
+	minisocket_async_send_t send;
+	minithread_attr_t attr;
+	minithread_future_t future;
+
+	// Check for valid arguments
+	if (socket == NULL || msg == NULL) {
+		fprintf(stderr, "ERROR: minisocket_send_async() passed NULL argument\n");
+		*error = SOCKET_INVALIDPARAMS;
+		return NULL;
+	}
+
+	future = future_create();
+	send = (minisocket_async_send_t) malloc(sizeof(struct minisocket_async_send));
+	if (future == NULL || send == NULL) {
+		fprintf(stderr, "ERROR: minisocket_send_async() failed to malloc send\n");
+		*error = SOCKET_OUTOFMEMORY;
+		if (future != NULL) future_destroy(future);
+		free(send);
+		return NULL;
+	}
+	send->socket = socket;
+	send->msg = msg;
+	send->len = len;
+	send->error = error;
+	send->future = future;
+
+	minithread_attr_init(&attr);
+	attr.stack_size = ASYNC_SEND_STACK_SIZE;
+	attr.name = "async send";
+	if (minithread_fork_attr((proc_t) minisocket_send_async_run, (arg_t) send, &attr) == NULL) {
+		fprintf(stderr, "ERROR: minisocket_send_async() failed to fork sending thread\n");
+		*error = SOCKET_OUTOFMEMORY;
+		future_destroy(future);
+		free(send);
+		return NULL;
+	}
+
+	return future;
+}
+
 /*
  * Receive a message from the other end of the socket. Blocks until
  * some data is received (which can be smaller than max_len bytes).
@@ -374,9 +446,8 @@ int minisocket_receive(minisocket_t socket, minimsg_t msg, int max_len, minisock
 
 	semaphore_P(socket->datagrams_ready);
 	
-	// Obtain received message from miniport queue and extract header data
-	while (bytes_received < max_len && queue_dequeue(socket->incoming_data, (void**) &packet) > 0) {
-		// Extract message data
+	// Obtain received message from the socket's ring and extract message data; one packet per V
+	if ((packet = ring_get(socket->incoming_data)) != NULL) {
 		buffer = packet->buffer;
 		i = 0;
 		while (buffer[21 + i] && bytes_received < max_len) {
@@ -384,9 +455,9 @@ int minisocket_receive(minisocket_t socket, minimsg_t msg, int max_len, minisock
 			i++;
 			bytes_received++;
 		}
-	}
 
- 	free(packet);
+		free(packet);
+	}
 
 	semaphore_V(socket->receiving);
 
@@ -415,57 +486,65 @@ int validate_packet(network_interrupt_arg_t* packet, char message_type, int seq_
 		return 0;
 }
 
-int wait_for_arrival_or_timeout(semaphore_t sema, alarm_t* alarm, int timeout) {
-	if (sema == NULL) {
-		fprintf(stderr, "ERROR: wait_for_arrival_or_timeout() passed uninitialized semaphore\n");
-		return -1;
-	}
-	*alarm = (alarm_t) register_alarm(timeout, (alarm_handler_t) semaphore_V, (void*) sema);
-	semaphore_P(sema);
-	// fprintf(stderr, "Woke up!\n");
-	if (*alarm != NULL) {
-		return deregister_alarm((alarm_id) (*alarm));
-	} else {
-		return 0;
+void retransmit_timeout(void* arg) {
+	minisocket_t socket = (minisocket_t) arg;
+
+	rearm_alarm(socket->retransmit_alarm, backoff_next(&socket->retransmit_backoff));
+	if (swap(&(socket->awaiting_ack), 0)) { // Unless the network handler took the ACK just now
+		socket->ack_timed_out = 1;
+		semaphore_V(socket->datagrams_ready);
 	}
 }
 
 /* Used when we want to retransmit a given packet a certain number of times while a desired response has not been received 
 	(relies on network_handler to get said response). Return -1 on Failure, 0 if Timed out, 1 if Received packet. */
 int retransmit_packet(minisocket_t socket, char* hdr, int data_len, char* data, minisocket_error *error) {
-	int send_attempts, timeout, received_next_packet;
-	int exec = 0;
+	int send_attempts, received_next_packet;
+	int timeout;
 
 	send_attempts = 0;
-	timeout = INITIAL_TIMEOUT;
 	received_next_packet = 0;
-
-	// "Reset" alarm field
-	socket->alarm = NULL;
+	socket->ack_timed_out = 0;
+	backoff_init(&socket->retransmit_backoff, INITIAL_TIMEOUT, INITIAL_TIMEOUT << (MAX_SEND_ATTEMPTS - 1));
 
 	while (send_attempts < MAX_SEND_ATTEMPTS && !received_next_packet) {
+		socket->awaiting_ack = 1; // Before sending, so that the quickest ACK still wakes us
 		if (network_send_pkt(socket->dest_address, sizeof(struct mini_header_reliable), hdr, data_len, data) < 0) {
 			fprintf(stderr, "ERROR: retransmit_packet() failed to successfully execute network_send_pkt()\n");
 			*error = SOCKET_SENDERROR;
+			socket->awaiting_ack = 0;
+			rearm_alarm(socket->retransmit_alarm, -1);
 			// semaphore_V(skt_mutex);
 			return -1; // Failure
 		}
 		fprintf(stderr, "DEBUG: Sent %i with (seq = %i, ack = %i) attempt %i\n", ((mini_header_reliable_t) hdr)->message_type, unpack_unsigned_int(((mini_header_reliable_t) hdr)->seq_number), unpack_unsigned_int(((mini_header_reliable_t) hdr)->ack_number), send_attempts + 1);
 
-		// Block here until timeout expires (and alarm is thus deregistered) or packet is received, deregistering the pending alarm		
-		// CHECK: need to enforce mutual exclusion here?
-		exec = wait_for_arrival_or_timeout(socket->datagrams_ready, &(socket->alarm), timeout);	//CHECK: Is this the CORRECT semaphore to block on?
-		fprintf(stderr, "executed: %i\n", exec);
-		// if (((alarm_t) socket->alarm)->executed) { // Timeout has been reached without ACK
-		if (exec) {
-			timeout *= 2;
+		// Start the timer on the first attempt; it backs itself off for the later ones
+		if (send_attempts == 0) {
+			timeout = backoff_next(&socket->retransmit_backoff);
+			if (rearm_alarm(socket->retransmit_alarm, timeout) < 0) {
+				socket->retransmit_alarm = register_periodic_alarm(timeout, retransmit_timeout, socket);
+				if (socket->retransmit_alarm == NULL) {
+					fprintf(stderr, "ERROR: retransmit_packet() failed to register retransmission alarm\n");
+					*error = SOCKET_OUTOFMEMORY;
+					socket->awaiting_ack = 0;
+					return -1;
+				}
+				set_alarm_slack(socket->retransmit_alarm, RETRANSMIT_SLACK);
+			}
+		}
+
+		// Block here until the timer goes off or the ACK (or equivalent) is received
+		semaphore_P(socket->datagrams_ready);
+		if (swap(&(socket->ack_timed_out), 0)) {
 			send_attempts++;
-		} else { // ACK (or equivalent received)
+		} else {
 			received_next_packet = 1;
-			socket->alarm = NULL;		// No active retransmission alarm
 		}
 	}
 
+	rearm_alarm(socket->retransmit_alarm, -1); // Park the timer until the next send
+
 	return received_next_packet;
 }
 
@@ -483,4 +562,51 @@ void set_header(minisocket_t socket, mini_header_reliable_t hdr, char message_ty
 	hdr->message_type = message_type; // Message type
 	pack_unsigned_int(hdr->seq_number, socket->seqnum); // Sequence number
 	pack_unsigned_int(hdr->ack_number, socket->acknum); // Acknowledgment number
-}
\ No newline at end of file
+}
+
+
+/*
+ * Incoming ring of a minisocket, copied for minisocket_stats_dump.
+ */
+typedef struct minisocket_snapshot minisocket_snapshot;
+struct minisocket_snapshot {
+	int local_port;
+	int length;
+	ring_stats_t stats;
+};
+
+/* Prints the incoming ring counters of every minisocket to stdout. */
+void minisocket_stats_dump() {
+	minisocket_snapshot* snapshot;
+	int port, i, n = 0;
+
+	semaphore_P(skt_mutex);
+	for (port = 0; port < NUM_SERVER_PORTS + NUM_CLIENT_PORTS; port++) {
+		if (sockets[port] != NULL) {
+			n++;
+		}
+	}
+	snapshot = (minisocket_snapshot*) malloc((n > 0 ? n : 1) * sizeof(minisocket_snapshot));
+	if (snapshot == NULL) { // malloc() failed
+		semaphore_V(skt_mutex);
+		fprintf(stderr, "ERROR: minisocket_stats_dump() failed to malloc snapshot\n");
+		return;
+	}
+	for (port = 0, i = 0; port < NUM_SERVER_PORTS + NUM_CLIENT_PORTS; port++) {
+		if (sockets[port] != NULL) {
+			snapshot[i].local_port = port;
+			snapshot[i].length = ring_length(sockets[port]->incoming_data);
+			ring_stats(sockets[port]->incoming_data, &snapshot[i].stats);
+			i++;
+		}
+	}
+	semaphore_V(skt_mutex);
+
+	printf("%6s %6s %8s %8s %8s %6s\n", "port", "queued", "puts", "gets", "refused", "high");
+	for (i = 0; i < n; i++) {
+		printf("%6i %6i %8i %8i %8i %6i\n", snapshot[i].local_port, snapshot[i].length, snapshot[i].stats.puts,
+			snapshot[i].stats.gets, snapshot[i].stats.rejected, snapshot[i].stats.high_water);
+	}
+
+	free(snapshot);
+}
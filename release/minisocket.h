@@ -12,11 +12,13 @@
  */
 
 #include "synch.h"
+#include "future.h"
 #include "network.h"
 #include "alarm.h"
 #include "miniheader.h"
 #include "minimsg.h"
 #include "queue.h"
+#include "ring.h"
 #include <stdio.h>
 
 // Define minisocket port num limits
@@ -30,6 +32,8 @@
 
 #define MAX_SEND_ATTEMPTS 7
 #define INITIAL_TIMEOUT 100 // Initial timeout time in [ms]
+#define RETRANSMIT_SLACK 10 // How late [ms] a retransmission may go out, so that the timers of many sockets coalesce
+#define MINISOCKET_RING_CAPACITY 32 // Data packets a socket buffers before refusing (and not ACKing) more
 
 
 struct minisocket {
@@ -40,17 +44,19 @@ struct minisocket {
   network_address_t dest_address;
 
   semaphore_t datagrams_ready; // Allows socket to wait for messages (paired w/ data messages (receive()) when we care about internal data)
-  semaphore_t sending;
+  mutex_t sending; // Held while sending, so that sends from the same socket do not interleave
   semaphore_t receiving;
   semaphore_t timeout; // Used whenever sending any non-ACK message
   semaphore_t wait_syn;
-  queue_t incoming_data; // Queue of incoming messages
+  ring_t incoming_data; // Incoming data packets, refused once full so the sender retransmits later
 
   int seqnum; // Current sequence number
   int acknum; // Current (Local) ack number
 
-  /*alarm_id*/
-  alarm_t alarm; // Alarm associated with minisocket's timeout
+  int awaiting_ack; // Set while retransmit_packet waits for an ACK; cleared by whichever of the network handler and the timeout wins
+  int ack_timed_out; // Set by the retransmission timer when it wins awaiting_ack
+  alarm_id retransmit_alarm; // Periodic retransmission timer, reused across sends; parked between them
+  backoff_t retransmit_backoff; // Timeouts of the current send
 };
 
 typedef struct minisocket* minisocket_t;
@@ -125,6 +131,15 @@ minisocket_t minisocket_client_create(network_address_t addr, int port, minisock
  */
 int minisocket_send(minisocket_t socket, minimsg_t msg, int len, minisocket_error *error);
 
+/*
+ * Like minisocket_send, but return at once with a future that is completed with
+ * minisocket_send's return value once the message is acknowledged or the send
+ * fails, or NULL with the error code set if the send could not be started. msg
+ * and error must stay valid until then; the caller destroys the future. The
+ * order in which concurrent asynchronous sends go out is not defined.
+ */
+minithread_future_t minisocket_send_async(minisocket_t socket, minimsg_t msg, int len, minisocket_error *error);
+
 /*
  * Receive a message from the other end of the socket. Blocks until max_len
  * bytes or a full message is received (which can be smaller than max_len
@@ -145,18 +160,21 @@ int minisocket_receive(minisocket_t socket, minimsg_t msg, int max_len, minisock
  */
 void minisocket_close(minisocket_t socket); 
 
+/* Prints, for every minisocket, the counters of its incoming ring: data packets queued now,
+ * put, taken and refused so far, and the most ever queued at once. A refused packet is not
+ * ACKed, so its sender retransmits it later.
+ */
+void minisocket_stats_dump();
+
 /* Verifies that the packet parameter is of type message_type and has (seq, ack) = (seq_num, ack_num)
  * Returns 1 of packet satisfies requirements or 0 if otherwise
  */
 int validate_packet(network_interrupt_arg_t* packet, char message_type, int seq_num, int ack_num);
 
-/* Operates similarly to minithread_sleep_with_timeout() but accepts the wake-up semaphore as the first parameter and the timeout in [ms] as the second.
- * Allows the thread to be woken if either a packet arrives or the timeout finishes.
- * Requires functions that access socket queues not to assume the queue has at least one element when thread is woken
- *
- * Precondition: sema is initialized as a counting semaphore (0)
+/* Alarm handler for a socket's retransmission timer. Wakes retransmit_packet to resend, unless the network
+ * handler cleared awaiting_ack first, and backs the timer off for the next attempt.
  */
-int wait_for_arrival_or_timeout(semaphore_t sema, alarm_t* alarm, int timeout);
+void retransmit_timeout(void* arg);
 
 /* Used when we want to retransmit a given packet a certain number of times while a desired response has not been received 
   (relies on network_handler to get said response). Return -1 on Failure, 0 if Timed out, 1 if Received packet. */
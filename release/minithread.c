@@ -10,7 +10,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "minithread.h"
 
 #include "miniheader.h"
@@ -29,40 +36,270 @@
  */
 
 
-semaphore_t mutex = NULL;
+/*
+ * A virtual processor: a host thread that runs minithreads from its own run queue.
+ * run_queue is touched by other processors when they steal work, so it is guarded by
+ * run_queue_lock; everything else belongs to the processor itself.
+ */
+typedef struct minithread_cpu* minithread_cpu_t;
+struct minithread_cpu {
+	int id;
+	pthread_t host;                             // Host thread running this processor
+	minithread_t idle;                          // Kernel TCB running the idle thread on the host thread's stack
+	minithread_t prev;                          // Thread that just switched away here; its context may still be live
+	minithread_t volatile running;              // Thread switched to here (current, for other processors to read)
+	run_queue_t run_queue;                      // The running multilevel feedback queue
+	tas_lock_t run_queue_lock;
+	int run_level;                              // The level of the currently running process
+	int parked;                                 // Set while the idle thread is parked waiting for an interrupt
+	unsigned long long slice_start;             // When the running thread was switched to [ns] (tickless clock)
+	unsigned long long slice_end;               // When the running thread's quanta run out [ns] (tickless clock)
+	int resched;                                // Set when a thread above the running one was made runnable here
+	long epoch;                                 // Aging period in which run_queue was last moved up to level 0
+
+	/* IDLE VARIABLES */
+	unsigned long long idle_time;               // Total time [ns] the idle thread has spent parked
+	unsigned long long idle_wakeups;            // Number of times the idle thread has been woken by an interrupt
+};
 
 /* LOCAL SCHEDULER VARIABLES */
-multilevel_queue_t run_queue = NULL;            // The running multilevel feedback queue
-int system_run_level = -1;                      // The level of the currently running process
-float prob_level[4] = {0.5, 0.25, 0.15, 0.1};   // Probability of selecting thread at given level
+struct minithread_cpu cpus[MAX_CPUS];           // Virtual processors; cpus[0] runs on the host's main thread
+int num_cpus = 1;                               // Number of virtual processors in use
+__thread minithread_cpu_t this_cpu;             // Virtual processor run by the calling host thread
+int level_weight[4] = {10, 5, 3, 2};            // Share of scheduling picks given to each level (out of 20)
 int quanta_level[4] = {1, 2, 4, 8};             // Quanta assigned for each level
+long boost_period = 2 * SECOND;                 // Every thread is moved back up to level 0 this often
+int wakeup_preemption = 1;                      // Preempt the running thread when a higher-level one is woken
 
-minithread_t globaltcb;                         // Main TCB that contains the "OS" thread
 int thread_ctr = 0;                             // Counts created threads (used for ID assignment)
-minithread_t current;                           // Keeps track of the currently running minithread
-queue_t zombie_queue;                           // Keeps dead threads for cleanup. Cleaned by kernel TCB when size exceeds limit
-int zombie_limit = 5;                           // Limit on length of zombie queue  
+__thread minithread_t current;                  // Keeps track of the minithread running on this processor
+minithread_t all_threads = NULL;                // List of all threads not yet freed, linked through all_next/all_prev
+tas_lock_t all_threads_lock = 0;                // Guards all_threads across processors
+list_t zombie_queue = {NULL, NULL, 0};          // Keeps dead threads for cleanup. Cleaned a few at a time by the scheduler
+tas_lock_t zombie_lock = 0;                     // Guards zombie_queue across processors
+int zombie_batch = 8;                           // Most zombies freed per reaping pass
 
 /* DISK VARIABLES*/
 disk_t disk;
 
+/* Disk requests sent by disk_read_block_async or disk_write_block_async and not yet answered */
+struct disk_pending {
+	disk_request_t request;
+	minithread_future_t future;                 // Completed with the reply; NULL if the entry is free
+} disk_pending[MAX_PENDING_DISK_REQUESTS];
+tas_lock_t disk_pending_lock = 0;               // Guards disk_pending across processors
+
+
+
+/* scheduler internals */
+
+/*
+ * Move t from state from (or from any state, if from is -1) to state to at time now, charging
+ * the time since its last change to the state it leaves. Returns 0, or -1 if t was not in
+ * state from. A thread may be woken on one processor while still switching out on another,
+ * so the state is changed atomically and only the winning change is charged.
+ */
+static int minithread_set_state(minithread_t t, int from, int to, unsigned long long now) {
+	unsigned long long elapsed;
+	int old;
+
+	if (from < 0) {
+		old = swap(&(t->state), to);
+	} else if ((old = compare_and_swap(&(t->state), from, to)) != from) {
+		return -1;
+	}
+
+	elapsed = now - t->state_since;
+	t->state_since = now;
+	if (old == MINITHREAD_RUNNABLE) {
+		t->stats.runnable_time += elapsed;
+	} else if (old == MINITHREAD_BLOCKED) {
+		t->stats.blocked_time += elapsed;
+	}
+
+	return 0;
+}
+
+/* Number of quanta t runs for per turn at its current level. */
+static int minithread_quanta(minithread_t t) {
+	return (t->quanta > 0) ? t->quanta : quanta_level[t->run_level];
+}
+
+/*
+ * Move t back up to level 0 if an aging period has begun since it was last moved there, so
+ * that threads demoted for running long are not starved by a stream of short ones. The part
+ * quantum it carries is kept.
+ */
+static void minithread_age(minithread_t t, unsigned long long now) {
+	long epoch = (long) (now / boost_period);
+
+	if (t->epoch != epoch) {
+		t->epoch = epoch;
+		t->run_level = 0;
+		t->quanta_left = minithread_quanta(t);
+	}
+}
+
+/* Move t down a level for using up its quanta at its current level, and refill them. */
+static void minithread_demote(minithread_t t) {
+	if (t->run_level < 3) { // Threads stay at the bottom level until aged back up
+		t->run_level++;
+		t->stats.demotions++;
+	}
+	t->quanta_left = minithread_quanta(t);
+}
+
+/*
+ * Program this processor's one-shot clock for the end of the running thread's quanta or,
+ * on the first processor, the next alarm, whichever is sooner. Interrupts must be disabled.
+ */
+static void minithread_clock_program() {
+	unsigned long long deadline = 0, alarm;
+
+	if (!CLOCK_TICKLESS) {
+		return;
+	}
+
+	if (current != this_cpu->idle) {
+		deadline = this_cpu->slice_end;
+	}
+	if (this_cpu->id == 0) {
+		alarm = alarm_next_deadline();
+		if (alarm != 0 && (deadline == 0 || alarm < deadline)) {
+			deadline = alarm;
+		}
+	}
+
+	minithread_clock_arm(this_cpu->id, deadline);
+}
+
+/*
+ * Charge self for the whole quanta it has run since it was switched to at time now, and
+ * start next's turn. Without clock ticks to count quanta, a thread's partial quantum is
+ * carried in quantum_used until it adds up to a whole one. Interrupts must be disabled.
+ */
+static void minithread_clock_switch(minithread_t self, minithread_t next, unsigned long long now) {
+	unsigned long long used;
+	int quanta;
+
+	if (!CLOCK_TICKLESS) {
+		return;
+	}
+
+	if (self != this_cpu->idle) {
+		used = self->quantum_used + (now - this_cpu->slice_start);
+		quanta = (int) (used / clk_period);
+		if (quanta >= self->quanta_left) {
+			// Its quanta ran out over turns that ended before the clock could expire it
+			self->stats.ticks += self->quanta_left;
+			self->quantum_used = 0;
+			minithread_demote(self);
+		} else {
+			self->quanta_left -= quanta;
+			self->stats.ticks += quanta;
+			self->quantum_used = used - quanta * (unsigned long long) clk_period;
+		}
+	}
+
+	this_cpu->slice_start = now;
+	this_cpu->slice_end = now + next->quanta_left * (unsigned long long) clk_period - next->quantum_used;
+}
+
+/*
+ * Mark the thread that last switched away on this processor as no longer running,
+ * now that its context is saved and its stack free for another processor to resume.
+ * Called with interrupts disabled by whichever thread the switch landed in.
+ */
+static void minithread_finish_switch() {
+	minithread_t prev = this_cpu->prev;
+
+	if (prev != NULL) {
+		this_cpu->prev = NULL;
+		prev->on_cpu = 0;
+	}
+}
+
+/*
+ * Switch this processor from self to next. Must be called with interrupts disabled;
+ * returns once self is scheduled again, possibly on another processor, with interrupts
+ * enabled.
+ */
+static void minithread_switch_to(minithread_t self, minithread_t next) {
+	unsigned long long now;
+
+	if (minithread_stack_check(self->stackbase) < 0) {
+		fprintf(stderr, "ERROR: minithread_switch_to() found that thread %i overflowed its stack\n", self->id);
+		abort();
+	}
+
+	// next may have just been made runnable and still be switching out elsewhere; that processor's
+	// host thread may need ours to step aside before it can finish
+	while (next->on_cpu) {
+		sched_yield();
+	}
+
+	// self is blocking unless it was put back on a run_queue (or has exited)
+	now = minithread_clock_now();
+	minithread_set_state(self, MINITHREAD_RUNNING, MINITHREAD_BLOCKED, now);
+	minithread_set_state(next, -1, MINITHREAD_RUNNING, now);
+	if (next != this_cpu->idle) {
+		minithread_age(next, now);
+	}
+	minithread_clock_switch(self, next, now);
+	this_cpu->resched = 0;
+
+	next->on_cpu = 1;
+	this_cpu->prev = self;
+	current = next;
+	this_cpu->running = next;
+	minithread_clock_program();
+	minithread_switch(&(self->stacktop), &(next->stacktop));
+
+	minithread_finish_switch();
+	set_interrupt_level(ENABLED);
+}
+
+/*
+ * Take the next ready thread for this processor from its own run_queue or, failing that,
+ * steal one from another processor. Returns NULL if no thread is ready. Must be called
+ * with interrupts disabled.
+ */
+static minithread_t minithread_dequeue() {
+	minithread_cpu_t victim;
+	minithread_t next = NULL;
+	int i;
+
+	for (i = 0; i < num_cpus && next == NULL; i++) {
+		victim = &cpus[(this_cpu->id + i) % num_cpus];
+		if (i > 0 && run_queue_length(victim->run_queue) == 0) {
+			continue; // Nothing to steal; skip the lock
+		}
+
+		// The run queue's weighted schedule chooses the level (favoring level 0 over 1 over 2 over 3)
+		atomic_spin_lock(&victim->run_queue_lock);
+		this_cpu->run_level = run_queue_dequeue(victim->run_queue, (void**) &next); // Set new run_level
+		atomic_clear(&victim->run_queue_lock);
+	}
+
+	return next;
+}
 
 
 /* minithread functions */
 
 minithread_t minithread_fork(proc_t proc, arg_t arg) {
-	minithread_t tcb = minithread_create(proc, arg);
+	return minithread_fork_attr(proc, arg, NULL);
+}
+
+minithread_t minithread_fork_attr(proc_t proc, arg_t arg, minithread_attr_t* attr) {
+	minithread_t tcb = minithread_create_attr(proc, arg, attr);
 	/*int error;
 	char block_buffer[DISK_BLOCK_SIZE];
 	superblock_t sblock;*/
 
 	// Check for argument errors
 	if (tcb == NULL) {
-		fprintf(stderr, "ERROR: minithread_fork() failed to create new minithread_t\n");
-		return NULL;
-	}
-	if (proc == NULL) { // Fail if process pointer is NULL
-		fprintf(stderr, "ERROR: minithread_fork() passed a NULL process pointer\n");
+		fprintf(stderr, "ERROR: minithread_fork_attr() failed to create new minithread_t\n");
 		return NULL;
 	}
 
@@ -79,36 +316,216 @@ minithread_t minithread_fork(proc_t proc, arg_t arg) {
 	return tcb;
 }
 
+void minithread_attr_init(minithread_attr_t* attr) {
+	attr->stack_size = 0;
+	attr->level = 0;
+	attr->quanta = 0;
+	attr->name = NULL;
+	attr->detached = 1;
+}
+
+/*
+ * First code run by every new thread: release the thread that switched to it, then
+ * enable interrupts and run the thread's body.
+ */
+static int minithread_run(minithread_t tcb) {
+	minithread_finish_switch();
+	set_interrupt_level(ENABLED);
+
+	tcb->exit_value = tcb->func(tcb->arg);
+	return tcb->exit_value;
+}
+
 minithread_t minithread_create(proc_t proc, arg_t arg) {
+	return minithread_create_attr(proc, arg, NULL);
+}
+
+minithread_t minithread_create_attr(proc_t proc, arg_t arg, minithread_attr_t* attr) {
+	minithread_attr_t defaults;
 	minithread_t tcb;
+	interrupt_level_t old_level;
+	int id;
+
+	if (attr == NULL) {
+		minithread_attr_init(&defaults);
+		attr = &defaults;
+	}
 
 	if (proc == NULL) { // Fail if process pointer is NULL
-		fprintf(stderr, "ERROR: minithread_create() passed a NULL process pointer\n");
+		fprintf(stderr, "ERROR: minithread_create_attr() passed a NULL process pointer\n");
+		return NULL;
+	}
+	if (attr->level < 0 || attr->level > 3 || attr->quanta < 0 || attr->stack_size < 0) {
+		fprintf(stderr, "ERROR: minithread_create_attr() passed invalid attributes\n");
 		return NULL;
 	}
 
 	tcb = malloc(sizeof(struct minithread));
 
 	if (tcb == NULL) { // Fail if malloc() fails
-		fprintf(stderr, "ERROR: minithread_create() failed to malloc new TCB\n");
+		fprintf(stderr, "ERROR: minithread_create_attr() failed to malloc new TCB\n");
 		return NULL;
 	}
 
 	// Set TCB properties
-	tcb->id = ++thread_ctr;
+	do {
+		id = thread_ctr;
+	} while (compare_and_swap(&thread_ctr, id, id + 1) != id);  // Processors may create threads concurrently
+	tcb->id = id + 1;
 	tcb->dead = 0;
+	tcb->detached = attr->detached;
+	tcb->name[0] = '\0';
+	if (attr->name != NULL) {
+		strncpy(tcb->name, attr->name, MINITHREAD_NAME_LEN - 1);
+		tcb->name[MINITHREAD_NAME_LEN - 1] = '\0';
+	}
 	tcb->func = proc;
 	tcb->arg = arg;
-	tcb->run_level = 0; // Add new thread to highest level in run_queue
-	tcb->quanta_left = quanta_level[0];
+	tcb->exit_value = 0;
+	tcb->exited = NULL;
+	tcb->joined = 0;
+	tcb->run_level = attr->level; // Level 0 is the highest in run_queue
+	tcb->quanta = attr->quanta;
+	tcb->boost_level = MINITHREAD_NO_BOOST;
+	tcb->held_mutexes = NULL;
+	tcb->blocked_on = NULL;
+	list_node_init(&tcb->wait_node, tcb);
+	list_node_init(&tcb->zombie_node, tcb);
+	tcb->quanta_left = minithread_quanta(tcb);
+	tcb->quantum_used = 0;
+	tcb->state_since = minithread_clock_now();
+	tcb->epoch = (long) (tcb->state_since / boost_period);
+	run_queue_node_init(&(tcb->rq_node), tcb);
+	tcb->cpu = 0;
+	tcb->on_cpu = 0;
+	tcb->state = MINITHREAD_BLOCKED; // Until started
+	memset(&(tcb->stats), 0, sizeof(tcb->stats));
+	tcb->all_prev = NULL;
+	tcb->all_next = NULL;
 	
 	// Set up TCB stack
-	minithread_allocate_stack(&(tcb->stackbase), &(tcb->stacktop)); // Allocate new stack
-	minithread_initialize_stack(&(tcb->stacktop), proc, arg, /*&*/ minithread_exit, (arg_t) tcb); // Initialize stack with proc & cleanup functions
+	tcb->stack_size = attr->stack_size;
+	if (tcb->stack_size > 0) {
+		minithread_allocate_stack_size(&(tcb->stackbase), &(tcb->stacktop), tcb->stack_size);
+	} else {
+		minithread_allocate_stack(&(tcb->stackbase), &(tcb->stacktop)); // Allocate new stack
+	}
+	if (tcb->stackbase == NULL) {
+		fprintf(stderr, "ERROR: minithread_create_attr() failed to allocate stack\n");
+		free(tcb);
+		return NULL;
+	}
+	if (!tcb->detached) {
+		tcb->exited = semaphore_create_named("thread exited");
+		if (tcb->exited == NULL) {
+			fprintf(stderr, "ERROR: minithread_create_attr() failed to create exit semaphore\n");
+			minithread_deallocate(tcb);
+			return NULL;
+		}
+		semaphore_initialize(tcb->exited, 0);
+	}
+
+	// Make the thread visible to minithread_stats_dump
+	old_level = set_interrupt_level(DISABLED);
+	atomic_spin_lock(&all_threads_lock);
+	tcb->all_next = all_threads;
+	if (all_threads != NULL) {
+		all_threads->all_prev = tcb;
+	}
+	all_threads = tcb;
+	atomic_clear(&all_threads_lock);
+	set_interrupt_level(old_level);
+	minithread_initialize_stack(&(tcb->stacktop), (proc_t) minithread_run, (arg_t) tcb, /*&*/ minithread_exit, (arg_t) tcb); // Initialize stack with proc & cleanup functions
 	
 	return tcb;
 }
 
+int minithread_join(minithread_t thread, int* exit_value) {
+	interrupt_level_t old_level;
+
+	if (thread == NULL || thread == current) {
+		fprintf(stderr, "ERROR: minithread_join() passed a NULL or own thread\n");
+		return -1;
+	}
+	if (thread->detached) {
+		fprintf(stderr, "ERROR: minithread_join() passed a detached thread\n");
+		return -1;
+	}
+	if (swap(&(thread->joined), 1) == 1) {
+		fprintf(stderr, "ERROR: minithread_join() passed a thread that is already being joined\n");
+		return -1;
+	}
+
+	semaphore_P(thread->exited);
+	if (exit_value != NULL) {
+		*exit_value = thread->exit_value;
+	}
+
+	// The thread may still be switching away from its last run; leave it to the reaper
+	old_level = set_interrupt_level(DISABLED);
+	atomic_spin_lock(&zombie_lock);
+	list_append(&zombie_queue, &thread->zombie_node);
+	atomic_clear(&zombie_lock);
+	set_interrupt_level(old_level);
+
+	return 0;
+}
+
+void minithread_stats(minithread_t thread, minithread_stats_t* stats) {
+	unsigned long long elapsed;
+
+	*stats = thread->stats;
+	stats->id = thread->id;
+	memcpy(stats->name, thread->name, MINITHREAD_NAME_LEN);
+	stats->run_level = thread->run_level;
+	stats->state = thread->dead ? MINITHREAD_DEAD : thread->state;
+
+	// Include the time spent in the current state so far
+	elapsed = minithread_clock_now() - thread->state_since;
+	if (stats->state == MINITHREAD_RUNNABLE) {
+		stats->runnable_time += elapsed;
+	} else if (stats->state == MINITHREAD_BLOCKED) {
+		stats->blocked_time += elapsed;
+	}
+}
+
+void minithread_stats_dump() {
+	static const char* state_names[] = {"running", "runnable", "blocked", "dead"};
+	minithread_stats_t* snapshot;
+	minithread_t t;
+	int i, n = 0;
+	interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+	atomic_spin_lock(&all_threads_lock);
+	for (t = all_threads; t != NULL; t = t->all_next) {
+		n++;
+	}
+	snapshot = (minithread_stats_t*) malloc((n > 0 ? n : 1) * sizeof(minithread_stats_t));
+	if (snapshot == NULL) { // malloc() failed
+		atomic_clear(&all_threads_lock);
+		set_interrupt_level(old_level);
+		fprintf(stderr, "ERROR: minithread_stats_dump() failed to malloc snapshot\n");
+		return;
+	}
+	// Copy the stats under the lock, so that printing holds up no one
+	for (t = all_threads, i = 0; t != NULL; t = t->all_next, i++) {
+		minithread_stats(t, &snapshot[i]);
+	}
+	atomic_clear(&all_threads_lock);
+	set_interrupt_level(old_level);
+
+	printf("%6s %-16s %5s %-8s %8s %8s %8s %7s %12s %12s\n", "id", "name", "level", "state",
+		"ticks", "vol", "invol", "demoted", "runnable ms", "blocked ms");
+	for (i = 0; i < n; i++) {
+		printf("%6i %-16s %5i %-8s %8lu %8lu %8lu %7lu %12llu %12llu\n", snapshot[i].id, snapshot[i].name,
+			snapshot[i].run_level, state_names[snapshot[i].state], snapshot[i].ticks, snapshot[i].voluntary_switches,
+			snapshot[i].involuntary_switches, snapshot[i].demotions, snapshot[i].runnable_time / MILLISECOND,
+			snapshot[i].blocked_time / MILLISECOND);
+	}
+
+	free(snapshot);
+}
+
 /* */
 minithread_t minithread_self() {
 	return current;
@@ -120,50 +537,184 @@ int minithread_id() {
 }
 
 /* Take the current process off the run_queue. Can choose to put in a wait_queue. 
-	 Regardless, switch over to OS to now decide what to do. */
+	 Regardless, hand the processor straight to the next ready thread. */
 void minithread_stop() {
-	minithread_t tcb_old;
+	unsigned long long used = 0;
 
 	set_interrupt_level(DISABLED);        //CHECK!!!
-	tcb_old = current;
 
-	// Context switch to OS
-	current = globaltcb;
-	minithread_switch(&(tcb_old->stacktop), &(globaltcb->stacktop));
+	// A thread that blocks before using up a quantum at its level is interactive or waiting on I/O;
+	// move it up a level. The part quantum it carries is kept, so it cannot stay up by blocking just short of one
+	if (CLOCK_TICKLESS) {
+		used = current->quantum_used + (minithread_clock_now() - this_cpu->slice_start);
+	}
+	if (current->run_level > 0 && current->quanta_left == minithread_quanta(current) && used < clk_period) {
+		current->run_level--;
+		current->quanta_left = minithread_quanta(current);
+	}
+
+	current->stats.voluntary_switches++;
+	minithread_next(current);
+}
+
+/* Place t at the end of its level in this processor's run_queue. Interrupts must be disabled. */
+static int minithread_enqueue(minithread_t t) {
+	unsigned long long now = minithread_clock_now();
+	int result;
+
+	minithread_set_state(t, -1, MINITHREAD_RUNNABLE, now);
+	minithread_age(t, now);
+
+	atomic_spin_lock(&this_cpu->run_queue_lock);
+	t->cpu = this_cpu->id;
+	result = run_queue_enqueue(this_cpu->run_queue, minithread_priority(t), &(t->rq_node));
+	atomic_clear(&this_cpu->run_queue_lock);
+
+	return result;
+}
+
+int minithread_running(minithread_t t) {
+	int i;
+
+	for (i = 0; i < num_cpus; i++) {
+		if (cpus[i].running == t) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int minithread_priority(minithread_t t) {
+	int boost = t->boost_level;
+
+	return (boost < t->run_level) ? boost : t->run_level;
+}
+
+void minithread_boost(minithread_t t, int level) {
+	minithread_cpu_t cpu;
+	int priority;
+	interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+	t->boost_level = level;
+
+	// A waiting thread is moved so that the boost is seen by whichever processor dequeues it
+	priority = minithread_priority(t);
+	cpu = &cpus[t->cpu];
+	atomic_spin_lock(&cpu->run_queue_lock);
+	// Read level before cpu: t->cpu is written before t is linked into another processor's queue
+	if (t->rq_node.level != -1 && t->cpu == cpu->id && t->rq_node.level != priority) {
+		run_queue_remove(cpu->run_queue, &(t->rq_node));
+		run_queue_enqueue(cpu->run_queue, priority, &(t->rq_node));
+	}
+	atomic_clear(&cpu->run_queue_lock);
+
+	set_interrupt_level(old_level);
+}
+
+/* Wake one parked processor, if any, so that it can steal newly runnable work. */
+static void minithread_kick() {
+	int i;
+
+	for (i = 0; i < num_cpus; i++) {
+		// Clearing parked with a locked instruction also orders it after the preceding enqueue
+		if (&cpus[i] != this_cpu && compare_and_swap(&cpus[i].parked, 1, 0) == 1) {
+			pthread_kill(cpus[i].host, SIGRTMAX-1);
+			return;
+		}
+	}
 }
 
+/* Place t at the end of its level in run_queue. */
 void minithread_start(minithread_t t) {
 	interrupt_level_t old_level = set_interrupt_level(DISABLED);        //CHECK!!!
 
-	semaphore_P(mutex);
-	// Place at level 0 by default
-	// current->run_level = 0;
-	if (multilevel_queue_enqueue(run_queue, t->run_level, t) < 0) {
-		fprintf(stderr, "ERROR: minithread_yield() failed to append thread to end of level 0 in run_queue\n");
-		return;
+	if (minithread_enqueue(t) < 0) {
+		fprintf(stderr, "ERROR: minithread_start() failed to append thread to end of its level in run_queue\n");
+	} else if (current != this_cpu->idle) {
+		if (wakeup_preemption && minithread_priority(t) < minithread_priority(current)) {
+			this_cpu->resched = 1; // Switched to at the next minithread_resched()
+		}
+		if (num_cpus > 1) {
+			minithread_kick(); // This processor is busy; let an idle one take t
+		}
 	}
-	semaphore_V(mutex);
 
 	set_interrupt_level(old_level);
 }
 
-void minithread_yield() {
-	minithread_t tcb_old;
+void minithread_resched() {
+	minithread_t next = NULL;
+	interrupt_level_t old_level = set_interrupt_level(DISABLED);
 
-	set_interrupt_level(DISABLED);
-	tcb_old = current;
+	if (this_cpu->resched && current != this_cpu->idle) {
+		this_cpu->resched = 0;
+
+		// Only a thread still waiting above the current one takes its place
+		atomic_spin_lock(&this_cpu->run_queue_lock);
+		this_cpu->run_level = run_queue_dequeue_above(this_cpu->run_queue, minithread_priority(current), (void**) &next);
+		atomic_clear(&this_cpu->run_queue_lock);
+
+		if (next != NULL) {
+			current->stats.involuntary_switches++;
+			minithread_enqueue(current);
+			minithread_switch_to(current, next);
+		} else {
+			this_cpu->run_level = minithread_priority(current);
+		}
+	}
+
+	set_interrupt_level(old_level);
+}
+
+void minithread_yield() {
+	interrupt_level_t old_level = set_interrupt_level(DISABLED);
 
-	semaphore_P(mutex);
 	/* Move current process to end of its current level in run_queue */
-	if (multilevel_queue_enqueue(run_queue, current->run_level, current) < 0) {
+	if (minithread_enqueue(current) < 0) {
 		fprintf(stderr, "ERROR: minithread_yield() failed to append current process to end of its level in run_queue\n");
+		set_interrupt_level(old_level);
 		return;
 	}
-	semaphore_V(mutex);
 
-	//Context switch to OS
-	current = globaltcb;
-	minithread_switch(&(tcb_old->stacktop), &(globaltcb->stacktop));
+	// Context switch directly to the next ready process; a yield that finds nothing else ready is not a switch
+	if (minithread_next(current)) {
+		current->stats.voluntary_switches++;
+	}
+
+	set_interrupt_level(old_level);
+}
+
+/* Yield the processor directly to t, if t is waiting on a run_queue. Otherwise behaves like minithread_yield(). */
+void minithread_yield_to(minithread_t t) {
+	minithread_cpu_t cpu;
+	int removed = 0;
+	interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+	// Only a thread that is ready to run can be handed the processor
+	if (t != NULL && t != current) {
+		cpu = &cpus[t->cpu];
+		atomic_spin_lock(&cpu->run_queue_lock);
+		// Read level before cpu: t->cpu is written before t is linked into another processor's queue
+		if (t->rq_node.level != -1 && t->cpu == cpu->id) {
+			removed = (run_queue_remove(cpu->run_queue, &(t->rq_node)) == 0);
+		}
+		atomic_clear(&cpu->run_queue_lock);
+	}
+
+	if (!removed) {
+		set_interrupt_level(old_level);
+		minithread_yield();
+		return;
+	}
+
+	/* Move current process to end of its current level in run_queue */
+	minithread_enqueue(current);
+
+	current->stats.voluntary_switches++;
+	this_cpu->run_level = minithread_priority(t);
+	minithread_switch_to(current, t);
+
+	set_interrupt_level(old_level);
 }
 
 /*
@@ -172,65 +723,68 @@ void minithread_yield() {
  * function as parameter in minithread_system_initialize
  */
 void clock_handler(void* arg) {
-	elem_q* iter;
-	alarm_t alarm;
-	void (*func)();
-	void (*argument);
-	minithread_t tcb_old;
+	unsigned long long now;
 	interrupt_level_t old_level = set_interrupt_level(DISABLED); // Disable interrupts
 
-	tcb_old = current;
-
-	clk_count++; // Increment clock count
-
-	if (alarm_queue == NULL) { // Ensure alarm_queue has been initialized
-		alarm_queue = queue_new();
+	// Every processor has a clock for preemption; only the first keeps time and fires alarms
+	now = minithread_clock_now();
+	if (this_cpu->id == 0) {
+		clk_count++; // Increment clock count
+		alarm_fire(now);
 	}
-	iter = alarm_queue->head;
 
-	// While next alarm deadline has passed
-	while (iter && (iter->next != alarm_queue->head) && (((alarm_t)(iter->data))->deadline <= ((unsigned long long) clk_count) * clk_period)) {
-	alarm = (alarm_t) iter->data;
-	if (alarm->executed != 1) {      //Only if we haven't yet processed this alarm
-		func = alarm->func;
-		argument = alarm->arg;
-		func(argument);
-		alarm->executed = 1;
+	// Move threads waiting here back up to level 0 at the start of each aging period
+	if (this_cpu->epoch != (long) (now / boost_period)) {
+		this_cpu->epoch = (long) (now / boost_period);
+		atomic_spin_lock(&this_cpu->run_queue_lock);
+		run_queue_merge(this_cpu->run_queue, 0);
+		atomic_clear(&this_cpu->run_queue_lock);
 	}
-	iter = iter->next;   // Bump alarm pointer
-	}
-
-	// Process last alarm_queue element
-	if (iter && (((alarm_t)(iter->data))->deadline <= ((unsigned long long) clk_count) * clk_period)) {
-		alarm = (alarm_t) iter->data;
-		if (alarm->executed != 1) {      //Only if we haven't yet processed this alarm
-			func = alarm->func;
-			argument = alarm->arg;
-			func(argument);
-			alarm->executed = 1;
-		}
-	}
-
 
 	// Track non-privileged process quanta
-	if (current != globaltcb) {  // Applies only to non-OS threads
-		(current->quanta_left)--;    // Do we guarantee that this only happens AFTER the current thread has run >= 1 quanta?
+	if (current != this_cpu->idle) {  // Applies only to non-OS threads
+		minithread_age(current, now);
+		if (!CLOCK_TICKLESS) {
+			current->stats.ticks++;
+			(current->quanta_left)--;    // Do we guarantee that this only happens AFTER the current thread has run >= 1 quanta?
+		} else if (now >= this_cpu->slice_end) { // Otherwise the clock went off for an alarm, or early
+			current->stats.ticks += current->quanta_left;
+			current->quanta_left = 0;
+			current->quantum_used = 0;
+			this_cpu->slice_start = now;
+		}
 		
 		// Time's Up
 		if (current->quanta_left == 0) {
-			current->run_level = (current->run_level + 1) % 4;   // Choose to wrap around processes to have priority "refreshed"
-			current->quanta_left = quanta_level[current->run_level];
-			multilevel_queue_enqueue(run_queue, current->run_level, current);
+			minithread_demote(current);
+			minithread_enqueue(current);
 			
-			current = globaltcb;
-			// system_run_level = -1;
-			minithread_switch(&(tcb_old->stacktop), &(globaltcb->stacktop));  //Context switch to OS to choose next process
+			if (minithread_next(current)) { //Context switch directly to the next process
+				current->stats.involuntary_switches++;
+			}
+			set_interrupt_level(DISABLED);
 		}
 	}
 
+	minithread_resched(); // An alarm may have woken a thread above current
+	minithread_clock_program();
 	set_interrupt_level(old_level); // Restore old interrupt level
 }
 
+/*
+ * Entry points for network and disk interrupts. A packet or completed request may wake a
+ * thread above the one that was interrupted, which then takes the processor on return.
+ */
+static void minithread_network_interrupt(network_interrupt_arg_t* pkt) {
+	network_handler(pkt);
+	minithread_resched();
+}
+
+static void minithread_disk_interrupt(disk_interrupt_arg_t* arg) {
+	disk_handler(arg);
+	minithread_resched();
+}
+
 /*
  * Initialization.
  *
@@ -246,33 +800,118 @@ void clock_handler(void* arg) {
  *
  */
 void minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
-	// Create "OS"/kernel TCB
-	globaltcb = (minithread_t) malloc(sizeof(struct minithread));
-	if (globaltcb == NULL) { // Fail if malloc() fails
-		fprintf(stderr, "ERROR: minithread_system_initialize() failed to malloc kernel TCB\n");
-		return;
+	minithread_system_initialize_cpus(mainproc, mainarg, 1);
+}
+
+/*
+ * SIGSEGV handler. Runs on the signal stack, so it still works when the faulting
+ * thread has run off the end of its own stack onto the guard page.
+ */
+static void stack_fault_handler(int sig, siginfo_t* si, void* context) {
+	char message[64];
+	int length;
+
+	if (current != NULL && minithread_stack_guard_hit(current->stackbase, si->si_addr)) {
+		// Not fprintf: unbuffered stderr formats through a buffer too big for the signal stack
+		length = snprintf(message, sizeof(message), "ERROR: minithread %i overflowed its stack\n", current->id);
+		write(2, message, length);
+		abort();
 	}
 
-	// Allocate stack
-	minithread_allocate_stack(&(globaltcb->stackbase), &(globaltcb->stacktop));
+	signal(SIGSEGV, SIG_DFL); // Not an overflow; the faulting access is retried and crashes as usual
+}
+
+/*
+ * Body of the host thread behind each additional virtual processor: start its clock
+ * and run its idle thread.
+ */
+static void* minithread_cpu_main(void* arg) {
+	this_cpu = (minithread_cpu_t) arg;
+	this_cpu->host = pthread_self();
+	current = this_cpu->idle;
+	this_cpu->running = current;
+
+	minithread_clock_init_cpu(this_cpu->id, CLOCK_TICKLESS ? 0 : clk_period);
+	set_interrupt_level(ENABLED);
 
-	// Create mutex for shared-state accesses
-	mutex = semaphore_create();
-	semaphore_initialize(mutex, 1);
+	minithread_idle();
+	return NULL;
+}
 
-	// Create multilevel-feedback queue
-	if (run_queue == NULL) run_queue = multilevel_queue_new(4);
-	// system_run_level = -1;
+void minithread_system_initialize_cpus(proc_t mainproc, arg_t mainarg, int n) {
+	minithread_cpu_t cpu;
+	struct sigaction fault_action;
+	int i;
 
-	// Create zombie queue for dead threads
-	if (zombie_queue == NULL) zombie_queue = queue_new();
+	if (n < 1 || n > MAX_CPUS) {
+		fprintf(stderr, "ERROR: minithread_system_initialize_cpus() passed invalid number of processors %i\n", n);
+		return;
+	}
+	num_cpus = n;
+
+	for (i = 0; i < num_cpus; i++) {
+		cpu = &cpus[i];
+		cpu->id = i;
+		cpu->prev = NULL;
+		cpu->run_queue_lock = 0;
+		cpu->run_level = -1;
+		cpu->parked = 0;
+		cpu->resched = 0;
+		cpu->epoch = 0;
+		cpu->idle_time = 0;
+		cpu->idle_wakeups = 0;
+
+		// Create "OS"/kernel TCB
+		cpu->idle = (minithread_t) malloc(sizeof(struct minithread));
+		if (cpu->idle == NULL) { // Fail if malloc() fails
+			fprintf(stderr, "ERROR: minithread_system_initialize_cpus() failed to malloc kernel TCB\n");
+			return;
+		}
+
+		// Kernel TCB runs on its host thread's stack; its stacktop is saved on the first switch away
+		cpu->idle->id = 0;
+		cpu->idle->dead = 0;
+		cpu->idle->detached = 1;
+		snprintf(cpu->idle->name, MINITHREAD_NAME_LEN, "idle%d", i);
+		cpu->idle->run_level = 0;
+		cpu->idle->quanta = 0;
+		cpu->idle->boost_level = MINITHREAD_NO_BOOST;
+		cpu->idle->held_mutexes = NULL;
+		cpu->idle->blocked_on = NULL;
+		list_node_init(&cpu->idle->wait_node, cpu->idle);
+		list_node_init(&cpu->idle->zombie_node, cpu->idle);
+		cpu->idle->quanta_left = 0;
+		cpu->idle->quantum_used = 0;
+		cpu->idle->epoch = 0;
+		cpu->idle->exited = NULL;
+		cpu->idle->state = MINITHREAD_RUNNING;
+		cpu->idle->state_since = 0;
+		memset(&(cpu->idle->stats), 0, sizeof(cpu->idle->stats));
+		cpu->idle->stack_size = 0;
+		cpu->idle->cpu = i;
+		cpu->idle->on_cpu = 1;
+		cpu->idle->stackbase = NULL;
+		cpu->idle->stacktop = NULL;
+
+		// Create multilevel-feedback queue
+		cpu->run_queue = run_queue_new(4, level_weight);
+	}
+
+	// The calling host thread becomes the first processor
+	this_cpu = &cpus[0];
+	this_cpu->host = pthread_self();
 
 	/* Set up clock and alarms */
-	minithread_clock_init(clk_period, (interrupt_handler_t) &clock_handler);
-	alarm_queue = queue_new();
+	minithread_clock_init(CLOCK_TICKLESS ? 0 : clk_period, (interrupt_handler_t) &clock_handler);
+
+	// Report stack overflows, on the clock's signal stack
+	fault_action.sa_sigaction = stack_fault_handler;
+	fault_action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&fault_action.sa_mask);
+	sigaction(SIGSEGV, &fault_action, NULL);
 
 	// Initialize the network and related resources
-	network_initialize((network_handler_t) &network_handler);
+	network_initialize((network_handler_t) &minithread_network_interrupt);
 	minimsg_initialize();
 	minisocket_initialize();
 	miniroute_initialize();
@@ -280,7 +919,7 @@ void minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
 
 	// Initialize Disk
 	disk_initialize(&disk);
-	install_disk_handler((interrupt_handler_t) disk_handler);
+	install_disk_handler((interrupt_handler_t) minithread_disk_interrupt);
 
 	/*
 	// Create requests table
@@ -290,84 +929,208 @@ void minithread_system_initialize(proc_t mainproc, arg_t mainarg) {
 		return;
 	}
 	//Init mmbm_sema to correct size
-	mmbm_sema = semaphore_create(); 
+	mmbm_sema = semaphore_create_named("mmbm_sema"); 
 	semaphore_initialize(mmbm_sema, MAX_PENDING_DISK_REQUESTS);
 
 	//Init mmbm mutex
-	mmbm_mutex = semaphore_create(); 
+	mmbm_mutex = semaphore_create_named("mmbm_mutex"); 
 	semaphore_initialize(mmbm_mutex, 1);
 	*/
 
-	// Create and schedule first minithread                 
-	current = minithread_fork(mainproc, mainarg);         //CHECK FOR INVARIANT!!!!!
+	// Create and schedule first minithread; the kernel TCB stays current until the first switch
+	current = this_cpu->idle;
+	this_cpu->running = current;
+	minithread_fork(mainproc, mainarg);
+
+	// Start the thread that executes deferred alarms
+	alarm_initialize();
+
+	// Start the remaining processors; they inherit this thread's unblocked interrupt signals
+	for (i = 1; i < num_cpus; i++) {
+		if (pthread_create(&cpus[i].host, NULL, minithread_cpu_main, &cpus[i]) != 0) {
+			fprintf(stderr, "ERROR: minithread_system_initialize_cpus() failed to start processor %i\n", i);
+		}
+	}
 
 	set_interrupt_level(ENABLED);
 
 	// OS Code
-	while (1) {
-		// Periodically free up zombie queue
-		if (queue_length(zombie_queue) == zombie_limit) {
-			queue_iterate(zombie_queue, (func_t) minithread_deallocate_func, NULL);     //deallocate all threads in zombie queue
-			//queue_free(zombie_queue);                                 //NOTE: Would NOT need to again do "queue_new" for zombie_thread
-			zombie_queue = queue_new();                               //IFF we've written queue_free such that it does not make zombie_queue NULL 
+	minithread_idle();
+}
+
+/*
+ * Free up to zombie_batch dead threads, returning their stacks to the stack cache, so
+ * that no single pass takes long. Must be called with interrupts disabled. Zombies still
+ * switching out on some processor (the caller included, if it is exiting) are left for
+ * a later pass.
+ */
+static void minithread_reap() {
+	minithread_t zombie;
+	int i, length, freed = 0;
+
+	if (atomic_test_and_set(&zombie_lock) == 1) {
+		return; // Another processor is reaping or a thread is exiting; try again later
+	}
+
+	length = list_length(&zombie_queue);
+	for (i = 0; i < length && freed < zombie_batch; i++) {
+		zombie = (minithread_t) list_dequeue(&zombie_queue);
+		if (zombie->on_cpu) {
+			list_append(&zombie_queue, &zombie->zombie_node);
+		} else {
+			minithread_deallocate(zombie);
+			freed++;
 		}
+	}
+
+	atomic_clear(&zombie_lock);
+}
+
+/*
+ * Issue rt_sigsuspend directly rather than through libc. An interrupt that arrives
+ * while the host thread is parked then interrupts an instruction inside the
+ * minithread package, so handle_interrupt delivers it instead of dropping it.
+ */
+static long idle_sigsuspend(sigset_t* mask) {
+	long result;
+
+	__asm__ volatile ("syscall"
+		: "=a" (result)
+		: "0" ((long) SYS_rt_sigsuspend), "D" (mask), "S" ((long) (_NSIG / 8)) // Kernel sigset size
+		: "rcx", "r11", "memory");
+
+	return result;
+}
+
+/* Return 1 if any processor has a thread ready to run. */
+static int minithread_work_ready() {
+	int i;
+
+	for (i = 0; i < num_cpus; i++) {
+		if (run_queue_length(cpus[i].run_queue) > 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Park the host thread until the next interrupt, unless a thread became runnable.
+ * Called by the idle thread with interrupts disabled.
+ */
+static void minithread_idle_wait() {
+	sigset_t interrupt_signals, old_mask;
+	unsigned long long before;
 
-		if (multilevel_queue_length(run_queue) > 0) {
-			minithread_next(globaltcb); // Select next ready process
+	// Hold off interrupt signals so none can slip in between checking run_queue and parking
+	sigemptyset(&interrupt_signals);
+	sigaddset(&interrupt_signals, SIGRTMAX-1);
+	sigaddset(&interrupt_signals, SIGRTMAX-2);
+	pthread_sigmask(SIG_BLOCK, &interrupt_signals, &old_mask);
+
+	// Advertise the park before the final check, so a processor that enqueues work afterwards kicks us
+	swap(&this_cpu->parked, 1);
+
+	if (!minithread_work_ready()) {
+		before = minithread_clock_now();
+
+		// Atomically unblock and wait; the interrupt handler runs before this returns
+		set_interrupt_level(ENABLED);
+		idle_sigsuspend(&old_mask);
+		set_interrupt_level(DISABLED);
+
+		this_cpu->idle_time += minithread_clock_now() - before;
+		this_cpu->idle_wakeups++;
+	}
+
+	this_cpu->parked = 0;
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+/*
+ * The idle thread. Runs on each processor's kernel TCB whenever that processor has no
+ * minithread to run: frees dead threads, hands the processor to the next ready thread
+ * (stealing one from a busy processor if need be), and otherwise parks the host thread
+ * instead of spinning.
+ */
+void minithread_idle() {
+	minithread_t next;
+
+	while (1) {
+		set_interrupt_level(DISABLED);
+
+		minithread_reap();
+
+		next = minithread_dequeue();
+		if (next != NULL) {
+			minithread_switch_to(this_cpu->idle, next); // Run next ready process
+		} else {
+			minithread_idle_wait(); // Sleep until an interrupt makes a thread runnable
 		}
-	}  
+	}
+}
+
+/* Total time [ns] the idle threads have spent parked waiting for interrupts. */
+unsigned long long minithread_idle_time() {
+	unsigned long long total = 0;
+	int i;
+
+	for (i = 0; i < num_cpus; i++) {
+		total += cpus[i].idle_time;
+	}
+
+	return total;
+}
+
+/* Number of times the idle threads have been woken from a park. */
+unsigned long long minithread_idle_wakeups() {
+	unsigned long long total = 0;
+	int i;
+
+	for (i = 0; i < num_cpus; i++) {
+		total += cpus[i].idle_wakeups;
+	}
+
+	return total;
 }
 
+
 /*
  * minithread_sleep_with_timeout(int delay)
  *      Put the current thread to sleep for [delay] milliseconds
  */
 void minithread_sleep_with_timeout(int delay) {
-	semaphore_t alert = semaphore_create();
+	semaphore_t alert = semaphore_create_named("sleep");
 	semaphore_initialize(alert, 0);
 	register_alarm(delay, (alarm_handler_t) semaphore_V, (void*) alert);
 	semaphore_P(alert);
 }
 
-/* Pick next process to run. SHOULD ONLY run in OS MODE */
-void minithread_next(minithread_t self) {
-
-	//Make the OS scheduler probabilistic rather than just selecting from the next level down
-	int nxt_lvl;
-	float val = (float)rand() / RAND_MAX;
-	// float prob = 0;
-	// int i = 0;
-
-	/*while (i < run_queue->num_levels) {
-	prob += prob_level[i];
-	if (val < prob) {
-		nxt_lvl = i;
-	}
-	i++;
-	}*/
-
-	interrupt_level_t old_level = set_interrupt_level(DISABLED); // Disable interrupts
-
-	if (val < prob_level[0])       // Pri 0
-		nxt_lvl = 0;
-	else if (val < (prob_level[0] + prob_level[1]))  // Pri 1
-		nxt_lvl = 1;
-	else if (val < (prob_level[0] + prob_level[1] + prob_level[2]))  // Pri 2
-		nxt_lvl = 2;
-	else   //Pri 3
-		nxt_lvl = 3;
+/*
+ * Pick next process to run and switch from self straight to it, falling back to the
+ * idle thread when nothing is runnable. Must be called with interrupts disabled;
+ * returns once self is scheduled again, with interrupts enabled.
+ */
+int minithread_next(minithread_t self) {
+	minithread_t next;
 
-	// fprintf(stderr, "%d\n", nxt_lvl); // DEBUG!!!
+	// Dead threads are freed here too, since a busy system may rarely reach the idle thread
+	minithread_reap();
 
-	system_run_level = multilevel_queue_dequeue(run_queue, nxt_lvl, (void**) &current); // Set new run_level
+	next = minithread_dequeue();
 
-	if (current == NULL) {
-		fprintf(stderr, "ERROR: minithread_next() attempted to context switch to NULL current thread pointer\n");
+	if (next == NULL) { // Nothing ready; let the idle thread wait for an interrupt
+		next = this_cpu->idle;
 	}
 
-	minithread_switch(&(self->stacktop), &(current->stacktop)); // Context switch to next ready process
+	if (next == self) { // self is the only ready thread; keep running without a switch
+		set_interrupt_level(ENABLED);
+		return 0;
+	}
 
-	set_interrupt_level(old_level); // Restore old interrupt level
+	minithread_switch_to(self, next); // Context switch to next ready process
+	return 1;
 }
 
 /*
@@ -378,22 +1141,54 @@ int minithread_exit(arg_t arg) {
 	set_interrupt_level(DISABLED);
 
 	((minithread_t) arg)->dead = 1;   //do we need this? if using zombie_queue, probably not...
-	queue_append(zombie_queue, current);
+	if (current->detached) {
+		atomic_spin_lock(&zombie_lock);
+		list_append(&zombie_queue, &current->zombie_node);
+		atomic_clear(&zombie_lock);
+	} else {
+		semaphore_V(current->exited); // The joiner hands this thread to the reaper
+	}
 	
-	// Context switch to OS/kernel
-	current = globaltcb;
-	// minithread_switch(&(tcb_old->stacktop), &(globaltcb->stacktop));
-	minithread_switch(&(((minithread_t) arg)->stacktop), &(globaltcb->stacktop));
+	// Context switch to next process; the scheduler frees this one once it is switched out
+	minithread_next((minithread_t) arg);
 	return 0;
 }
 
 /* Wake up a thread. */
 int minithread_wake(minithread_t thread) {
-	return multilevel_queue_enqueue(run_queue, thread->run_level, thread);    //CHECK!!!    //NOT currently thread-safe
+	int result;
+	interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+	result = minithread_enqueue(thread);
+
+	set_interrupt_level(old_level);
+	return result;
 }
 
-/* Deallocate a thread. */
+/* Deallocate a thread, returning its stack to the stack cache. */
 void minithread_deallocate(minithread_t thread) {
+	interrupt_level_t old_level = set_interrupt_level(DISABLED);
+
+	atomic_spin_lock(&all_threads_lock);
+	if (thread->all_prev != NULL) {
+		thread->all_prev->all_next = thread->all_next;
+	} else if (all_threads == thread) {
+		all_threads = thread->all_next;
+	}
+	if (thread->all_next != NULL) {
+		thread->all_next->all_prev = thread->all_prev;
+	}
+	atomic_clear(&all_threads_lock);
+	set_interrupt_level(old_level);
+
+	if (thread->stack_size > 0) {
+		minithread_free_stack_size(thread->stackbase, thread->stack_size);
+	} else {
+		minithread_free_stack(thread->stackbase);
+	}
+	if (thread->exited != NULL) {
+		semaphore_destroy(thread->exited);
+	}
 	free(thread);
 }
 
@@ -425,6 +1220,7 @@ void network_handler(network_interrupt_arg_t* pkt) {
 	unsigned int ack_num;	// of the packet
 	char* subbuffer;
 	mini_header_reliable_t hdr;
+	network_interrupt_arg_t* evicted;
 
 	interrupt_level_t old_level = set_interrupt_level(DISABLED); // Disable interrupts
 
@@ -461,10 +1257,14 @@ void network_handler(network_interrupt_arg_t* pkt) {
 				if (network_compare_network_addresses(dest_addr, my_addr) != 0) {  // This packet is meant for me
 					if (ports[dest_port] != NULL) {     //Locally unbound port exists
 						fprintf(stderr, "GOT HERE?\n");
-						if (ports[dest_port]->u.unbound.incoming_data != NULL) {  //Queue at locally unbound port has been initialized
-							//Put PTR TO ENTIRE PACKET (type: network_interrupt_arg_t*) in the queue at that port
-							queue_append(ports[dest_port]->u.unbound.incoming_data, /*(void*)*/ pkt);   //(minimsg_t) subbuffer, data;
-							semaphore_V(ports[dest_port]->u.unbound.datagrams_ready);   // V on semaphore
+						if (ports[dest_port]->u.unbound.incoming_data != NULL) {  //Ring at locally unbound port has been initialized
+							//Put PTR TO ENTIRE PACKET (type: network_interrupt_arg_t*) in the ring at that port
+							ring_put(ports[dest_port]->u.unbound.incoming_data, /*(void*)*/ pkt, (void**) &evicted); // Never refused
+							if (evicted != NULL) {
+								free(evicted); // Ring was full; the oldest datagram made room, so the count is unchanged
+							} else {
+								semaphore_V(ports[dest_port]->u.unbound.datagrams_ready);   // V on semaphore
+							}
 						} else
 							fprintf(stderr, "Network handler: queue not set. ERROR\n");
 					} else
@@ -497,31 +1297,30 @@ void network_handler(network_interrupt_arg_t* pkt) {
 								fprintf(stderr, "Got an ACK of some sort\n");
 								// Consider cases of empty ACK vs. data ACK
 								if (pkt->size == sizeof(struct mini_header_reliable)) { // Empty ACK
-									if (sockets[dest_port]->alarm != NULL && !sockets[dest_port]->alarm->executed) {
+									if (swap(&(sockets[dest_port]->awaiting_ack), 0)) { // Wake the sender, unless it gave up
 										// semaphore_V(sockets[dest_port]->timeout);
 										semaphore_V(sockets[dest_port]->datagrams_ready);
 										fprintf(stderr, "Got empty ACK packet\n");
 									}
-									deregister_alarm(sockets[dest_port]->alarm);
-									sockets[dest_port]->alarm = NULL;
-									// sockets[dest_port]->alarm->executed = 1;
 								} else { // Data ACK
 									fprintf(stderr, "Got data ACK packet\n");
 									if (seq_num == sockets[dest_port]->acknum + 1) { // First arrival of message
+										// Receiver is behind: drop the packet without ACKing it, so the sender retransmits later
+										if (ring_put(sockets[dest_port]->incoming_data, pkt, NULL) < 0) {
+											free(pkt);
+											set_interrupt_level(old_level);
+											return;
+										}
 										sockets[dest_port]->acknum++;
 
 										// Treat data ACK as an empty ACK if something is awaiting an ACK
-										if (sockets[dest_port]->alarm != NULL && !sockets[dest_port]->alarm->executed) {
+										if (swap(&(sockets[dest_port]->awaiting_ack), 0)) {
 											// semaphore_V(sockets[dest_port]->timeout);
 											semaphore_V(sockets[dest_port]->datagrams_ready);
 										}
-										deregister_alarm(sockets[dest_port]->alarm);
-										sockets[dest_port]->alarm = NULL;
-										// sockets[dest_port]->alarm->executed = 1;
 
 										fprintf(stderr, "Got data ACK packet\n");
 
-										queue_append(sockets[dest_port]->incoming_data, pkt);
 										semaphore_V(sockets[dest_port]->datagrams_ready);
 									}
 
@@ -563,14 +1362,11 @@ void network_handler(network_interrupt_arg_t* pkt) {
 							} else if (msg_type == MSG_SYNACK) {
 								fprintf(stderr, "Got MSG_SYNACK packet\n");
 								// Disable timeout alert
-								if (sockets[dest_port]->alarm != NULL && !sockets[dest_port]->alarm->executed) {
+								if (swap(&(sockets[dest_port]->awaiting_ack), 0)) {
 									sockets[dest_port]->acknum++;
 									// semaphore_V(sockets[dest_port]->timeout);
 									semaphore_V(sockets[dest_port]->datagrams_ready);
 								}
-								deregister_alarm(sockets[dest_port]->alarm);
-								sockets[dest_port]->alarm = NULL;
-								// sockets[dest_port]->alarm->executed = 1;
 
 								// Send an empty ACK back
 								hdr = malloc(sizeof(struct mini_header_reliable));	// Allocate new header for ACK packet
@@ -703,9 +1499,7 @@ void network_handler(network_interrupt_arg_t* pkt) {
 				return;
 			}
 			if (dest_elem->path[0][0] == 0) { // Only update cache entry's path if not already completed
-				if (dest_elem->reply != NULL && dest_elem->reply->executed == 0) { // Timout has not yet occured and reply has not already been received
-					deregister_alarm(dest_elem->reply);
-					dest_elem->reply = NULL;
+				if (swap(&(dest_elem->awaiting_reply), 0)) { // Timout has not yet occured and reply has not already been received
 
 					// Reverse path
 					for (i = path_len; i >= 0; i--) {
@@ -715,8 +1509,12 @@ void network_handler(network_interrupt_arg_t* pkt) {
 					}
 					dest_elem->path_len = path_len; // Update path length
 
-					// Create cache entry expiration alarm
-					dest_elem->expire = register_alarm(3000, (alarm_handler_t) remove_cache_entry, (void*) dest_elem);
+					// Create cache entry expiration alarm, reusing the entry's last one if it has not yet gone off; deferred,
+					// since removing the entry walks the route cache
+					if (rearm_alarm(dest_elem->expire, 3000) < 0) {
+						dest_elem->expire = register_deferred_alarm(3000, (alarm_handler_t) remove_cache_entry, (void*) dest_elem);
+						set_alarm_slack(dest_elem->expire, ROUTE_EXPIRE_SLACK);
+					}
 
 					semaphore_V(dest_elem->timeout);
 				}
@@ -765,50 +1563,102 @@ void remove_cache_entry(cache_elem_t entry) {
 	int result;
 
 	deregister_alarm(entry->expire);
+	deregister_alarm(entry->discovery_alarm); // Parked: the entry's discovery has finished
+
+	// Run by the softirq thread, so discoveries and lookups may be using the cache meanwhile
+	rwlock_write_lock(cache_lock);
 	result = cache_table_remove(cache, entry->dest);
+	rwlock_write_unlock(cache_lock);
 
 	if (result < 0) {
 		fprintf(stderr, "ERROR: remove_cache_entry() couldn't remove cache table entry\n");
 	}
 }
 
-void disk_handler(disk_interrupt_arg_t* arg) {
-	// disk_t* disk_ptr;
-	// disk_request_t request;
-	// disk_reply_t reply;
-	// disk_request_type_t type;
-	// int blocknum;
-	//char* block;
-	// superblock_t superblk;
-	//int entry;
-	//semaphore_t req_sema;
-
-	// Identify arg type
-	// disk_ptr = arg->disk;
-	//request = arg->request;
-	// reply = arg->reply;
-	// type = request.type;
-	// blocknum = request.blocknum;
-	//block = request.buffer;
-
-	/*printf("Name of your disk: %s\n", disk_name);	
-	printf("Size of disk (in blocks): %i\n", disk_ptr->layout.size);
-	printf("This arg's disk reply: %i\n", reply);*/
+/*
+ * Send a disk request and return a future completed with the disk's reply, or NULL if it
+ * could not be sent.
+ */
+static minithread_future_t disk_send_request_async(disk_t* disk, int blocknum, char* buffer, disk_request_type_t type) {
+	minithread_future_t future;
+	interrupt_level_t old_level;
+	int i, entry = -1;
 
-	/*
-	// Search through mmbm_t requests until found same char* as for the thing
-	entry = 0;
-	while (entry < MAX_PENDING_DISK_REQUESTS  &&  requests->buff_addr[entry] != block) {
-		entry++;
+	future = future_create();
+	if (future == NULL) {
+		return NULL;
 	}
-	if (entry == MAX_PENDING_DISK_REQUESTS) { // Didn't find in mmbm_t table
-		printf("ERROR: disk_handler returned a disk reply not corresponding to an active disk handler\n");
-	} else {
-		req_sema = *(requests->sema_addr[entry]);
-		semaphore_V(req_sema);
-		// The thread will handle deallocation of entry in mmbtm
+
+	old_level = set_interrupt_level(DISABLED);
+	atomic_spin_lock(&disk_pending_lock);
+	for (i = 0; i < MAX_PENDING_DISK_REQUESTS; i++) {
+		if (disk_pending[i].future == NULL) {
+			entry = (entry < 0) ? i : entry;
+		} else if (disk_pending[i].request.buffer == buffer && disk_pending[i].request.blocknum == blocknum
+				&& disk_pending[i].request.type == type) {
+			entry = -2; // Its reply could not be told apart from this one's
+			break;
+		}
 	}
-	*/
+	if (entry >= 0) {
+		disk_pending[entry].request.blocknum = blocknum;
+		disk_pending[entry].request.buffer = buffer;
+		disk_pending[entry].request.type = type;
+		disk_pending[entry].future = future;
+	}
+	atomic_clear(&disk_pending_lock);
+	set_interrupt_level(old_level);
 
-	return;
+	if (entry == -1) {
+		fprintf(stderr, "ERROR: disk_send_request_async() found too many requests pending\n");
+		future_destroy(future);
+		return NULL;
+	}
+	if (entry == -2) {
+		fprintf(stderr, "ERROR: disk_send_request_async() passed a request identical to a pending one\n");
+		future_destroy(future);
+		return NULL;
+	}
+
+	if (disk_send_request(disk, blocknum, buffer, type) < 0) {
+		fprintf(stderr, "ERROR: disk_send_request_async() failed to send request\n");
+		old_level = set_interrupt_level(DISABLED);
+		atomic_spin_lock(&disk_pending_lock);
+		disk_pending[entry].future = NULL;
+		atomic_clear(&disk_pending_lock);
+		set_interrupt_level(old_level);
+		future_destroy(future);
+		return NULL;
+	}
+
+	return future;
+}
+
+minithread_future_t disk_read_block_async(disk_t* disk, int blocknum, char* buffer) {
+	return disk_send_request_async(disk, blocknum, buffer, DISK_READ);
+}
+
+minithread_future_t disk_write_block_async(disk_t* disk, int blocknum, char* buffer) {
+	return disk_send_request_async(disk, blocknum, buffer, DISK_WRITE);
+}
+
+void disk_handler(disk_interrupt_arg_t* arg) {
+	minithread_future_t future = NULL;
+	int i;
+
+	// Find the asynchronous request this reply answers; the disk identifies it only by its contents
+	atomic_spin_lock(&disk_pending_lock);
+	for (i = 0; i < MAX_PENDING_DISK_REQUESTS; i++) {
+		if (disk_pending[i].future != NULL && disk_pending[i].request.buffer == arg->request.buffer
+				&& disk_pending[i].request.blocknum == arg->request.blocknum && disk_pending[i].request.type == arg->request.type) {
+			future = disk_pending[i].future;
+			disk_pending[i].future = NULL;
+			break;
+		}
+	}
+	atomic_clear(&disk_pending_lock);
+
+	if (future != NULL) {
+		future_complete(future, arg->reply);
+	}
 }
\ No newline at end of file
@@ -16,6 +16,7 @@
 #include "interrupts.h"
 #include "queue.h"
 #include "synch.h"
+#include "future.h"
 #include "alarm.h"
 #include "multilevel_queue.h"
 #include "network.h"
@@ -23,6 +24,30 @@
 #include "disk.h"
 #include "block_defs.h"
 
+#define MINITHREAD_NAME_LEN 32
+
+/*
+ * Scheduling statistics of a thread. Times are in nanoseconds.
+ */
+typedef struct minithread_stats minithread_stats_t;
+struct minithread_stats {
+	int id;
+	char name[MINITHREAD_NAME_LEN];
+	int run_level; // Level in run_queue the thread is currently at
+	int state; // MINITHREAD_RUNNING, MINITHREAD_RUNNABLE, MINITHREAD_BLOCKED or MINITHREAD_DEAD
+	unsigned long ticks; // Clock ticks that found the thread running
+	unsigned long voluntary_switches; // Times it yielded or blocked
+	unsigned long involuntary_switches; // Times it was preempted for using up its quanta
+	unsigned long demotions; // Times it was moved down a level in run_queue
+	unsigned long long runnable_time; // Time spent in run_queue waiting for a processor
+	unsigned long long blocked_time; // Time spent blocked, e.g. on a semaphore
+};
+
+#define MINITHREAD_RUNNING 0
+#define MINITHREAD_RUNNABLE 1
+#define MINITHREAD_BLOCKED 2
+#define MINITHREAD_DEAD 3
+
 /*
  * struct minithread:
  *  This is the key data structure for the thread management package.
@@ -32,23 +57,49 @@ typedef struct minithread *minithread_t;
 struct minithread {
 	int id;
 	int dead;
+	int detached; // Freed as soon as it exits, rather than kept until joined
+	char name[MINITHREAD_NAME_LEN]; // Name for debugging
 
 	int run_level; // Current level in run_queue that thread is running on
 	int quanta_left; // Number of quanta thread may run (necessary?)
+	int quanta; // Quanta per turn at every level, overriding quanta_level (0 if not overridden)
+	int boost_level; // Level lent by threads waiting on a mutex it holds (MINITHREAD_NO_BOOST if none)
+	mutex_t held_mutexes; // Mutexes it holds, linked through next_held
+	mutex_t blocked_on; // Mutex it is waiting for, or NULL
+	list_node wait_node; // Links it into the wait queue of the synch primitive it is blocked on
+	list_node zombie_node; // Links it into the zombie list once it is dead
+	unsigned long long quantum_used; // Time [ns] run into its current quantum (tickless clock)
+	long epoch; // Aging period in which it was last moved up to level 0
+	run_queue_node rq_node; // Links thread into run_queue without allocating
+	int cpu; // Virtual processor whose run queue the thread was last placed on
+	volatile int on_cpu; // Set from being switched to until its context is saved after switching away
 
 	stack_pointer_t stackbase;
 	stack_pointer_t stacktop;
+	int stack_size; // Size the stack was allocated with (0 for the default size)
 
 	proc_t func;
 	arg_t arg;
+	int exit_value; // Value returned by func
+	semaphore_t exited; // Signalled when a joinable thread exits (NULL if detached)
+	int joined; // Set once a thread has claimed the right to join this one
 
 	int wd; // Working directory of minithread
+
+	int state; // MINITHREAD_RUNNING, MINITHREAD_RUNNABLE, MINITHREAD_BLOCKED or MINITHREAD_DEAD
+	unsigned long long state_since; // When state was last changed [ns]
+	minithread_stats_t stats; // Counters; its id, name, run_level and state are filled in by minithread_stats
+	minithread_t all_prev; // Links all threads that have not been freed, for minithread_stats_dump
+	minithread_t all_next;
 };
 
+/* SCHEDULER VARIABLES */
+extern long boost_period;		// Every thread is moved back up to level 0 this often [ns]
+extern int wakeup_preemption;		// Preempt the running thread when a higher-level one is woken
+
 /* CLOCK VARIABLES */
 extern long clk_period;    		// Clock interrupt period
 extern long clk_count;			// Running count of clock interrupts
-extern queue_t alarm_queue;		// Queue containing alarms (soonest deadline at head of queue)
 //Collection of Local miniports
 //-use a queue? Put where?
 
@@ -58,6 +109,40 @@ extern cache_table_t cache;
 extern disk_t disk;
 
 
+/*
+ * Attributes of a new minithread. Initialize with minithread_attr_init, then
+ * override whichever fields are needed.
+ */
+typedef struct minithread_attr minithread_attr_t;
+struct minithread_attr {
+	int stack_size; // Bytes of stack; 0 for the default size
+	int level; // Starting level in the run queue, 0 (highest priority) to 3
+	int quanta; // Quanta per turn, at every level; 0 to use the default for the level
+	const char* name; // Name for debugging (copied), or NULL
+	int detached; // 1 to free the thread as soon as it exits, 0 to keep it until joined
+};
+
+/*
+ * minithread_attr_init(minithread_attr_t* attr)
+ *  Fill in attr with the attributes minithread_fork uses: default stack size,
+ *  level 0, the level's default quanta, no name, detached.
+ */
+extern void minithread_attr_init(minithread_attr_t* attr);
+
+/*
+ * minithread_t
+ * minithread_create_attr(proc_t proc, arg_t arg, minithread_attr_t* attr)
+ *  Like minithread_create, with the attributes in attr (NULL for the defaults).
+ */
+extern minithread_t minithread_create_attr(proc_t proc, arg_t arg, minithread_attr_t* attr);
+
+/*
+ * minithread_t
+ * minithread_fork_attr(proc_t proc, arg_t arg, minithread_attr_t* attr)
+ *  Like minithread_fork, with the attributes in attr (NULL for the defaults).
+ */
+extern minithread_t minithread_fork_attr(proc_t proc, arg_t arg, minithread_attr_t* attr);
+
 /*
  * minithread_t
  * minithread_fork(proc_t proc, arg_t arg)
@@ -78,6 +163,27 @@ extern minithread_t minithread_create(proc_t proc, arg_t arg);
 
 
 
+/*
+ * int minithread_join(minithread_t thread, int* exit_value)
+ *  Wait for the joinable thread to exit, then store the value its proc returned
+ *  in *exit_value (unless exit_value is NULL) and free the thread. Each joinable
+ *  thread must be joined exactly once; detached threads cannot be joined.
+ *  Returns 0 on success, -1 on error.
+ */
+extern int minithread_join(minithread_t thread, int* exit_value);
+
+/*
+ * minithread_stats(minithread_t thread, minithread_stats_t* stats)
+ *  Fill in stats with a snapshot of the thread's scheduling statistics.
+ */
+extern void minithread_stats(minithread_t thread, minithread_stats_t* stats);
+
+/*
+ * minithread_stats_dump()
+ *  Print the scheduling statistics of every thread to stdout, one line each.
+ */
+extern void minithread_stats_dump();
+
 /*
  * minithread_t minithread_self():
  *  Return identity (minithread_t) of caller thread.
@@ -91,6 +197,29 @@ extern minithread_t minithread_self();
  */
 extern int minithread_id();
 
+/*
+ * int minithread_running(minithread_t t)
+ *  Return 1 if t is running on some processor right now, or 0. Only a hint
+ *  (t may be switched out by the time the caller looks at the answer), but t
+ *  is never dereferenced, so it may be a thread that has since exited.
+ */
+extern int minithread_running(minithread_t t);
+
+/*
+ * int minithread_priority(minithread_t t)
+ *  Return the run_queue level t is scheduled at: its own level, or the level
+ *  lent to it by a thread waiting on a mutex it holds if that is higher.
+ */
+#define MINITHREAD_NO_BOOST 4
+extern int minithread_priority(minithread_t t);
+
+/*
+ * minithread_boost(minithread_t t, int level)
+ *  Set the level lent to t (MINITHREAD_NO_BOOST to lend none). If t is waiting
+ *  to run, it is moved to the level it is now scheduled at.
+ */
+extern void minithread_boost(minithread_t t, int level);
+
 /*
  * minithread_stop()
  *  Block the calling thread.
@@ -103,6 +232,14 @@ extern void minithread_stop();
  */
 extern void minithread_start(minithread_t t);
 
+/*
+ * minithread_resched()
+ *  If a thread at a higher level than the caller has been made runnable on this
+ *  processor since it last switched (and wakeup_preemption is set), hand it the
+ *  processor. Called after waking threads, once any locks are released.
+ */
+extern void minithread_resched();
+
 /*
  * minithread_yield()
  *  Forces the caller to relinquish the processor and be put to the end of
@@ -110,6 +247,14 @@ extern void minithread_start(minithread_t t);
  */
 extern void minithread_yield();
 
+/*
+ * minithread_yield_to(minithread_t t)
+ *  Like minithread_yield, but if t is ready to run the processor is handed
+ *  directly to t instead of to whichever thread the scheduler would pick.
+ *  Useful for producer/consumer pairs that hand work back and forth.
+ */
+extern void minithread_yield_to(minithread_t t);
+
 /*
  * minithread_system_initialize(proc_t mainproc, arg_t mainarg)
  *  Initialize the system to run the first minithread at
@@ -119,6 +264,38 @@ extern void minithread_yield();
  */
 extern void minithread_system_initialize(proc_t mainproc, arg_t mainarg);
 
+/*
+ * minithread_system_initialize_cpus(proc_t mainproc, arg_t mainarg, int num_cpus)
+ *  Like minithread_system_initialize, but runs minithreads on num_cpus virtual
+ *  processors, each a host thread with its own run queue, clock and idle thread.
+ *  Threads run on the processor that made them runnable; idle processors steal
+ *  ready threads from busy ones. num_cpus == 1 is minithread_system_initialize.
+ */
+#define MAX_CPUS 32
+extern void minithread_system_initialize_cpus(proc_t mainproc, arg_t mainarg, int num_cpus);
+
+
+/*
+ * minithread_idle()
+ *  Body of each processor's idle thread, run by the kernel TCB once the system
+ *  is initialized. Dispatches ready threads, stealing them from other processors
+ *  if necessary, and parks the host thread until the next interrupt when none
+ *  are runnable. Never returns.
+ */
+extern void minithread_idle();
+
+/*
+ * unsigned long long minithread_idle_time()
+ *      Return the total time, in nanoseconds, the idle threads have spent parked.
+ */
+extern unsigned long long minithread_idle_time();
+
+/*
+ * unsigned long long minithread_idle_wakeups()
+ *      Return the number of times the idle threads have been woken from a park.
+ */
+extern unsigned long long minithread_idle_wakeups();
+
 
 /*
  * minithread_sleep_with_timeout(int delay)
@@ -128,13 +305,17 @@ extern void minithread_sleep_with_timeout(int delay);
 
 
 /*
- * Selects next ready process.  Acts as the scheduler, but does not deallocate dead threads
+ * Selects next ready process and switches directly to it from self (or to the idle thread
+ * if nothing is ready). Acts as the scheduler, but does not deallocate dead threads.
+ * Returns 1 once self runs again, or 0 straight away if self was the only ready thread,
+ * in which case there was no switch. Call with interrupts disabled.
  */
-extern void minithread_next(minithread_t self);
+extern int minithread_next(minithread_t self);
 
 /*
 This function marks the calling thread as "dead" or done executing. However, its stack space cannot
-be freed by itself. The scheduler frees the function's stack space in .... (TBD)
+be freed by itself. A detached thread goes on the zombie queue right away, and a joinable one once it
+is joined; the scheduler frees a few zombies on each pass, returning their stacks to the stack cache.
 
 This function is better known as the "final_proc" called in minithread_initialize_stack.
 */
@@ -156,4 +337,16 @@ extern void remove_cache_entry(cache_elem_t entry);
 
 extern void disk_handler(disk_interrupt_arg_t* arg);
 
+/*
+ * minithread_future_t disk_read_block_async(disk_t* disk, int blocknum, char* buffer)
+ * minithread_future_t disk_write_block_async(disk_t* disk, int blocknum, char* buffer)
+ *  Like disk_read_block and disk_write_block, but return a future that disk_handler
+ *  completes with the disk_reply_t, or NULL if the request could not be sent. The
+ *  caller destroys the future once it is complete. Requests are told apart by their
+ *  arguments, so identical requests may not be pending at once.
+ */
+extern minithread_future_t disk_read_block_async(disk_t* disk, int blocknum, char* buffer);
+
+extern minithread_future_t disk_write_block_async(disk_t* disk, int blocknum, char* buffer);
+
 #endif /*__MINITHREAD_H__*/
\ No newline at end of file
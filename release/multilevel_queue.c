@@ -143,3 +143,305 @@ int multilevel_queue_length(multilevel_queue_t queue) {
 
 	return queue->length;
 }
+
+
+/*
+ * Run queue functions
+ */
+
+/*
+ * Initialize a run queue node owned by data. Must be called before the node is first enqueued.
+ */
+void run_queue_node_init(run_queue_node* node, void* data) {
+	node->data = data;
+	node->next = NULL;
+	node->prev = NULL;
+	node->level = -1;
+}
+
+/*
+ * Returns an empty run queue with number_of_levels levels. On error should return NULL.
+ *
+ * The schedule is built by smooth weighted round-robin: at each step every level gains its
+ * weight in credit, and the level with the most credit is served and pays back the total.
+ * This spreads each level's picks evenly across the cycle instead of serving them in bursts.
+ */
+run_queue_t run_queue_new(int number_of_levels, int* weights) {
+	run_queue_t rq;
+	int credit[RUN_QUEUE_MAX_LEVELS];
+	int i, j, best, total;
+
+	// Check for argument errors
+	if (number_of_levels <= 0 || number_of_levels > RUN_QUEUE_MAX_LEVELS) {
+		fprintf(stderr, "ERROR: run_queue_new() received invalid number of levels\n");
+		return NULL;
+	}
+	if (weights == NULL) {
+		fprintf(stderr, "ERROR: run_queue_new() received NULL argument weights\n");
+		return NULL;
+	}
+
+	total = 0;
+	for (i = 0; i < number_of_levels; i++) {
+		if (weights[i] <= 0) {
+			fprintf(stderr, "ERROR: run_queue_new() received non-positive weight for level %d\n", i);
+			return NULL;
+		}
+		total += weights[i];
+	}
+	if (total > RUN_QUEUE_MAX_SCHEDULE) {
+		fprintf(stderr, "ERROR: run_queue_new() received weights summing past RUN_QUEUE_MAX_SCHEDULE\n");
+		return NULL;
+	}
+
+	// Allocate space for new run queue
+	rq = (run_queue_t) malloc(sizeof(struct run_queue));
+	if (rq == NULL) { // malloc() failed
+		fprintf(stderr, "ERROR: run_queue_new() failed to malloc new run queue\n");
+		return NULL;
+	}
+
+	rq->num_levels = number_of_levels;
+	rq->length = 0;
+	rq->bitmap = 0;
+	rq->schedule_len = total;
+	rq->cursor = 0;
+
+	for (i = 0; i < number_of_levels; i++) {
+		rq->heads[i] = NULL;
+		rq->tails[i] = NULL;
+		credit[i] = 0;
+	}
+
+	// Lay out one full cycle of level picks
+	for (j = 0; j < total; j++) {
+		best = 0;
+		for (i = 0; i < number_of_levels; i++) {
+			credit[i] += weights[i];
+			if (credit[i] > credit[best]) {
+				best = i;
+			}
+		}
+		credit[best] -= total;
+		rq->schedule[j] = best;
+	}
+
+	return rq;
+}
+
+/*
+ * Appends node to the end of the specified level. Return 0 (success) or -1 (failure).
+ */
+int run_queue_enqueue(run_queue_t queue, int level, run_queue_node* node) {
+	// Check for argument errors
+	if (queue == NULL || node == NULL) {
+		fprintf(stderr, "ERROR: run_queue_enqueue() received NULL argument\n");
+		return -1;
+	}
+	if (level < 0 || level >= queue->num_levels) {
+		fprintf(stderr, "ERROR: run_queue_enqueue() received invalid queue level\n");
+		return -1;
+	}
+	if (node->level != -1) {
+		fprintf(stderr, "ERROR: run_queue_enqueue() received node that is already queued\n");
+		return -1;
+	}
+
+	node->next = NULL;
+	node->prev = queue->tails[level];
+	node->level = level;
+
+	if (queue->tails[level] == NULL) { // Level was empty
+		queue->heads[level] = node;
+		queue->bitmap |= (1u << level);
+	} else {
+		queue->tails[level]->next = node;
+	}
+	queue->tails[level] = node;
+
+	(queue->length)++;
+
+	return 0;
+}
+
+/*
+ * Unlink node from whichever level it is queued on. Return 0 (success) or -1 if not queued.
+ */
+int run_queue_remove(run_queue_t queue, run_queue_node* node) {
+	int level;
+
+	// Check for argument errors
+	if (queue == NULL || node == NULL) {
+		fprintf(stderr, "ERROR: run_queue_remove() received NULL argument\n");
+		return -1;
+	}
+
+	level = node->level;
+	if (level == -1) { // Not queued; nothing to remove
+		return -1;
+	}
+
+	// Update references of adjacent nodes (or level head/tail pointers)
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else
+		queue->heads[level] = node->next;
+
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	else
+		queue->tails[level] = node->prev;
+
+	if (queue->heads[level] == NULL) { // Level is now empty
+		queue->bitmap &= ~(1u << level);
+	}
+
+	node->next = NULL;
+	node->prev = NULL;
+	node->level = -1;
+
+	(queue->length)--;
+
+	return 0;
+}
+
+/*
+ * Dequeue the item at the head of the next level chosen by the weighted schedule.
+ * Return the level that the item was located on and that item if the run queue is nonempty,
+ * or -1 (failure) and NULL if queue is empty.
+ */
+int run_queue_dequeue(run_queue_t queue, void** item) {
+	run_queue_node* node;
+	unsigned int below;
+	int level;
+
+	// Check for argument errors
+	if (queue == NULL) {
+		fprintf(stderr, "ERROR: run_queue_dequeue() received NULL argument queue\n");
+		return -1;
+	}
+
+	if (queue->bitmap == 0) { // Run queue is empty
+		*item = NULL;
+		return -1;
+	}
+
+	level = queue->schedule[queue->cursor];
+	queue->cursor = (queue->cursor + 1) % queue->schedule_len;
+
+	// Serve the first non-empty level at or below the scheduled one, wrapping around to level 0
+	below = queue->bitmap >> level;
+	if (below != 0)
+		level += __builtin_ctz(below);
+	else
+		level = __builtin_ctz(queue->bitmap);
+
+	node = queue->heads[level];
+	run_queue_remove(queue, node);
+
+	*item = node->data;
+	return level;
+}
+
+/*
+ * Dequeue the item at the head of the highest non-empty level, if that level is above level.
+ * Return the level that the item was located on and that item, or -1 (failure) and NULL.
+ */
+int run_queue_dequeue_above(run_queue_t queue, int level, void** item) {
+	run_queue_node* node;
+	int top;
+
+	// Check for argument errors
+	if (queue == NULL) {
+		fprintf(stderr, "ERROR: run_queue_dequeue_above() received NULL argument queue\n");
+		return -1;
+	}
+
+	*item = NULL;
+	if (queue->bitmap == 0) { // Run queue is empty
+		return -1;
+	}
+
+	top = __builtin_ctz(queue->bitmap);
+	if (top >= level) {
+		return -1;
+	}
+
+	node = queue->heads[top];
+	run_queue_remove(queue, node);
+
+	*item = node->data;
+	return top;
+}
+
+/*
+ * Move every node to the end of the specified level. Return 0 (success) or -1 (failure).
+ */
+int run_queue_merge(run_queue_t queue, int level) {
+	run_queue_node* node;
+	int i;
+
+	// Check for argument errors
+	if (queue == NULL) {
+		fprintf(stderr, "ERROR: run_queue_merge() received NULL argument queue\n");
+		return -1;
+	}
+	if (level < 0 || level >= queue->num_levels) {
+		fprintf(stderr, "ERROR: run_queue_merge() received invalid queue level\n");
+		return -1;
+	}
+
+	for (i = 0; i < queue->num_levels; i++) {
+		if (i == level || queue->heads[i] == NULL) {
+			continue;
+		}
+
+		for (node = queue->heads[i]; node != NULL; node = node->next) {
+			node->level = level;
+		}
+
+		// Splice level i onto the end of level
+		if (queue->tails[level] == NULL) {
+			queue->heads[level] = queue->heads[i];
+		} else {
+			queue->tails[level]->next = queue->heads[i];
+			queue->heads[i]->prev = queue->tails[level];
+		}
+		queue->tails[level] = queue->tails[i];
+		queue->heads[i] = NULL;
+		queue->tails[i] = NULL;
+	}
+
+	if (queue->bitmap != 0) {
+		queue->bitmap = (1u << level);
+	}
+
+	return 0;
+}
+
+/*
+ * Free the run queue and return 0 (success) or -1 (failure). Queued nodes are not freed.
+ */
+int run_queue_free(run_queue_t queue) {
+	// Check for argument errors
+	if (queue == NULL) {
+		fprintf(stderr, "ERROR: run_queue_free() received NULL argument queue\n");
+		return -1;
+	}
+
+	free(queue);
+	return 0;
+}
+
+/*
+ * Return the total number of nodes in the run queue or -1 on error
+ */
+int run_queue_length(run_queue_t queue) {
+	// Check for argument errors
+	if (queue == NULL) {
+		fprintf(stderr, "ERROR: run_queue_length() received NULL argument queue\n");
+		return -1;
+	}
+
+	return queue->length;
+}
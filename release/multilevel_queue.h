@@ -48,4 +48,92 @@ extern int multilevel_queue_free(multilevel_queue_t queue);
  */
 extern int multilevel_queue_length(multilevel_queue_t queue);
 
+
+/*
+ * Run queue: a multilevel queue specialized for the scheduler.
+ *
+ * Nodes are embedded in the objects being queued (e.g. inside struct minithread),
+ * so enqueueing and dequeueing never allocate. A bitmap records which levels are
+ * non-empty, and the level to serve next is taken from a deterministic weighted
+ * schedule, so picking the next item costs the same regardless of queue length.
+ */
+#define RUN_QUEUE_MAX_LEVELS 32     // Levels are indexed by bits of an unsigned int
+#define RUN_QUEUE_MAX_SCHEDULE 64   // Upper bound on the sum of the level weights
+
+/*
+ * run_queue_node is embedded in every object that can be placed on a run queue.
+ * data points back to the enclosing object; level is -1 while the node is not queued.
+ */
+typedef struct run_queue_node run_queue_node;
+struct run_queue_node {
+	void* data;
+	run_queue_node* next;
+	run_queue_node* prev;
+	int level;
+};
+
+typedef struct run_queue* run_queue_t;
+struct run_queue {
+	int num_levels;
+	int length;
+	unsigned int bitmap;                            // Bit i is set iff level i is non-empty
+	run_queue_node* heads[RUN_QUEUE_MAX_LEVELS];
+	run_queue_node* tails[RUN_QUEUE_MAX_LEVELS];
+	int schedule[RUN_QUEUE_MAX_SCHEDULE];           // Sequence of levels to serve, interleaved by weight
+	int schedule_len;
+	int cursor;                                     // Next position in schedule
+};
+
+/*
+ * Initialize a run queue node owned by data. Must be called before the node is first enqueued.
+ */
+extern void run_queue_node_init(run_queue_node* node, void* data);
+
+/*
+ * Returns an empty run queue with number_of_levels levels. weights[i] is the relative number
+ * of picks that level i receives when every level is non-empty. On error should return NULL.
+ */
+extern run_queue_t run_queue_new(int number_of_levels, int* weights);
+
+/*
+ * Appends node to the end of the specified level. Return 0 (success) or -1 (failure).
+ */
+extern int run_queue_enqueue(run_queue_t queue, int level, run_queue_node* node);
+
+/*
+ * Dequeue the item at the head of the next level chosen by the weighted schedule. If that
+ * level is empty, the next non-empty level below it is used, wrapping around to level 0.
+ * Return the level that the item was located on and that item if the run queue is nonempty,
+ * or -1 (failure) and NULL if queue is empty.
+ */
+extern int run_queue_dequeue(run_queue_t queue, void** item);
+
+/*
+ * Dequeue the item at the head of the highest non-empty level, if that level is above (less
+ * than) level. Return the level that the item was located on and that item, or -1 (failure)
+ * and NULL if every level above level is empty.
+ */
+extern int run_queue_dequeue_above(run_queue_t queue, int level, void** item);
+
+/*
+ * Unlink node from whichever level it is queued on. Return 0 (success) or -1 if not queued.
+ */
+extern int run_queue_remove(run_queue_t queue, run_queue_node* node);
+
+/*
+ * Move every node to the end of the specified level, in order of the level it was on and then
+ * its place there. Return 0 (success) or -1 (failure).
+ */
+extern int run_queue_merge(run_queue_t queue, int level);
+
+/*
+ * Free the run queue and return 0 (success) or -1 (failure). Queued nodes are not freed.
+ */
+extern int run_queue_free(run_queue_t queue);
+
+/*
+ * Return the total number of nodes in the run queue or -1 on error
+ */
+extern int run_queue_length(run_queue_t queue);
+
 #endif /*__MULTILEVEL_QUEUE_H__*/
@@ -27,6 +27,47 @@ void enqueue_test(multilevel_queue_t queue, void** item) {
 }
 
 
+/* Levels are served in weighted order, and empty levels fall through to the next non-empty one. */
+int run_queue_test() {
+  int weights[4] = {10, 5, 3, 2};
+  int genies[4] = {0, 1, 2, 3};
+  int picks[4] = {0, 0, 0, 0};
+  run_queue_node nodes[4];
+  run_queue_t rq;
+  void* item;
+  int i, level;
+
+  rq = run_queue_new(4, weights);
+  for (i = 0; i < 4; i++) {
+    run_queue_node_init(&nodes[i], (void*) &genies[i]);
+  }
+
+  // Keep every level occupied for one full schedule cycle and count the picks per level
+  for (i = 0; i < 4; i++) {
+    run_queue_enqueue(rq, i, &nodes[i]);
+  }
+  for (i = 0; i < 20; i++) {
+    level = run_queue_dequeue(rq, &item);
+    if (*((int*) item) != level) return 0;
+    picks[level]++;
+    run_queue_enqueue(rq, level, &nodes[level]);
+  }
+  for (i = 0; i < 4; i++) {
+    if (picks[i] != weights[i]) return 0;
+  }
+
+  // Removing by handle empties level 0, so only level 3 can be served
+  run_queue_remove(rq, &nodes[0]);
+  run_queue_remove(rq, &nodes[1]);
+  run_queue_remove(rq, &nodes[2]);
+  if (run_queue_dequeue(rq, &item) != 3 || run_queue_length(rq) != 0) return 0;
+  if (run_queue_dequeue(rq, &item) != -1 || item != NULL) return 0;
+
+  run_queue_free(rq);
+  return 1;
+}
+
+
 int main(void) {
   void* item;
   multilevel_queue_t queue;
@@ -41,5 +82,11 @@ int main(void) {
     printf("Failure...\n");
   }
 
+  if (run_queue_test()) {
+    printf("Run queue success!!!\n");
+  } else {
+    printf("Run queue failure...\n");
+  }
+
   return 0;
 }
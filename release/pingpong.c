@@ -0,0 +1,64 @@
+/*
+ * Semaphore ping-pong benchmark.
+ *
+ * Two threads hand control back and forth through a pair of semaphores, so
+ * that every P blocks and every V wakes a waiter. Reports the average cost of
+ * one round trip (two contended P/V pairs and two context switches).
+ *
+ * Usage: pingpong [rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "minithread.h"
+#include "synch.h"
+
+#define DEFAULT_ROUNDS 1000000
+
+semaphore_t ping;
+semaphore_t pong;
+int rounds = DEFAULT_ROUNDS;
+
+int ponger(int* arg) {
+  int i;
+
+  for (i = 0; i < rounds; i++) {
+    semaphore_P(ping);
+    semaphore_V(pong);
+  }
+
+  return 0;
+}
+
+int pinger(int* arg) {
+  unsigned long long start, elapsed;
+  int i;
+
+  minithread_fork(ponger, NULL);
+  minithread_yield(); // Let ponger block on ping first
+
+  start = minithread_clock_now();
+  for (i = 0; i < rounds; i++) {
+    semaphore_V(ping);
+    semaphore_P(pong);
+  }
+  elapsed = minithread_clock_now() - start;
+
+  printf("%d rounds in %llu ms: %llu ns per round trip\n", rounds,
+         elapsed / MILLISECOND, elapsed / rounds);
+  exit(0);
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1)
+    rounds = atoi(argv[1]);
+
+  ping = semaphore_create();
+  semaphore_initialize(ping, 0);
+  pong = semaphore_create();
+  semaphore_initialize(pong, 0);
+
+  minithread_system_initialize(pinger, NULL);
+  return -1;
+}
@@ -16,6 +16,8 @@ queue_t queue_new() {
         return NULL;
     }
     
+    queue->head = NULL;
+    queue->tail = NULL;
     queue->len = 0;
     return queue;
 }
@@ -126,10 +128,10 @@ int queue_dequeue(queue_t queue, void** item) {
 	    queue->tail = NULL;
     } else {
 	    queue->head = queue->head->next;
-	    free(ptr);
 	    queue->tail->next = queue->head;
 	    queue->head->prev = queue->tail;
 	}
+    free(ptr);
 
     (queue->len)--;
 
@@ -182,15 +184,15 @@ int queue_free (queue_t queue) {
         return -1;
     }
 
-    // Free queue elements
-    while (queue->head != NULL){
+    // Free queue elements (the list is circular, so count them off rather than look for NULL)
+    while (queue->len > 0) {
         free(queue->head->data); // Free element data
 
         ptr = queue->head;
         queue->head = queue->head->next;
 
         free(ptr); // Free element
-        ptr = NULL; // Set ptr to NULL to avoid dangling pointer when iteration reaches queue->tail and attempts to access the freed head element
+        (queue->len)--;
     }
 
     free(queue);
@@ -262,4 +264,119 @@ int queue_delete(queue_t queue, void* item) {
     } else { // item not found
  		return -1;
 	}
-}
\ No newline at end of file
+}
+
+
+/*
+ * Initialize an empty list.
+ */
+void list_init(list_t* list) {
+    list->head = NULL;
+    list->tail = NULL;
+    list->len = 0;
+}
+
+
+/*
+ * Initialize a node owned by data.
+ */
+void list_node_init(list_node* node, void* data) {
+    node->data = data;
+    node->next = NULL;
+    node->prev = NULL;
+    node->list = NULL;
+}
+
+
+/*
+ * Link node at the end of list. Return 0 (success) or -1 (failure).
+ */
+int list_append(list_t* list, list_node* node) {
+    return list_insert_before(list, NULL, node);
+}
+
+
+/*
+ * Link node at the front of list. Return 0 (success) or -1 (failure).
+ */
+int list_prepend(list_t* list, list_node* node) {
+    return list_insert_before(list, list->head, node);
+}
+
+
+/*
+ * Link node into list just before pos, or at the end if pos is NULL.
+ * Return 0 (success) or -1 (failure).
+ */
+int list_insert_before(list_t* list, list_node* pos, list_node* node) {
+    // Check for argument errors
+    if (node->list != NULL) {
+        fprintf(stderr, "ERROR: list_insert_before() received a node that is already linked\n");
+        return -1;
+    }
+    if (pos != NULL && pos->list != list) {
+        fprintf(stderr, "ERROR: list_insert_before() received a position that is not on the list\n");
+        return -1;
+    }
+
+    node->next = pos;
+    node->prev = (pos == NULL) ? list->tail : pos->prev;
+    if (node->prev == NULL) {
+        list->head = node;
+    } else {
+        node->prev->next = node;
+    }
+    if (pos == NULL) {
+        list->tail = node;
+    } else {
+        pos->prev = node;
+    }
+
+    node->list = list;
+    (list->len)++;
+
+    return 0;
+}
+
+
+/*
+ * Unlink the first node of list and return its data, or NULL if list is empty.
+ */
+void* list_dequeue(list_t* list) {
+    list_node* node = list->head;
+
+    if (node == NULL) { // Empty list
+        return NULL;
+    }
+
+    list_remove(list, node);
+    return node->data;
+}
+
+
+/*
+ * Unlink node from list. Return 0 (success) or -1 if node is not on list.
+ */
+int list_remove(list_t* list, list_node* node) {
+    if (node->list != list) {
+        return -1;
+    }
+
+    if (node->prev == NULL) {
+        list->head = node->next;
+    } else {
+        node->prev->next = node->next;
+    }
+    if (node->next == NULL) {
+        list->tail = node->prev;
+    } else {
+        node->next->prev = node->prev;
+    }
+
+    node->next = NULL;
+    node->prev = NULL;
+    node->list = NULL;
+    (list->len)--;
+
+    return 0;
+}
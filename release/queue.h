@@ -80,4 +80,66 @@ extern int queue_length(queue_t queue);
  */
 extern int queue_delete(queue_t queue, void* item);
 
+
+
+/*
+ * Intrusive lists, for kernel objects that are queued often. A list_node is
+ * embedded in the object it links, so linking and unlinking never allocate,
+ * and an object is removed in O(1) given its node. data points back to the
+ * enclosing object; list is the list the node is on, or NULL. A node can be
+ * on one list at a time. None of these functions lock; callers do.
+ */
+typedef struct list_node list_node;
+typedef struct list list_t;
+struct list_node {
+    void* data;
+    list_node* next;
+    list_node* prev;
+    list_t* list;
+};
+
+struct list {
+    list_node* head;
+    list_node* tail;
+    int len;
+};
+
+/*
+ * Initialize an empty list.
+ */
+extern void list_init(list_t* list);
+
+/*
+ * Initialize a node owned by data. Must be called before the node is first linked.
+ */
+extern void list_node_init(list_node* node, void* data);
+
+/*
+ * Link node at the end or the front of list. Return 0 (success) or -1 if node is
+ * already on a list.
+ */
+extern int list_append(list_t* list, list_node* node);
+extern int list_prepend(list_t* list, list_node* node);
+
+/*
+ * Link node into list just before pos, which must be on list (or NULL, to append).
+ * Return 0 (success) or -1 (failure).
+ */
+extern int list_insert_before(list_t* list, list_node* pos, list_node* node);
+
+/*
+ * Unlink the first node of list and return its data, or NULL if list is empty.
+ */
+extern void* list_dequeue(list_t* list);
+
+/*
+ * Unlink node from list. Return 0 (success) or -1 if node is not on list.
+ */
+extern int list_remove(list_t* list, list_node* node);
+
+/*
+ * Return the number of nodes on list.
+ */
+#define list_length(list) ((list)->len)
+
 #endif /*__QUEUE_H__*/
\ No newline at end of file
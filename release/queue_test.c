@@ -39,12 +39,47 @@ void append_test(queue_t queue) {
 }
 
 
+void list_test() {
+  int genie[5] = {1, 2, 3, 4, 5};
+  list_node nodes[5];
+  list_t list;
+  void* item;
+  int i;
+
+  list_init(&list);
+  for (i = 0; i < 5; i++) {
+    list_node_init(&nodes[i], (void*) &genie[i]);
+  }
+
+  list_append(&list, &nodes[1]);
+  list_append(&list, &nodes[3]);
+  list_prepend(&list, &nodes[0]);
+  list_insert_before(&list, &nodes[3], &nodes[2]);
+  list_append(&list, &nodes[4]);
+
+  // [1,2,3,4,5]
+  list_remove(&list, &nodes[2]);
+  list_remove(&list, &nodes[4]);
+  if (list_remove(&list, &nodes[4]) == 0) { // Already removed
+    fprintf(stderr, "list_remove() removed a node twice\n");
+  }
+
+  // Print [1,2,4]
+  while ((item = list_dequeue(&list)) != NULL) {
+    fprintf(stderr, "%i\n", *((int*) item));
+  }
+  if (list_length(&list) != 0) {
+    fprintf(stderr, "list_dequeue() left a non-empty list\n");
+  }
+}
+
 int main(void) {
   //elem_q* ptr;
   queue_t queue = malloc(sizeof(struct queue));
 
   queue->len = 0;
   append_test(queue);
+  list_test();
 
   // if (queue->len == 5) {
   //   printf("Success!!!\n");
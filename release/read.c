@@ -67,7 +67,7 @@ int miniterm_initialize() {
 	kb_head = NULL;
 	kb_tail = NULL;
 
-	new_data = semaphore_create();
+	new_data = semaphore_create_named("read new_data");
 	semaphore_initialize(new_data, 0);
 
     AbortOnCondition(pthread_create(&read_thread, NULL, (void*)read_poll, NULL)!=0,
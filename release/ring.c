@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ring.h"
+#include "machineprimitives.h"
+
+/*
+ *      Bounded multi-producer, multi-consumer rings. Each slot carries a sequence
+ *      number that says whose turn it is: a producer may fill the slot at position
+ *      pos once seq == pos, and a consumer may empty it once seq == pos + 1. Producers
+ *      and consumers claim positions with a compare-and-swap on put_pos or get_pos,
+ *      which live on separate cache lines so that the two sides do not contend.
+ */
+
+
+/* Add n to *counter atomically. */
+static void ring_count(int* counter, int n) {
+	int old;
+
+	do {
+		old = *((volatile int*) counter);
+	} while (compare_and_swap(counter, old, old + n) != old);
+}
+
+/* Raise *counter to value atomically, unless it is already higher. */
+static void ring_raise(int* counter, int value) {
+	int old;
+
+	do {
+		old = *((volatile int*) counter);
+	} while (old < value && compare_and_swap(counter, old, value) != old);
+}
+
+
+/*
+ * ring_t ring_new(int capacity, ring_policy_t policy)
+ *      Allocate an empty ring.
+ */
+ring_t ring_new(int capacity, ring_policy_t policy) {
+	ring_t ring;
+	unsigned int size = 1, i;
+
+	if (capacity <= 0) {
+		fprintf(stderr, "ERROR: ring_new() received non-positive capacity\n");
+		return NULL;
+	}
+	while (size < (unsigned int) capacity) {
+		size <<= 1;
+	}
+
+	ring = (ring_t) malloc(sizeof(struct ring) + size * sizeof(ring_slot));
+	if (ring == NULL) { // malloc() failed
+		fprintf(stderr, "ERROR: ring_new() failed to malloc new ring_t\n");
+		return NULL;
+	}
+
+	ring->put_pos = 0;
+	ring->get_pos = 0;
+	ring->mask = size - 1;
+	ring->policy = policy;
+	ring->stats.puts = 0;
+	ring->stats.gets = 0;
+	ring->stats.rejected = 0;
+	ring->stats.evicted = 0;
+	ring->stats.high_water = 0;
+	for (i = 0; i < size; i++) {
+		ring->slots[i].seq = i;
+		ring->slots[i].item = NULL;
+	}
+
+	return ring;
+}
+
+/*
+ * ring_free(ring_t ring)
+ *      Deallocate a ring.
+ */
+void ring_free(ring_t ring) {
+	if (ring == NULL) {
+		fprintf(stderr, "ERROR: ring_free() received NULL argument ring\n");
+		return;
+	}
+
+	free(ring);
+}
+
+/*
+ * Claim the next free slot and fill it with item. Return 0, or -1 if the ring is full.
+ */
+static int ring_try_put(ring_t ring, void* item) {
+	ring_slot* slot;
+	unsigned int pos = ring->put_pos;
+	int diff;
+
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		diff = (int) (slot->seq - pos);
+		if (diff == 0) { // Slot free at pos; claim pos unless another producer got there first
+			if ((unsigned int) compare_and_swap((int*) &ring->put_pos, (int) pos, (int) (pos + 1)) == pos) {
+				break;
+			}
+			pos = ring->put_pos;
+		} else if (diff < 0) { // Slot still holds the item put a lap ago: full
+			return -1;
+		} else { // Another producer claimed pos; catch up
+			pos = ring->put_pos;
+		}
+	}
+
+	slot->item = item;
+	slot->seq = pos + 1; // Publish to consumers
+	ring_raise(&ring->stats.high_water, (int) (pos + 1 - ring->get_pos));
+
+	return 0;
+}
+
+/*
+ * int ring_put(ring_t ring, void* item, void** evicted)
+ *      Queue item, refusing it or evicting the oldest item if the ring is full.
+ */
+int ring_put(ring_t ring, void* item, void** evicted) {
+	if (evicted != NULL) {
+		*evicted = NULL;
+	}
+
+	if (ring_try_put(ring, item) == 0) {
+		ring_count(&ring->stats.puts, 1);
+		return 0;
+	}
+
+	if (ring->policy == RING_REJECT) {
+		ring_count(&ring->stats.rejected, 1);
+		return -1;
+	}
+
+	// Evict the oldest item to make room, and try again. A consumer may empty the ring meanwhile,
+	// in which case nothing is evicted; other producers may take the room first, in which case
+	// wait for more rather than evict a second item, which could not be handed back
+	do {
+		if (*evicted == NULL && (*evicted = ring_get(ring)) != NULL) {
+			ring_count(&ring->stats.gets, -1); // Not taken by a consumer
+			ring_count(&ring->stats.evicted, 1);
+		} else {
+			cpu_relax();
+		}
+	} while (ring_try_put(ring, item) != 0);
+	ring_count(&ring->stats.puts, 1);
+	return 0;
+}
+
+/*
+ * void* ring_get(ring_t ring)
+ *      Take the oldest item off the ring.
+ */
+void* ring_get(ring_t ring) {
+	ring_slot* slot;
+	unsigned int pos = ring->get_pos;
+	void* item;
+	int diff;
+
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		diff = (int) (slot->seq - (pos + 1));
+		if (diff == 0) { // Slot filled at pos; claim it unless another consumer got there first
+			if ((unsigned int) compare_and_swap((int*) &ring->get_pos, (int) pos, (int) (pos + 1)) == pos) {
+				break;
+			}
+			pos = ring->get_pos;
+		} else if (diff < 0) { // Slot not yet filled: empty
+			return NULL;
+		} else { // Another consumer claimed pos; catch up
+			pos = ring->get_pos;
+		}
+	}
+
+	item = slot->item;
+	slot->seq = pos + ring->mask + 1; // Free the slot for the producer one lap on
+	ring_count(&ring->stats.gets, 1);
+
+	return item;
+}
+
+/*
+ * int ring_length(ring_t ring)
+ *      Return the number of items on the ring.
+ */
+int ring_length(ring_t ring) {
+	return (int) (ring->put_pos - ring->get_pos);
+}
+
+/*
+ * ring_stats(ring_t ring, ring_stats_t* stats)
+ *      Copy the ring's counters.
+ */
+void ring_stats(ring_t ring, ring_stats_t* stats) {
+	*stats = ring->stats;
+}
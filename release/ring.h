@@ -0,0 +1,97 @@
+/*
+ * Definitions for bounded ring buffers.
+ *
+ *  A ring holds at most a fixed number of void* items in FIFO order. Putting
+ *  and getting never allocate, lock or block, so any number of producers and
+ *  consumers may use a ring at once, interrupt handlers included. What
+ *  happens when a producer finds the ring full is set per ring: the item is
+ *  refused, so that the producer can push back on its source (e.g. by not
+ *  acknowledging a packet), or the oldest item is evicted to make room.
+ */
+#ifndef __RING_H__
+#define __RING_H__
+
+#define RING_CACHE_LINE 64
+
+/* What ring_put does when the ring is full */
+typedef enum {
+	RING_REJECT,		// Refuse the new item; the caller keeps it
+	RING_DROP_OLDEST	// Evict the oldest item and hand it back to the caller
+} ring_policy_t;
+
+/*
+ * Counters kept by a ring. Updated atomically, so they are exact even with
+ * several producers or consumers.
+ */
+typedef struct ring_stats ring_stats_t;
+struct ring_stats {
+	int puts;			// Items queued
+	int gets;			// Items taken off
+	int rejected;		// Items refused because the ring was full
+	int evicted;		// Items evicted to make room for newer ones
+	int high_water;		// Most items ever queued at once
+};
+
+typedef struct ring_slot ring_slot;
+struct ring_slot {
+	volatile unsigned int seq;	// Position the slot is next ready to be put (== pos) or got (== pos + 1) at
+	void* volatile item;
+};
+
+typedef struct ring *ring_t;
+struct ring {
+	volatile unsigned int put_pos;	// Next position to put at
+	char put_pad[RING_CACHE_LINE - sizeof(unsigned int)];
+	volatile unsigned int get_pos;	// Next position to get from
+	char get_pad[RING_CACHE_LINE - sizeof(unsigned int)];
+	unsigned int mask;				// Capacity - 1; the capacity is a power of two
+	ring_policy_t policy;
+	ring_stats_t stats;
+	ring_slot slots[];
+};
+
+/*
+ * ring_t ring_new(int capacity, ring_policy_t policy)
+ *  Allocate an empty ring holding at least capacity items (rounded up to a
+ *  power of two). Returns NULL on error.
+ */
+extern ring_t ring_new(int capacity, ring_policy_t policy);
+
+/*
+ * ring_free(ring_t ring)
+ *  Deallocate a ring. Items still on it are not freed.
+ */
+extern void ring_free(ring_t ring);
+
+/*
+ * int ring_put(ring_t ring, void* item, void** evicted)
+ *  Queue item at the end of the ring. Returns 0 if it was queued, or -1 if
+ *  the ring was full and refused it, in which case the caller keeps item.
+ *  Under RING_DROP_OLDEST a full ring first evicts its oldest item into
+ *  *evicted (NULL if nothing was evicted) to make room; the caller owns the
+ *  evicted item, and evicted may only be NULL for RING_REJECT rings. A put
+ *  under RING_DROP_OLDEST always succeeds and evicts at most one item: if
+ *  other producers take the room it made, it waits for room.
+ */
+extern int ring_put(ring_t ring, void* item, void** evicted);
+
+/*
+ * void* ring_get(ring_t ring)
+ *  Take the oldest item off the ring, or return NULL if it is empty.
+ */
+extern void* ring_get(ring_t ring);
+
+/*
+ * int ring_length(ring_t ring)
+ *  Return the number of items on the ring. Only a snapshot if other threads
+ *  are using it.
+ */
+extern int ring_length(ring_t ring);
+
+/*
+ * ring_stats(ring_t ring, ring_stats_t* stats)
+ *  Copy the ring's counters into *stats.
+ */
+extern void ring_stats(ring_t ring, ring_stats_t* stats);
+
+#endif /*__RING_H__*/
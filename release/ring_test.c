@@ -0,0 +1,216 @@
+/* ring_test.c
+
+   Test the implementation of ring: items come out in order as positions wrap
+   around, a full ring refuses new items or evicts its oldest one depending
+   on its policy, and producers and consumers on separate host threads lose,
+   duplicate or reorder nothing.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "ring.h"
+
+
+#define CAPACITY 8
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define ITEMS 50000
+
+ring_t ring;
+volatile int stop = 0;
+long taken[CONSUMERS];
+long dropped = 0;
+int refusals = 0;
+int disorders = 0;
+
+
+/* Encode producer p's i-th item; never NULL, since i starts at 1. */
+void* item(long p, long i) {
+  return (void*) ((p << 24) | i);
+}
+
+void* producer(void* arg) {
+  long p = (long) arg;
+  void* evicted;
+  long i;
+
+  for (i = 1; i <= ITEMS; i++) {
+    if (ring->policy == RING_REJECT) {
+      while (ring_put(ring, item(p, i), NULL) != 0) {
+        sched_yield();
+      }
+    } else {
+      if (ring_put(ring, item(p, i), &evicted) != 0) {
+        __sync_fetch_and_add(&refusals, 1);
+      }
+      if (evicted != NULL) {
+        __sync_fetch_and_add(&dropped, 1);
+      }
+      if (i % 16 == 0) {
+        sched_yield(); // Let the consumers keep up with some of it
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Take items until the producers are done and the ring is empty, checking each producer's items come in order. */
+void* consumer(void* arg) {
+  long c = (long) arg;
+  long last[PRODUCERS] = { 0 };
+  long value;
+  void* got;
+
+  for (;;) {
+    got = ring_get(ring);
+    if (got == NULL) {
+      if (!stop) {
+        sched_yield();
+        continue;
+      }
+      if ((got = ring_get(ring)) == NULL) break;
+    }
+    value = (long) got;
+    if ((value & 0xffffff) <= last[value >> 24]) {
+      __sync_fetch_and_add(&disorders, 1);
+    }
+    last[value >> 24] = value & 0xffffff;
+    taken[c]++;
+  }
+  return NULL;
+}
+
+/* Items go in and come out in FIFO order for many times the capacity, at every fill level. */
+int wraparound_test() {
+  ring_stats_t stats;
+  long i, j, next_in = 1, next_out = 1;
+
+  ring = ring_new(6, RING_REJECT);
+  if (ring == NULL || ring_get(ring) != NULL || ring_length(ring) != 0) return 0;
+
+  for (i = 0; i < 100; i++) {
+    for (j = 0; j < 1 + i % CAPACITY; j++) {
+      if (ring_put(ring, item(0, next_in++), NULL) != 0) return 0;
+    }
+    if (ring_length(ring) != 1 + i % CAPACITY) return 0;
+    while (ring_get(ring) == item(0, next_out)) {
+      next_out++;
+    }
+    if (next_out != next_in || ring_length(ring) != 0) return 0;
+  }
+
+  ring_stats(ring, &stats);
+  ring_free(ring);
+  return stats.puts == next_in - 1 && stats.gets == next_out - 1 && stats.high_water == CAPACITY
+    && stats.rejected == 0 && stats.evicted == 0;
+}
+
+/* A full RING_REJECT ring refuses the newest item; a full RING_DROP_OLDEST ring hands back its oldest to take it. */
+int policy_test() {
+  ring_stats_t stats;
+  void* evicted;
+  long i;
+
+  // Rounded up to a power of two, a ring asked for 6 items holds 8 and refuses the 9th
+  ring = ring_new(6, RING_REJECT);
+  for (i = 1; i <= CAPACITY; i++) {
+    if (ring_put(ring, item(0, i), NULL) != 0) return 0;
+  }
+  if (ring_put(ring, item(0, i), NULL) != -1) return 0;
+  if (ring_put(ring, item(0, i), NULL) != -1) return 0;
+  if (ring_get(ring) != item(0, 1)) return 0;
+  if (ring_put(ring, item(0, i), NULL) != 0) return 0;
+  for (i = 2; i <= CAPACITY + 1; i++) {
+    if (ring_get(ring) != item(0, i)) return 0;
+  }
+  ring_stats(ring, &stats);
+  ring_free(ring);
+  if (stats.puts != CAPACITY + 1 || stats.gets != CAPACITY + 1 || stats.rejected != 2 || stats.evicted != 0) return 0;
+
+  // Under RING_DROP_OLDEST the ring keeps the newest 8
+  ring = ring_new(6, RING_DROP_OLDEST);
+  for (i = 1; i <= CAPACITY; i++) {
+    if (ring_put(ring, item(0, i), &evicted) != 0 || evicted != NULL) return 0;
+  }
+  for (i = CAPACITY + 1; i <= CAPACITY + 3; i++) {
+    if (ring_put(ring, item(0, i), &evicted) != 0 || evicted != item(0, i - CAPACITY)) return 0;
+  }
+  if (ring_length(ring) != CAPACITY) return 0;
+  for (i = 4; i <= CAPACITY + 3; i++) {
+    if (ring_get(ring) != item(0, i)) return 0;
+  }
+  if (ring_get(ring) != NULL) return 0;
+  ring_stats(ring, &stats);
+  ring_free(ring);
+  return stats.puts == CAPACITY + 3 && stats.gets == CAPACITY && stats.evicted == 3 && stats.rejected == 0
+    && stats.high_water == CAPACITY;
+}
+
+/* Several producers and consumers share a small ring: every item is taken once or handed back evicted, in order per producer. */
+int concurrent_test(ring_policy_t policy) {
+  pthread_t threads[PRODUCERS + CONSUMERS];
+  ring_stats_t stats;
+  long i, total = 0;
+
+  ring = ring_new(6, policy);
+  stop = 0;
+  dropped = 0;
+  refusals = 0;
+  disorders = 0;
+  for (i = 0; i < CONSUMERS; i++) {
+    taken[i] = 0;
+    pthread_create(&threads[PRODUCERS + i], NULL, consumer, (void*) i);
+  }
+  for (i = 0; i < PRODUCERS; i++) {
+    pthread_create(&threads[i], NULL, producer, (void*) i);
+  }
+  for (i = 0; i < PRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  stop = 1;
+  for (i = 0; i < CONSUMERS; i++) {
+    pthread_join(threads[PRODUCERS + i], NULL);
+    total += taken[i];
+  }
+
+  ring_stats(ring, &stats);
+  printf("%s: taken %ld, dropped %ld, rejected %d, evicted %d\n", policy == RING_REJECT ? "reject" : "drop oldest",
+    total, dropped, stats.rejected, stats.evicted);
+  ring_free(ring);
+  if (policy == RING_REJECT && dropped != 0) return 0;
+  if (policy == RING_DROP_OLDEST && (refusals != 0 || stats.rejected != 0)) return 0;  // Evicting always makes room
+  return total + dropped == (long) PRODUCERS * ITEMS && stats.gets == total && stats.puts == stats.gets + stats.evicted
+    && stats.evicted == dropped && stats.high_water <= CAPACITY && disorders == 0;
+}
+
+
+int main(void) {
+  if (wraparound_test()) {
+    printf("Wraparound success!!!\n");
+  } else {
+    printf("Wraparound failure...\n");
+  }
+
+  if (policy_test()) {
+    printf("Policy success!!!\n");
+  } else {
+    printf("Policy failure...\n");
+  }
+
+  if (concurrent_test(RING_REJECT)) {
+    printf("Concurrent reject success!!!\n");
+  } else {
+    printf("Concurrent reject failure...\n");
+  }
+
+  if (concurrent_test(RING_DROP_OLDEST)) {
+    printf("Concurrent drop oldest success!!!\n");
+  } else {
+    printf("Concurrent drop oldest failure...\n");
+  }
+
+  return 0;
+}
@@ -50,6 +50,11 @@ void take_phone(){
     //Customer prints
     printf("My Phone's ID: %i\n", phoneID++);
     unpacked_phones--;
+
+    //Last phone sold; show which semaphores the shop waited on
+    if (phoneID > NUMPHONES) {
+      synch_profile_dump();
+    }
   }
   else {
     // Dang, I didn't get a phone...
@@ -99,13 +104,13 @@ int init_sale(int* arg) {
 
 
 int main(int argc, char *argv[]) {
-  line = semaphore_create();
+  line = semaphore_create_named("line");
   semaphore_initialize(line, 1);
   
-  phone = semaphore_create();
+  phone = semaphore_create_named("phone");
   semaphore_initialize(phone, 1);
   
-  record_keeping = semaphore_create();
+  record_keeping = semaphore_create_named("record_keeping");
   semaphore_initialize(record_keeping, 1);
 
   //start
@@ -0,0 +1,145 @@
+/* smp_test.c
+
+   Test minithreads running on several virtual processors: a shared counter
+   stays consistent under a semaphore while threads yield, sleep and are
+   stolen between processors, joined threads hand back their results, and
+   the work really is spread over more than one processor.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "minithread.h"
+#include "synch.h"
+
+
+#define CPUS 4
+#define WORKERS 8
+#define ITERS 20000
+#define ROUNDS 3
+#define JOINED 64
+
+semaphore_t mutex;
+semaphore_t done;
+long counter = 0;
+
+pthread_t hosts[MAX_CPUS];  // Host threads that have run a worker
+int host_count = 0;
+
+
+/* Note the processor (host thread) running the caller. Call with mutex held. */
+void note_host() {
+  pthread_t self = pthread_self();
+  int i;
+
+  for (i = 0; i < host_count; i++) {
+    if (pthread_equal(hosts[i], self)) return;
+  }
+  if (host_count < MAX_CPUS) {
+    hosts[host_count++] = self;
+  }
+}
+
+int worker(int* arg) {
+  volatile int spin;
+  int i;
+
+  for (i = 0; i < ITERS; i++) {
+    semaphore_P(mutex);
+    counter++;
+    note_host();
+    semaphore_V(mutex);
+
+    if (i % 1000 == 0) minithread_yield();
+    if (i % 5000 == 0) minithread_sleep_with_timeout(20);
+    for (spin = 0; spin < 200; spin++);
+  }
+
+  semaphore_V(done);
+  return 0;
+}
+
+int nothing(int* arg) {
+  return 0;
+}
+
+int square(int* arg) {
+  long n = (long) arg;
+
+  if (n % 3 == 0) minithread_yield();
+  return (int) (n * n);
+}
+
+/* Every increment is counted, round after round, with short-lived threads coming and going alongside. */
+int counter_test() {
+  int i, round;
+
+  for (round = 0; round < ROUNDS; round++) {
+    counter = 0;
+    for (i = 0; i < WORKERS; i++) {
+      minithread_fork(worker, NULL);
+    }
+    for (i = 0; i < 200; i++) {
+      minithread_fork(nothing, NULL);
+    }
+    for (i = 0; i < WORKERS; i++) {
+      semaphore_P(done);
+    }
+    if (counter != WORKERS * ITERS) return 0;
+  }
+  return 1;
+}
+
+/* Threads joined from another processor return their own results. */
+int join_test() {
+  minithread_attr_t attr;
+  minithread_t threads[JOINED];
+  int i, value;
+  long sum = 0, expected = 0;
+
+  minithread_attr_init(&attr);
+  attr.detached = 0;
+  for (i = 0; i < JOINED; i++) {
+    threads[i] = minithread_fork_attr(square, (int*) (long) i, &attr);
+    expected += i * i;
+  }
+  for (i = 0; i < JOINED; i++) {
+    if (minithread_join(threads[i], &value) != 0) return 0;
+    sum += value;
+  }
+  return sum == expected;
+}
+
+
+int run_tests(int* arg) {
+  if (counter_test()) {
+    printf("Counter success!!!\n");
+  } else {
+    printf("Counter failure...\n");
+  }
+
+  if (join_test()) {
+    printf("Join success!!!\n");
+  } else {
+    printf("Join failure...\n");
+  }
+
+  if (host_count > 1) {
+    printf("Processors success!!! (workers ran on %d of %d)\n", host_count, CPUS);
+  } else {
+    printf("Processors failure... (workers ran on %d of %d)\n", host_count, CPUS);
+  }
+
+  exit(0);
+  return 0;
+}
+
+int main(void) {
+  mutex = semaphore_create();
+  semaphore_initialize(mutex, 1);
+  done = semaphore_create();
+  semaphore_initialize(done, 0);
+  minithread_system_initialize_cpus(run_tests, NULL, CPUS);
+  return 0;
+}
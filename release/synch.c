@@ -1,10 +1,12 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "synch.h"
 #include "interrupts.h"
 #include "minithread.h"
+#include "alarm.h"
 
 /*
  *      You must implement the procedures and types defined in this interface.
@@ -13,18 +15,75 @@
 
 /* NOTE: struct semaphore defined in synch.h */
 
+#define MUTEX_MAX_CHAIN 8 // Most holders a waiter lends its priority through
+#define MUTEX_SPIN_LIMIT 1000 // Most times mutex_lock checks on a running holder before blocking
+#define SYNCH_PROFILE_TOP 16 // Most semaphores listed by synch_profile_dump
+
+static semaphore_t profiled_semaphores = NULL; // All semaphores not yet destroyed, when profiling
+static tas_lock_t profiled_semaphores_lock = 0;  // Guards profiled_semaphores across processors
+
+
+/* Append thread to the end of queue. Call with the lock of the primitive owning queue held. */
+static void wait_queue_append(wait_queue_t* queue, minithread_t thread) {
+	list_append(queue, &thread->wait_node);
+}
+
+/* Remove and return the thread at the head of queue, or NULL if it is empty. */
+static minithread_t wait_queue_dequeue(wait_queue_t* queue) {
+	return (minithread_t) list_dequeue(queue);
+}
+
+/* Remove thread from queue. Return 0, or -1 if it is not on queue. */
+static int wait_queue_remove(wait_queue_t* queue, minithread_t thread) {
+	return list_remove(queue, &thread->wait_node);
+}
+
 
 /*
  * semaphore_t semaphore_create()
  *      Allocate a new semaphore.
  */
 semaphore_t semaphore_create() {
+	return semaphore_create_named(NULL);
+}
+
+
+/*
+ * semaphore_t semaphore_create_named(const char* name)
+ *      Allocate a new semaphore, named for synch_profile_dump.
+ */
+semaphore_t semaphore_create_named(const char* name) {
+	interrupt_level_t old_ilevel;
 	semaphore_t sem = (semaphore_t) malloc(sizeof(struct semaphore));    //Is the following a cast: return (semaphore_t)0;
 	if (sem == NULL) { // malloc() failed
         fprintf(stderr, "ERROR: semaphore_create() failed to malloc new semaphore_t\n");
         return NULL;
     }
 
+	sem->name = name;
+	sem->profile = NULL;
+
+	if (SYNCH_PROFILE) {
+		sem->profile = (semaphore_profile_t*) malloc(sizeof(semaphore_profile_t));
+		if (sem->profile == NULL) { // malloc() failed
+			fprintf(stderr, "ERROR: semaphore_create() failed to malloc new semaphore_profile_t\n");
+			free(sem);
+			return NULL;
+		}
+		memset(sem->profile, 0, sizeof(semaphore_profile_t));
+		sem->profile->max_waiter = -1;
+
+		old_ilevel = set_interrupt_level(DISABLED);
+		atomic_spin_lock(&profiled_semaphores_lock);
+		sem->profile->next = profiled_semaphores;
+		if (profiled_semaphores != NULL) {
+			profiled_semaphores->profile->prev = sem;
+		}
+		profiled_semaphores = sem;
+		atomic_clear(&profiled_semaphores_lock);
+		set_interrupt_level(old_ilevel);
+	}
+
     return sem;
 }
 
@@ -34,12 +93,29 @@ semaphore_t semaphore_create() {
  *      Deallocate a semaphore.
  */
 void semaphore_destroy(semaphore_t sem) {
+	interrupt_level_t old_ilevel;
+
 	if (sem == NULL) {
         fprintf(stderr, "ERROR: semaphore_destroy() received NULL argument semaphore\n");
         return;
     }
 
-	queue_free(sem->wait_queue);
+	if (SYNCH_PROFILE) {
+		old_ilevel = set_interrupt_level(DISABLED);
+		atomic_spin_lock(&profiled_semaphores_lock);
+		if (sem->profile->prev != NULL) {
+			sem->profile->prev->profile->next = sem->profile->next;
+		} else {
+			profiled_semaphores = sem->profile->next;
+		}
+		if (sem->profile->next != NULL) {
+			sem->profile->next->profile->prev = sem->profile->prev;
+		}
+		atomic_clear(&profiled_semaphores_lock);
+		set_interrupt_level(old_ilevel);
+		free(sem->profile);
+	}
+
 	free(sem);
 }
 
@@ -57,7 +133,30 @@ void semaphore_initialize(semaphore_t sem, int cnt) {
 
 	sem->count = cnt;
 	sem->lock = 0;
-	sem->wait_queue = queue_new();
+	list_init(&sem->wait_queue);
+}
+
+
+/*
+ * Charge a wait that began at start to sem's profile, as a completed P or, if timed_out,
+ * a timeout. Call with interrupts disabled and sem->lock not held.
+ */
+static void semaphore_profile_wait(semaphore_t sem, unsigned long long start, int timed_out) {
+	unsigned long long waited = minithread_clock_now() - start;
+
+	atomic_spin_lock(&sem->lock);
+	sem->profile->contended++;
+	if (timed_out) {
+		sem->profile->timeouts++;
+	} else {
+		sem->profile->acquisitions++;
+	}
+	sem->profile->total_wait += waited;
+	if (waited > sem->profile->max_wait) {
+		sem->profile->max_wait = waited;
+		sem->profile->max_waiter = minithread_id();
+	}
+	atomic_clear(&sem->lock);
 }
 
 
@@ -67,20 +166,129 @@ void semaphore_initialize(semaphore_t sem, int cnt) {
  */
 void semaphore_P(semaphore_t sem) {
 	minithread_t tcb;
+	unsigned long long start = 0;
 
 	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
 
-	while (atomic_test_and_set(&sem->lock) == 1); // Atomically check lock status and exit loop with lock locked
+	atomic_spin_lock(&sem->lock); // Acquire lock; other processors may be using sem
 	if (--(sem->count) < 0) { // Resource unavailable
 		tcb = minithread_self();
-		queue_append(sem->wait_queue, (void*) tcb); // Move calling process from run_queue to semaphore wait_queue
-		sem->lock = 0; // Release lock
+		wait_queue_append(&sem->wait_queue, tcb); // Move calling process from run_queue to semaphore wait_queue
+		if (SYNCH_PROFILE) {
+			start = minithread_clock_now();
+		}
+		atomic_clear(&sem->lock); // Release lock
+		// A V on another processor may requeue tcb before it has switched out; the scheduler
+		// does not resume it elsewhere until its context is saved
 		minithread_stop(); // Context switch to next thread on run_queue
+		if (SYNCH_PROFILE) {
+			set_interrupt_level(DISABLED);
+			semaphore_profile_wait(sem, start, 0);
+		}
 	} else { // Resource obtained; continue
-		sem->lock = 0; // Release lock
+		if (SYNCH_PROFILE) {
+			sem->profile->acquisitions++;
+		}
+		atomic_clear(&sem->lock); // Release lock
+	}
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+}
+
+
+/*
+ * A thread waiting in semaphore_P_timeout, shared with the alarm that gives up its wait.
+ * Lives on the waiting thread's stack.
+ */
+typedef struct semaphore_timeout semaphore_timeout;
+struct semaphore_timeout {
+	semaphore_t sem;
+	minithread_t thread;
+	int timed_out; // Set if the alarm took thread off sem's wait queue
+	volatile int done; // Set once the alarm is finished with this record
+};
+
+/*
+ * Alarm handler for semaphore_P_timeout: take the thread off the wait queue and undo its P,
+ * unless a V has already woken it.
+ */
+static void semaphore_expire(void* arg) {
+	semaphore_timeout* wait = (semaphore_timeout*) arg;
+	semaphore_t sem = wait->sem;
+	minithread_t tcb = wait->thread;
+
+	atomic_spin_lock(&sem->lock);
+	if (wait_queue_remove(&sem->wait_queue, tcb) == 0) {
+		sem->count++;
+		wait->timed_out = 1;
+	}
+	atomic_clear(&sem->lock);
+
+	if (wait->timed_out) {
+		minithread_start(tcb);
+	}
+	wait->done = 1;
+}
+
+/*
+ * int semaphore_P_timeout(semaphore_t sem, int delay)
+ *      P on the semaphore, giving up after delay milliseconds.
+ */
+int semaphore_P_timeout(semaphore_t sem, int delay) {
+	semaphore_timeout wait;
+	alarm_id alarm;
+	unsigned long long start = 0;
+
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	atomic_spin_lock(&sem->lock); // Acquire lock; other processors may be using sem
+	if (--(sem->count) >= 0) { // Resource obtained; continue
+		if (SYNCH_PROFILE) {
+			sem->profile->acquisitions++;
+		}
+		atomic_clear(&sem->lock);
+		set_interrupt_level(old_ilevel);
+		return 0;
+	}
+	if (delay <= 0) { // Resource unavailable and no time to wait for it
+		sem->count++;
+		if (SYNCH_PROFILE) {
+			sem->profile->timeouts++;
+		}
+		atomic_clear(&sem->lock);
+		set_interrupt_level(old_ilevel);
+		return 1;
+	}
+
+	wait.sem = sem;
+	wait.thread = minithread_self();
+	wait.timed_out = 0;
+	wait.done = 0;
+	wait_queue_append(&sem->wait_queue, wait.thread);
+	if (SYNCH_PROFILE) {
+		start = minithread_clock_now();
+	}
+	atomic_clear(&sem->lock); // Release lock
+
+	// If the alarm goes off on another processor before we switch out, the scheduler does not
+	// resume us there until our context is saved
+	alarm = register_alarm(delay, semaphore_expire, &wait);
+	minithread_stop(); // Context switch to next thread on run_queue
+	set_interrupt_level(DISABLED);
+
+	// An alarm that already went off may still be using wait on another processor
+	if (alarm != NULL && deregister_alarm(alarm) == 1) {
+		while (!wait.done) {
+			cpu_relax();
+		}
+	}
+
+	if (SYNCH_PROFILE) {
+		semaphore_profile_wait(sem, start, wait.timed_out);
 	}
 
 	set_interrupt_level(old_ilevel); // Enable interrupts
+	return wait.timed_out;
 }
 
 
@@ -93,12 +301,539 @@ void semaphore_V(semaphore_t sem) {
 
 	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
 
-	while (atomic_test_and_set(&sem->lock) == 1); // Atomically check lock status and exit loop with lock locked
+	atomic_spin_lock(&sem->lock); // Acquire lock; other processors may be using sem
 	if (++(sem->count) <= 0) { // Other thread(s) still waiting for resource
-		queue_dequeue(sem->wait_queue, (void**) &tcb); // Remove current thread from semaphore wait_queue
+		tcb = wait_queue_dequeue(&sem->wait_queue); // Remove first waiting thread from semaphore wait_queue
 		minithread_start(tcb); // Add current thread to run_queue
 	}
-	sem->lock = 0; // Release lock
+	atomic_clear(&sem->lock); // Release lock
 
 	set_interrupt_level(old_ilevel); // Enable interrupts
+	if (old_ilevel == ENABLED) {
+		minithread_resched(); // The woken thread may outrank the caller
+	}
+}
+
+
+/* A semaphore's name and statistics, copied out for synch_profile_dump. */
+typedef struct semaphore_snapshot semaphore_snapshot;
+struct semaphore_snapshot {
+	const char* name;
+	semaphore_profile_t profile;
+};
+
+/* Order snapshots by total wait, longest first. */
+static int semaphore_snapshot_compare(const void* a, const void* b) {
+	const semaphore_snapshot* x = (const semaphore_snapshot*) a;
+	const semaphore_snapshot* y = (const semaphore_snapshot*) b;
+
+	if (x->profile.total_wait != y->profile.total_wait) {
+		return (x->profile.total_wait > y->profile.total_wait) ? -1 : 1;
+	}
+	return (x->profile.contended > y->profile.contended) ? -1 : (x->profile.contended < y->profile.contended);
+}
+
+
+/*
+ * synch_profile_dump()
+ *      Print the profiles of the semaphores that were waited for longest.
+ */
+void synch_profile_dump() {
+	semaphore_snapshot* snapshot;
+	semaphore_profile_t* profile;
+	semaphore_t sem;
+	int i, n = 0;
+	interrupt_level_t old_ilevel;
+
+	if (!SYNCH_PROFILE) {
+		printf("synch_profile_dump(): semaphore profiling is off (set SYNCH_PROFILE in defs.h)\n");
+		return;
+	}
+
+	old_ilevel = set_interrupt_level(DISABLED);
+	atomic_spin_lock(&profiled_semaphores_lock);
+	for (sem = profiled_semaphores; sem != NULL; sem = sem->profile->next) {
+		n++;
+	}
+	snapshot = (semaphore_snapshot*) malloc((n > 0 ? n : 1) * sizeof(semaphore_snapshot));
+	if (snapshot == NULL) { // malloc() failed
+		atomic_clear(&profiled_semaphores_lock);
+		set_interrupt_level(old_ilevel);
+		fprintf(stderr, "ERROR: synch_profile_dump() failed to malloc snapshot\n");
+		return;
+	}
+	// Copy each profile under its semaphore's lock, so that printing holds up no one
+	for (sem = profiled_semaphores, i = 0; sem != NULL; sem = sem->profile->next, i++) {
+		atomic_spin_lock(&sem->lock);
+		snapshot[i].name = sem->name;
+		snapshot[i].profile = *(sem->profile);
+		atomic_clear(&sem->lock);
+	}
+	atomic_clear(&profiled_semaphores_lock);
+	set_interrupt_level(old_ilevel);
+
+	qsort(snapshot, n, sizeof(semaphore_snapshot), semaphore_snapshot_compare);
+
+	printf("%-24s %10s %10s %6s %8s %12s %12s %6s\n", "semaphore", "acquired", "contended", "%", "timeouts",
+		"wait ms", "max wait us", "waiter");
+	for (i = 0; i < n && i < SYNCH_PROFILE_TOP && snapshot[i].profile.contended > 0; i++) {
+		profile = &snapshot[i].profile;
+		printf("%-24.24s %10lu %10lu %6.1f %8lu %12llu %12llu %6i\n",
+			(snapshot[i].name != NULL) ? snapshot[i].name : "(unnamed)", profile->acquisitions, profile->contended,
+			100.0 * profile->contended / (profile->acquisitions + profile->timeouts), profile->timeouts,
+			profile->total_wait / MILLISECOND, profile->max_wait / MICROSECOND, profile->max_waiter);
+	}
+
+	free(snapshot);
+}
+
+
+/*
+ * Highest priority (lowest) level among the threads waiting for mutex, or
+ * MINITHREAD_NO_BOOST if there are none. Call with mutex->lock held.
+ */
+static int mutex_waiter_level(mutex_t mutex) {
+	list_node* iter;
+	int level, top = MINITHREAD_NO_BOOST;
+
+	for (iter = mutex->wait_queue.head; iter != NULL; iter = iter->next) {
+		level = minithread_priority((minithread_t) iter->data);
+		if (level < top) {
+			top = level;
+		}
+	}
+
+	return top;
+}
+
+/*
+ * Set the boost of thread to the highest level waiting on any mutex it holds. Only
+ * thread itself changes what it holds, except that mutex_unlock hands a mutex to a
+ * thread waiting in mutex_lock. Call with interrupts disabled and no mutex lock held.
+ */
+static void mutex_reboost(minithread_t thread) {
+	mutex_t held;
+	int level, top = MINITHREAD_NO_BOOST;
+
+	for (held = thread->held_mutexes; held != NULL; held = held->next_held) {
+		atomic_spin_lock(&held->lock);
+		level = mutex_waiter_level(held);
+		atomic_clear(&held->lock);
+		if (level < top) {
+			top = level;
+		}
+	}
+
+	minithread_boost(thread, top);
+}
+
+/*
+ * mutex_t mutex_create()
+ *      Allocate a new, unlocked mutex.
+ */
+mutex_t mutex_create() {
+	mutex_t mutex = (mutex_t) malloc(sizeof(struct mutex));
+	if (mutex == NULL) { // malloc() failed
+		fprintf(stderr, "ERROR: mutex_create() failed to malloc new mutex_t\n");
+		return NULL;
+	}
+
+	mutex->lock = 0;
+	mutex->owner = NULL;
+	mutex->next_held = NULL;
+	list_init(&mutex->wait_queue);
+
+	return mutex;
+}
+
+
+/*
+ * mutex_destroy(mutex_t mutex)
+ *      Deallocate an unlocked mutex.
+ */
+void mutex_destroy(mutex_t mutex) {
+	if (mutex == NULL) {
+		fprintf(stderr, "ERROR: mutex_destroy() received NULL argument mutex\n");
+		return;
+	}
+	if (mutex->owner != NULL) {
+		fprintf(stderr, "ERROR: mutex_destroy() received a locked mutex\n");
+		return;
+	}
+
+	free(mutex);
+}
+
+
+/*
+ * mutex_lock(mutex_t mutex)
+ *      Acquire the mutex, lending the caller's priority to the holder while waiting.
+ */
+void mutex_lock(mutex_t mutex) {
+	minithread_t self, owner;
+	mutex_t next;
+	int level, hops, spins;
+	interrupt_level_t old_ilevel;
+
+	self = minithread_self();
+
+	// A holder running on another processor will probably release the mutex before we could
+	// switch out and back in, so wait for it here, preemptibly. With a single processor it cannot
+	// be running, and a caller that holds the mutex itself would wait for nothing.
+	for (spins = 0; spins < MUTEX_SPIN_LIMIT; spins++) {
+		owner = ((volatile struct mutex*) mutex)->owner;
+		if (owner == NULL || owner == self || !minithread_running(owner)) {
+			break;
+		}
+		cpu_relax();
+	}
+
+	old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	atomic_spin_lock(&mutex->lock); // Acquire lock; other processors may be using mutex
+	if (mutex->owner == NULL) { // Free; take it
+		mutex->owner = self;
+		mutex->next_held = self->held_mutexes;
+		self->held_mutexes = mutex;
+		atomic_clear(&mutex->lock);
+		set_interrupt_level(old_ilevel);
+		return;
+	}
+
+	wait_queue_append(&mutex->wait_queue, self);
+	self->blocked_on = mutex;
+
+	// Lend our level to the holder and on down the chain of holders it is itself waiting for.
+	// Links past the first are read without their locks; a stale hop only costs a boost
+	// that the next lock or unlock along the chain corrects.
+	level = minithread_priority(self);
+	owner = mutex->owner;
+	for (hops = 0; owner != NULL && hops < MUTEX_MAX_CHAIN && level < minithread_priority(owner); hops++) {
+		minithread_boost(owner, level);
+		next = owner->blocked_on;
+		owner = (next != NULL) ? next->owner : NULL;
+	}
+	atomic_clear(&mutex->lock); // Release lock
+
+	// mutex_unlock hands the mutex over before waking us
+	minithread_stop();
+	self->blocked_on = NULL;
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+}
+
+
+/*
+ * mutex_unlock(mutex_t mutex)
+ *      Release the mutex, handing it to the first waiter, and give up any priority lent for it.
+ */
+void mutex_unlock(mutex_t mutex) {
+	minithread_t self, next = NULL;
+	mutex_t* link;
+
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	self = minithread_self();
+	atomic_spin_lock(&mutex->lock); // Acquire lock; other processors may be using mutex
+	if (mutex->owner != self) {
+		atomic_clear(&mutex->lock);
+		set_interrupt_level(old_ilevel);
+		fprintf(stderr, "ERROR: mutex_unlock() called by a thread not holding the mutex\n");
+		return;
+	}
+
+	// Remove mutex from the caller's held list
+	for (link = &(self->held_mutexes); *link != mutex; link = &((*link)->next_held));
+	*link = mutex->next_held;
+
+	if ((next = wait_queue_dequeue(&mutex->wait_queue)) != NULL) { // Hand over to the first waiter
+		mutex->owner = next;
+		mutex->next_held = next->held_mutexes;
+		next->held_mutexes = mutex;
+		next->blocked_on = NULL;
+	} else {
+		mutex->owner = NULL;
+		mutex->next_held = NULL;
+	}
+	atomic_clear(&mutex->lock); // Release lock
+
+	mutex_reboost(self); // Drop whatever priority was lent for this mutex
+	if (next != NULL) {
+		mutex_reboost(next); // Inherit from whoever still waits
+		minithread_start(next);
+	}
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+	if (old_ilevel == ENABLED) {
+		minithread_resched(); // The new owner may outrank the caller
+	}
+}
+
+
+/*
+ * condvar_t condvar_create()
+ *      Allocate a new condition variable.
+ */
+condvar_t condvar_create() {
+	condvar_t cond = (condvar_t) malloc(sizeof(struct condvar));
+	if (cond == NULL) { // malloc() failed
+		fprintf(stderr, "ERROR: condvar_create() failed to malloc new condvar_t\n");
+		return NULL;
+	}
+
+	cond->lock = 0;
+	list_init(&cond->wait_queue);
+
+	return cond;
+}
+
+
+/*
+ * condvar_destroy(condvar_t cond)
+ *      Deallocate a condition variable.
+ */
+void condvar_destroy(condvar_t cond) {
+	if (cond == NULL) {
+		fprintf(stderr, "ERROR: condvar_destroy() received NULL argument cond\n");
+		return;
+	}
+	if (list_length(&cond->wait_queue) > 0) {
+		fprintf(stderr, "ERROR: condvar_destroy() received a condition variable that threads are waiting on\n");
+		return;
+	}
+
+	free(cond);
+}
+
+
+/*
+ * condvar_wait(condvar_t cond, mutex_t mutex)
+ *      Release mutex, wait to be signalled, and reacquire mutex.
+ */
+void condvar_wait(condvar_t cond, mutex_t mutex) {
+	minithread_t self;
+
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	self = minithread_self();
+	if (mutex->owner != self) {
+		set_interrupt_level(old_ilevel);
+		fprintf(stderr, "ERROR: condvar_wait() called by a thread not holding the mutex\n");
+		return;
+	}
+
+	atomic_spin_lock(&cond->lock); // Acquire lock; other processors may be using cond
+	wait_queue_append(&cond->wait_queue, self);
+	atomic_clear(&cond->lock); // Release lock
+
+	// Queued before the mutex is released, so a signal sent once it is cannot be missed. A signal
+	// on another processor may requeue us before we have switched out; the scheduler does not
+	// resume us elsewhere until our context is saved
+	mutex_unlock(mutex);
+	minithread_stop();
+
+	mutex_lock(mutex);
+	set_interrupt_level(old_ilevel); // Enable interrupts
+}
+
+
+/*
+ * condvar_signal(condvar_t cond)
+ *      Wake the first thread waiting on cond.
+ */
+void condvar_signal(condvar_t cond) {
+	minithread_t tcb;
+
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	atomic_spin_lock(&cond->lock); // Acquire lock; other processors may be using cond
+	tcb = wait_queue_dequeue(&cond->wait_queue);
+	atomic_clear(&cond->lock); // Release lock
+
+	if (tcb != NULL) {
+		minithread_start(tcb);
+	}
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+	if (old_ilevel == ENABLED && tcb != NULL) {
+		minithread_resched(); // The woken thread may outrank the caller
+	}
+}
+
+
+/*
+ * condvar_broadcast(condvar_t cond)
+ *      Wake every thread waiting on cond.
+ */
+void condvar_broadcast(condvar_t cond) {
+	minithread_t tcb;
+
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	atomic_spin_lock(&cond->lock); // Acquire lock; other processors may be using cond
+	while ((tcb = wait_queue_dequeue(&cond->wait_queue)) != NULL) {
+		minithread_start(tcb);
+	}
+	atomic_clear(&cond->lock); // Release lock
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+	if (old_ilevel == ENABLED) {
+		minithread_resched(); // A woken thread may outrank the caller
+	}
+}
+
+
+/*
+ * rwlock_t rwlock_create()
+ *      Allocate a new, unlocked reader-writer lock.
+ */
+rwlock_t rwlock_create() {
+	rwlock_t rwlock = (rwlock_t) malloc(sizeof(struct rwlock));
+	if (rwlock == NULL) { // malloc() failed
+		fprintf(stderr, "ERROR: rwlock_create() failed to malloc new rwlock_t\n");
+		return NULL;
+	}
+
+	rwlock->lock = 0;
+	rwlock->readers = 0;
+	rwlock->writer = NULL;
+	list_init(&rwlock->readers_waiting);
+	list_init(&rwlock->writers_waiting);
+
+	return rwlock;
+}
+
+
+/*
+ * rwlock_destroy(rwlock_t rwlock)
+ *      Deallocate an unlocked reader-writer lock.
+ */
+void rwlock_destroy(rwlock_t rwlock) {
+	if (rwlock == NULL) {
+		fprintf(stderr, "ERROR: rwlock_destroy() received NULL argument rwlock\n");
+		return;
+	}
+	if (rwlock->readers > 0 || rwlock->writer != NULL) {
+		fprintf(stderr, "ERROR: rwlock_destroy() received a locked rwlock\n");
+		return;
+	}
+
+	free(rwlock);
+}
+
+
+/*
+ * rwlock_read_lock(rwlock_t rwlock)
+ *      Acquire the lock for reading, waiting behind any writer holding or waiting for it.
+ */
+void rwlock_read_lock(rwlock_t rwlock) {
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	atomic_spin_lock(&rwlock->lock); // Acquire lock; other processors may be using rwlock
+	if (rwlock->writer == NULL && list_length(&rwlock->writers_waiting) == 0) { // Take it alongside other readers
+		rwlock->readers++;
+		atomic_clear(&rwlock->lock);
+	} else {
+		wait_queue_append(&rwlock->readers_waiting, minithread_self());
+		atomic_clear(&rwlock->lock); // Release lock
+		// rwlock_write_unlock counts us as a reader before waking us
+		minithread_stop();
+	}
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+}
+
+
+/*
+ * rwlock_read_unlock(rwlock_t rwlock)
+ *      Release a read hold, handing the lock to the first waiting writer if it was the last.
+ */
+void rwlock_read_unlock(rwlock_t rwlock) {
+	minithread_t next = NULL;
+
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	atomic_spin_lock(&rwlock->lock); // Acquire lock; other processors may be using rwlock
+	if (rwlock->readers <= 0) {
+		atomic_clear(&rwlock->lock);
+		set_interrupt_level(old_ilevel);
+		fprintf(stderr, "ERROR: rwlock_read_unlock() called on a rwlock not held for reading\n");
+		return;
+	}
+
+	if (--(rwlock->readers) == 0 && (next = wait_queue_dequeue(&rwlock->writers_waiting)) != NULL) {
+		rwlock->writer = next;
+	}
+	atomic_clear(&rwlock->lock); // Release lock
+
+	if (next != NULL) {
+		minithread_start(next);
+	}
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+	if (old_ilevel == ENABLED && next != NULL) {
+		minithread_resched(); // The writer may outrank the caller
+	}
+}
+
+
+/*
+ * rwlock_write_lock(rwlock_t rwlock)
+ *      Acquire the lock for writing.
+ */
+void rwlock_write_lock(rwlock_t rwlock) {
+	minithread_t self;
+
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	self = minithread_self();
+	atomic_spin_lock(&rwlock->lock); // Acquire lock; other processors may be using rwlock
+	if (rwlock->writer == NULL && rwlock->readers == 0) { // Free; take it
+		rwlock->writer = self;
+		atomic_clear(&rwlock->lock);
+	} else {
+		wait_queue_append(&rwlock->writers_waiting, self);
+		atomic_clear(&rwlock->lock); // Release lock
+		// The last holder makes us the writer before waking us
+		minithread_stop();
+	}
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+}
+
+
+/*
+ * rwlock_write_unlock(rwlock_t rwlock)
+ *      Release a write hold, handing the lock to all waiting readers or else to the first waiting writer.
+ */
+void rwlock_write_unlock(rwlock_t rwlock) {
+	minithread_t tcb;
+
+	interrupt_level_t old_ilevel = set_interrupt_level((interrupt_level_t) DISABLED); // Disable interrupts
+
+	atomic_spin_lock(&rwlock->lock); // Acquire lock; other processors may be using rwlock
+	if (rwlock->writer != minithread_self()) {
+		atomic_clear(&rwlock->lock);
+		set_interrupt_level(old_ilevel);
+		fprintf(stderr, "ERROR: rwlock_write_unlock() called by a thread not holding the rwlock\n");
+		return;
+	}
+
+	// Readers that queued during the write go next, so a stream of writers cannot starve them
+	rwlock->writer = NULL;
+	if (list_length(&rwlock->readers_waiting) > 0) {
+		while ((tcb = wait_queue_dequeue(&rwlock->readers_waiting)) != NULL) {
+			rwlock->readers++;
+			minithread_start(tcb);
+		}
+	} else if ((tcb = wait_queue_dequeue(&rwlock->writers_waiting)) != NULL) {
+		rwlock->writer = tcb;
+		minithread_start(tcb);
+	}
+	atomic_clear(&rwlock->lock); // Release lock
+
+	set_interrupt_level(old_ilevel); // Enable interrupts
+	if (old_ilevel == ENABLED) {
+		minithread_resched(); // A woken thread may outrank the caller
+	}
 }
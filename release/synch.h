@@ -10,6 +10,30 @@
 #include "queue.h"
 #include "defs.h"
 
+struct minithread;
+
+/*
+ * FIFO of threads waiting for one of the primitives below, linked through their own
+ * wait_node so that blocking and waking never allocate. A thread waits for
+ * one thing at a time.
+ */
+typedef list_t wait_queue_t;
+
+/*
+ * Contention statistics kept for a semaphore when SYNCH_PROFILE is set.
+ */
+typedef struct semaphore_profile semaphore_profile_t;
+struct semaphore_profile {
+	unsigned long acquisitions;		//Completed Ps
+	unsigned long contended;		//Completed Ps that had to wait, including those that timed out
+	unsigned long timeouts;			//Ps given up by semaphore_P_timeout
+	unsigned long long total_wait;	//Time [ns] spent waiting by all Ps
+	unsigned long long max_wait;	//Longest single wait [ns]
+	int max_waiter;					//Id of the thread that waited max_wait
+	struct semaphore* prev;			//Links all semaphores not yet destroyed
+	struct semaphore* next;
+};
+
 /*
  * Semaphores.
  */
@@ -17,7 +41,9 @@ typedef struct semaphore *semaphore_t;
 struct semaphore {
 	tas_lock_t lock;
 	int count;
-	queue_t wait_queue;			//Wait queue for threads requesting this semaphore
+	wait_queue_t wait_queue;	//Wait queue for threads requesting this semaphore
+	const char* name;			//Name for synch_profile_dump, or NULL
+	semaphore_profile_t* profile;	//Contention statistics, or NULL unless SYNCH_PROFILE is set
 };
 
 /* SEMAPHORE METHODS */
@@ -28,6 +54,13 @@ struct semaphore {
  */
 extern semaphore_t semaphore_create();
 
+/*
+ * semaphore_t semaphore_create_named(const char* name)
+ *  Allocate a new semaphore that synch_profile_dump lists as name. The
+ *  string is not copied, so it must outlive the semaphore.
+ */
+extern semaphore_t semaphore_create_named(const char* name);
+
 /*
  * semaphore_destroy(semaphore_t sem);
  *  Deallocate a semaphore.
@@ -48,11 +81,171 @@ extern void semaphore_initialize(semaphore_t sem, int cnt);
  */
 extern void semaphore_P(semaphore_t sem);
 
+/*
+ * int semaphore_P_timeout(semaphore_t sem, int delay)
+ *  P on the semaphore, giving up if it cannot be completed within delay
+ *  milliseconds (at once, if delay is 0). Returns 0 if the P completed, or 1
+ *  if it timed out, in which case the count is left as it was.
+ */
+extern int semaphore_P_timeout(semaphore_t sem, int delay);
+
 /*
  * semaphore_V(semaphore_t sem)
  *  V on the semaphore.
  */
 extern void semaphore_V(semaphore_t sem);
 
+/*
+ * synch_profile_dump()
+ *  Print the contention statistics of the most contended semaphores, those
+ *  that threads spent the longest waiting for first, to stdout. Statistics
+ *  are only kept if SYNCH_PROFILE is set in defs.h.
+ */
+extern void synch_profile_dump();
+
+
+/*
+ * Mutexes. Unlike a semaphore, a mutex knows which thread holds it. While
+ * threads wait for it, the holder runs at the level of the highest priority
+ * waiter if that is higher than its own (priority inheritance), so a low
+ * priority holder cannot keep high priority threads waiting behind the
+ * threads in between. The mutex is handed directly to the next waiter. A
+ * thread that finds the mutex held by a thread running on another processor
+ * spins for a while before blocking, since the holder is likely to release it
+ * sooner than a context switch would take.
+ */
+typedef struct mutex *mutex_t;
+struct mutex {
+	tas_lock_t lock;
+	struct minithread* owner;	//Thread holding the mutex, or NULL
+	wait_queue_t wait_queue;	//Wait queue for threads requesting this mutex
+	mutex_t next_held;			//Next mutex held by the same owner
+};
+
+/* MUTEX METHODS */
+
+/*
+ * mutex_t mutex_create()
+ *  Allocate a new, unlocked mutex.
+ */
+extern mutex_t mutex_create();
+
+/*
+ * mutex_destroy(mutex_t mutex)
+ *  Deallocate an unlocked mutex.
+ */
+extern void mutex_destroy(mutex_t mutex);
+
+/*
+ * mutex_lock(mutex_t mutex)
+ *  Acquire the mutex, waiting for it if another thread holds it.
+ */
+extern void mutex_lock(mutex_t mutex);
+
+/*
+ * mutex_unlock(mutex_t mutex)
+ *  Release the mutex, which the calling thread must hold.
+ */
+extern void mutex_unlock(mutex_t mutex);
+
+
+/*
+ * Condition variables, used with a mutex that guards the condition.
+ */
+typedef struct condvar *condvar_t;
+struct condvar {
+	tas_lock_t lock;
+	wait_queue_t wait_queue;	//Wait queue for threads waiting for the condition
+};
+
+/* CONDITION VARIABLE METHODS */
+
+/*
+ * condvar_t condvar_create()
+ *  Allocate a new condition variable.
+ */
+extern condvar_t condvar_create();
+
+/*
+ * condvar_destroy(condvar_t cond)
+ *  Deallocate a condition variable no thread is waiting on.
+ */
+extern void condvar_destroy(condvar_t cond);
+
+/*
+ * condvar_wait(condvar_t cond, mutex_t mutex)
+ *  Release mutex, which the calling thread must hold, and wait to be
+ *  signalled; reacquire mutex before returning. Waking does not mean the
+ *  condition holds, so callers wait in a loop that rechecks it.
+ */
+extern void condvar_wait(condvar_t cond, mutex_t mutex);
+
+/*
+ * condvar_signal(condvar_t cond)
+ *  Wake the thread that has waited longest on cond, if any.
+ */
+extern void condvar_signal(condvar_t cond);
+
+/*
+ * condvar_broadcast(condvar_t cond)
+ *  Wake every thread waiting on cond.
+ */
+extern void condvar_broadcast(condvar_t cond);
+
+
+/*
+ * Reader-writer locks. Any number of readers may hold the lock at once, or a
+ * single writer. A reader arriving while a writer waits queues behind it, and
+ * readers that queued during a write all get the lock when it ends, so
+ * neither side starves the other. Like the mutex, the lock is handed directly
+ * to the threads it wakes.
+ */
+typedef struct rwlock *rwlock_t;
+struct rwlock {
+	tas_lock_t lock;
+	int readers;					//Number of threads holding the lock for reading
+	struct minithread* writer;		//Thread holding the lock for writing, or NULL
+	wait_queue_t readers_waiting;	//Threads waiting to read
+	wait_queue_t writers_waiting;	//Threads waiting to write
+};
+
+/* READER-WRITER LOCK METHODS */
+
+/*
+ * rwlock_t rwlock_create()
+ *  Allocate a new, unlocked reader-writer lock.
+ */
+extern rwlock_t rwlock_create();
+
+/*
+ * rwlock_destroy(rwlock_t rwlock)
+ *  Deallocate an unlocked reader-writer lock.
+ */
+extern void rwlock_destroy(rwlock_t rwlock);
+
+/*
+ * rwlock_read_lock(rwlock_t rwlock)
+ *  Acquire the lock for reading.
+ */
+extern void rwlock_read_lock(rwlock_t rwlock);
+
+/*
+ * rwlock_read_unlock(rwlock_t rwlock)
+ *  Release the lock, which the calling thread holds for reading.
+ */
+extern void rwlock_read_unlock(rwlock_t rwlock);
+
+/*
+ * rwlock_write_lock(rwlock_t rwlock)
+ *  Acquire the lock for writing.
+ */
+extern void rwlock_write_lock(rwlock_t rwlock);
+
+/*
+ * rwlock_write_unlock(rwlock_t rwlock)
+ *  Release the lock, which the calling thread must hold for writing.
+ */
+extern void rwlock_write_unlock(rwlock_t rwlock);
+
 
 #endif /*__SYNCH_H__*/
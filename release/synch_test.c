@@ -0,0 +1,367 @@
+/* synch_test.c
+
+   Test the synchronization primitives: semaphore_P_timeout giving up, racing
+   a V, and mixing with plain Vs from another thread; condition variables
+   guarding a bounded buffer and waking every waiter on a broadcast; and
+   reader-writer locks shared by readers, exclusive for writers, and fair to
+   a waiting writer.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "minithread.h"
+#include "synch.h"
+#include "alarm.h"
+
+
+#define RACES 200
+#define WAITERS 8
+#define WAITS 300
+#define VS 1500
+#define PAIRS 4
+#define ITEMS 5000
+#define CAPACITY 4
+#define SLEEPERS 6
+#define READERS 8
+#define READS 5000
+
+semaphore_t sem;
+semaphore_t done;
+int got = 0;
+int timeouts = 0;
+
+mutex_t mutex;
+condvar_t not_empty;
+condvar_t not_full;
+int buffered = 0;
+int produced = 0;
+int consumed = 0;
+int overflows = 0;
+int go = 0;
+int awake = 0;
+
+rwlock_t rwlock;
+int readers_inside = 0;
+int writers_inside = 0;
+int most_readers = 0;
+int conflicts = 0;
+int writes = 0;
+char order[4];
+int order_length = 0;
+
+
+/* Alarm handler doing a V. */
+void v_later(void* arg) {
+  semaphore_V((semaphore_t) arg);
+}
+
+int timed_waiter(int* arg) {
+  int i;
+
+  for (i = 0; i < WAITS; i++) {
+    if (semaphore_P_timeout(sem, 1 + i % 3) == 0) {
+      __sync_fetch_and_add(&got, 1);
+    } else {
+      __sync_fetch_and_add(&timeouts, 1);
+    }
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int v_thread(int* arg) {
+  int i;
+
+  for (i = 0; i < VS; i++) {
+    semaphore_V(sem);
+    if (i % 7 == 0) {
+      minithread_sleep_with_timeout(1);
+    } else {
+      minithread_yield();
+    }
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int producer(int* arg) {
+  int i;
+
+  for (i = 0; i < ITEMS; i++) {
+    mutex_lock(mutex);
+    while (buffered == CAPACITY) {
+      condvar_wait(not_full, mutex);
+    }
+    if (++buffered > CAPACITY) overflows++;
+    produced++;
+    condvar_signal(not_empty);
+    mutex_unlock(mutex);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int consumer(int* arg) {
+  int i;
+
+  for (i = 0; i < ITEMS; i++) {
+    mutex_lock(mutex);
+    while (buffered == 0) {
+      condvar_wait(not_empty, mutex);
+    }
+    if (--buffered < 0) overflows++;
+    consumed++;
+    condvar_broadcast(not_full);
+    mutex_unlock(mutex);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int sleeper(int* arg) {
+  mutex_lock(mutex);
+  while (!go) {
+    condvar_wait(not_empty, mutex);
+  }
+  awake++;
+  mutex_unlock(mutex);
+  semaphore_V(done);
+  return 0;
+}
+
+int reader(int* arg) {
+  int i, inside;
+
+  for (i = 0; i < READS; i++) {
+    rwlock_read_lock(rwlock);
+    inside = __sync_add_and_fetch(&readers_inside, 1);
+    if (inside > most_readers) most_readers = inside;
+    if (writers_inside) conflicts++;
+    if (i % 97 == 0) minithread_yield(); // Let other readers in alongside
+    __sync_sub_and_fetch(&readers_inside, 1);
+    rwlock_read_unlock(rwlock);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int writer(int* arg) {
+  int i;
+
+  for (i = 0; i < READS / 4; i++) {
+    rwlock_write_lock(rwlock);
+    if (__sync_add_and_fetch(&writers_inside, 1) != 1 || readers_inside) conflicts++;
+    writes++;
+    if (i % 31 == 0) minithread_yield(); // Nobody may get in meanwhile
+    __sync_sub_and_fetch(&writers_inside, 1);
+    rwlock_write_unlock(rwlock);
+  }
+  semaphore_V(done);
+  return 0;
+}
+
+int ordered_writer(int* arg) {
+  rwlock_write_lock(rwlock);
+  order[order_length++] = 'w';
+  rwlock_write_unlock(rwlock);
+  semaphore_V(done);
+  return 0;
+}
+
+int ordered_reader(int* arg) {
+  rwlock_read_lock(rwlock);
+  order[order_length++] = 'r';
+  rwlock_read_unlock(rwlock);
+  semaphore_V(done);
+  return 0;
+}
+
+/* A P that times out gives up after its delay, and leaves the count as it was. */
+int timeout_test() {
+  unsigned long long start;
+
+  sem = semaphore_create();
+  semaphore_initialize(sem, 0);
+
+  start = minithread_clock_now();
+  if (semaphore_P_timeout(sem, 30) != 1) return 0;
+  if (minithread_clock_now() - start < 30 * MILLISECOND) return 0;
+  if (semaphore_P_timeout(sem, 0) != 1) return 0;
+
+  semaphore_V(sem);
+  if (semaphore_P_timeout(sem, 0) != 0) return 0;
+  if (semaphore_P_timeout(sem, 0) != 1) return 0;
+
+  semaphore_destroy(sem);
+  return 1;
+}
+
+/* A V due just before, with, or just after the timeout is either taken by the P or left on the count, never lost or doubled. */
+int timeout_race_test() {
+  int i, timed_out, left, taken = 0;
+
+  sem = semaphore_create();
+  semaphore_initialize(sem, 0);
+
+  for (i = 0; i < RACES; i++) {
+    register_alarm(2 + i % 3, v_later, sem);
+    timed_out = semaphore_P_timeout(sem, 3);
+    minithread_sleep_with_timeout(6); // Let the V go off, if it has not yet
+    left = (semaphore_P_timeout(sem, 0) == 0);
+    if (left != timed_out) return 0;
+    if (semaphore_P_timeout(sem, 0) != 1) return 0;
+    taken += !timed_out;
+  }
+  printf("V taken by the P %d times, left after a timeout %d times\n", taken, RACES - taken);
+
+  semaphore_destroy(sem);
+  return 1;
+}
+
+/* Every V is taken by exactly one P, with waiters timing out all along. */
+int timeout_mix_test() {
+  int i, left = 0;
+
+  sem = semaphore_create();
+  semaphore_initialize(sem, 0);
+
+  for (i = 0; i < WAITERS; i++) {
+    minithread_fork(timed_waiter, NULL);
+  }
+  minithread_fork(v_thread, NULL);
+  for (i = 0; i <= WAITERS; i++) {
+    semaphore_P(done);
+  }
+  while (semaphore_P_timeout(sem, 0) == 0) {
+    left++;
+  }
+
+  semaphore_destroy(sem);
+  return got + left == VS && got + timeouts == WAITERS * WAITS;
+}
+
+/* Producers and consumers share a bounded buffer under a mutex, waiting on condition variables for room and items. */
+int condvar_test() {
+  int i;
+
+  mutex = mutex_create();
+  not_empty = condvar_create();
+  not_full = condvar_create();
+
+  for (i = 0; i < PAIRS; i++) {
+    minithread_fork(producer, NULL);
+    minithread_fork(consumer, NULL);
+  }
+  for (i = 0; i < 2 * PAIRS; i++) {
+    semaphore_P(done);
+  }
+  if (produced != PAIRS * ITEMS || consumed != PAIRS * ITEMS || buffered != 0 || overflows != 0) return 0;
+
+  // A broadcast wakes every waiter, a signal only one
+  for (i = 0; i < SLEEPERS; i++) {
+    minithread_fork(sleeper, NULL);
+  }
+  for (i = 0; i < 10; i++) {
+    minithread_yield();
+  }
+  mutex_lock(mutex);
+  go = 1;
+  condvar_signal(not_empty);
+  mutex_unlock(mutex);
+  semaphore_P(done);
+  if (semaphore_P_timeout(done, 20) != 1 || awake != 1) return 0;
+  mutex_lock(mutex);
+  condvar_broadcast(not_empty);
+  mutex_unlock(mutex);
+  for (i = 1; i < SLEEPERS; i++) {
+    semaphore_P(done);
+  }
+  if (awake != SLEEPERS) return 0;
+
+  condvar_destroy(not_empty);
+  condvar_destroy(not_full);
+  mutex_destroy(mutex);
+  return 1;
+}
+
+/* Readers share the lock and writers have it to themselves; a reader arriving while a writer waits goes after it. */
+int rwlock_test() {
+  int i;
+
+  rwlock = rwlock_create();
+
+  for (i = 0; i < READERS; i++) {
+    minithread_fork(reader, NULL);
+  }
+  for (i = 0; i < 2; i++) {
+    minithread_fork(writer, NULL);
+  }
+  for (i = 0; i < READERS + 2; i++) {
+    semaphore_P(done);
+  }
+  printf("at most %d readers at once\n", most_readers);
+  if (conflicts != 0 || writes != 2 * (READS / 4) || most_readers < 2) return 0;
+
+  // Hold the lock for reading while a writer and then another reader arrive
+  rwlock_read_lock(rwlock);
+  minithread_fork(ordered_writer, NULL);
+  for (i = 0; i < 10; i++) {
+    minithread_yield();
+  }
+  minithread_fork(ordered_reader, NULL);
+  for (i = 0; i < 10; i++) {
+    minithread_yield();
+  }
+  if (order_length != 0) return 0;
+  rwlock_read_unlock(rwlock);
+  semaphore_P(done);
+  semaphore_P(done);
+  if (order_length != 2 || order[0] != 'w' || order[1] != 'r') return 0;
+
+  rwlock_destroy(rwlock);
+  return 1;
+}
+
+
+int run_tests(int* arg) {
+  if (timeout_test()) {
+    printf("Timeout success!!!\n");
+  } else {
+    printf("Timeout failure...\n");
+  }
+
+  if (timeout_race_test()) {
+    printf("Timeout race success!!!\n");
+  } else {
+    printf("Timeout race failure...\n");
+  }
+
+  if (timeout_mix_test()) {
+    printf("Timeout mix success!!!\n");
+  } else {
+    printf("Timeout mix failure...\n");
+  }
+
+  if (condvar_test()) {
+    printf("Condvar success!!!\n");
+  } else {
+    printf("Condvar failure...\n");
+  }
+
+  if (rwlock_test()) {
+    printf("Rwlock success!!!\n");
+  } else {
+    printf("Rwlock failure...\n");
+  }
+
+  exit(0);
+  return 0;
+}
+
+int main(void) {
+  done = semaphore_create();
+  semaphore_initialize(done, 0);
+  minithread_system_initialize(run_tests, NULL);
+  return 0;
+}